@@ -0,0 +1,902 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <inttypes.h>
+
+#include "err.h"
+#include "utilities.h"
+
+#define MAX_CONNECTIONS  1024
+#define DURATION_SECONDS 10
+#define RANGE_SIZE       4096
+#define ZIPF_EXPONENT    0.99
+
+// latencies are kept in buckets 1/16 of a power of two wide, so percentiles
+// are exact to about 6%
+#define SUB_BUCKET_BITS  4
+#define SUB_BUCKETS      (1 << SUB_BUCKET_BITS)
+#define BUCKETS          ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+#define USAGE "Usage: %s [--connections <n>] [--duration <seconds>] [--warmup <seconds>] " \
+              "[--list-percent <p>] [--range-size <bytes>[-<bytes>]] " \
+              "[--popularity uniform|zipf] [--zipf-exponent <s>] [--files <n>] " \
+              "[--wide] [--seed <n>] [--json <file>] " \
+              "<server-name-or-ip4-address> [<port-number>]"
+
+enum request_kind {
+    KIND_RANGE,
+    KIND_LIST,
+    KINDS
+};
+
+static const char* kind_names[KINDS] = {"range", "list"};
+
+struct histogram {
+    uint64_t counts[BUCKETS];
+    uint64_t num;
+    uint64_t sum;                // of latencies in ns
+    uint64_t max;
+};
+
+struct file {
+    char* name;
+    uint64_t size;               // 0 if it cannot be requested
+};
+
+// one connection sending a request after another
+struct worker {
+    int id;
+    pthread_t thread;
+    int sock;
+    uint64_t rng;
+    char* buffer;                // for received data, dropped
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t refused;
+    uint64_t errors;
+    struct histogram latency[KINDS];
+};
+
+static struct {
+    struct addrinfo* addr;
+    char* server;
+    char* port;
+    bool wide;
+    long connections;
+    double duration;
+    double warmup;
+    long list_percent;
+    uint64_t range_min;
+    uint64_t range_max;
+    bool zipf;
+    double zipf_exponent;
+    long files_limit;            // 0 for all files on the list
+    uint64_t seed;
+
+    char* list;                  // names point into it
+    struct file* files;
+    size_t files_num;
+    size_t* ranked;              // non-empty files, the most popular first
+    double* cdf;                 // of popularity of ranked files
+    size_t ranked_num;
+
+    pthread_barrier_t barrier;   // workers wait for sizes and for the start
+    uint64_t measure_start;      // in ns of CLOCK_MONOTONIC
+    uint64_t end;
+} bench = {
+    .connections = 8,
+    .duration = DURATION_SECONDS,
+    .range_min = RANGE_SIZE,
+    .range_max = RANGE_SIZE,
+    .zipf_exponent = ZIPF_EXPONENT,
+    .seed = 1
+};
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*; good enough for choosing files and offsets
+uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// uniform in [0, 1)
+double random_fraction(uint64_t* state) {
+    return (next_random(state) >> 11) * 0x1.0p-53;
+}
+
+// uniform in [low, high]
+uint64_t random_between(uint64_t* state, uint64_t low, uint64_t high) {
+    if (high - low == UINT64_MAX)
+        return next_random(state);
+
+    return low + next_random(state) % (high - low + 1);
+}
+
+int bucket_of(uint64_t value) {
+    if (value < SUB_BUCKETS)
+        return value;
+
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// middle of the values falling into bucket
+double bucket_value(int bucket) {
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    uint64_t width = 1ULL << (exponent - SUB_BUCKET_BITS);
+
+    return (SUB_BUCKETS + bucket % SUB_BUCKETS) * (double) width + width / 2.0;
+}
+
+void histogram_add(struct histogram* histogram, uint64_t value) {
+    ++histogram->counts[bucket_of(value)];
+    ++histogram->num;
+    histogram->sum += value;
+
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+void histogram_merge(struct histogram* into, struct histogram* from) {
+    for (int i = 0; i < BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+
+    into->num += from->num;
+    into->sum += from->sum;
+
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+// latency in ns below which the fraction q of requests finished
+double histogram_quantile(struct histogram* histogram, double q) {
+    uint64_t rank = ceil(q * histogram->num);
+    uint64_t seen = 0;
+
+    if (rank == 0)
+        rank = 1;
+
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += histogram->counts[i];
+
+        if (seen >= rank)
+            return bucket_value(i) < histogram->max ? bucket_value(i) : histogram->max;
+    }
+
+    return histogram->max;
+}
+
+// asks the server for the wide protocol version; returns -1 on error or if
+// the server does not speak it
+int negotiate_wide(int sock) {
+    uint16_t request[2] = {htons(4), htons(PROTOCOL_WIDE)};
+    struct response_info r_info;
+
+    if (safe_write(sock, request, sizeof(request), "server") < 0
+        || safe_read(sock, &r_info, sizeof(struct response_info), "server") < 0)
+        return -1;
+
+    if (ntohs(r_info.msg_start) != 4 || ntohl(r_info.second_param) != PROTOCOL_WIDE) {
+        fprintf(stderr, "server does not speak the wide protocol version\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int connect_to_server(void) {
+    int sock = socket(bench.addr->ai_family, bench.addr->ai_socktype, bench.addr->ai_protocol);
+
+    if (sock < 0) {
+        syserr_noexit("socket");
+        return -1;
+    }
+
+    if (connect(sock, bench.addr->ai_addr, bench.addr->ai_addrlen) < 0) {
+        syserr_noexit("connect");
+        close(sock);
+        return -1;
+    }
+
+    if (bench.wide && negotiate_wide(sock) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// reads and drops len bytes of a response
+int drain(int sock, char* buffer, uint64_t len) {
+    while (len > 0) {
+        size_t chunk_size = len < MAX_CHUNK_SIZE ? len : MAX_CHUNK_SIZE;
+
+        if (safe_read(sock, buffer, chunk_size, "server") < 0)
+            return -1;
+
+        len -= chunk_size;
+    }
+
+    return 0;
+}
+
+// sends a file list request and reads the response; the list is stored in
+// *list if list is not NULL, dropped otherwise. Returns -1 on error
+int request_list(int sock, char* buffer, char** list, uint64_t* len) {
+    uint16_t request_type = htons(1);
+    uint16_t msg_start;
+
+    if (safe_write(sock, &request_type, sizeof(uint16_t), "server") < 0)
+        return -1;
+
+    if (bench.wide) {
+        struct fl_info64 info;
+
+        if (safe_read(sock, &info, sizeof(struct fl_info64), "server") < 0)
+            return -1;
+
+        msg_start = ntohs(info.msg_start);
+        *len = be64toh(info.fl_len);
+    } else {
+        struct fl_info info;
+
+        if (safe_read(sock, &info, sizeof(struct fl_info), "server") < 0)
+            return -1;
+
+        msg_start = ntohs(info.msg_start);
+        *len = ntohl(info.fl_len);
+    }
+
+    if (msg_start != 1) {
+        fprintf(stderr, "invalid response from server\n");
+        return -1;
+    }
+
+    if (!list)
+        return drain(sock, buffer, *len);
+
+    *list = malloc(*len + 1);
+
+    if (!*list) {
+        fprintf(stderr, "malloc for file list failed\n");
+        return -1;
+    }
+
+    if (safe_read(sock, *list, *len, "server") < 0) {
+        free(*list);
+        return -1;
+    }
+
+    (*list)[*len] = '\0';
+    return 0;
+}
+
+// asks for len bytes of file name starting at begin and reads the response;
+// *received is set to the length of the body, 0 if the request was refused.
+// Returns -1 on error
+int request_range(int sock, char* buffer, char* name, uint64_t begin, uint64_t len,
+                  uint64_t* received) {
+    uint16_t name_len = strlen(name);
+    uint16_t request_type = htons(2);
+    char request[sizeof(uint16_t) + sizeof(struct f_req_params64) + MAX_PATH_LEN];
+    size_t size = sizeof(uint16_t);
+    uint16_t msg_start;
+    uint64_t second_param;
+
+    memcpy(request, &request_type, sizeof(uint16_t));
+
+    if (bench.wide) {
+        struct f_req_params64 params = {htobe64(begin), htobe64(len), htons(name_len)};
+
+        memcpy(request + size, &params, sizeof(params));
+        size += sizeof(params);
+    } else {
+        struct f_req_params params = {htonl(begin), htonl(len), htons(name_len)};
+
+        memcpy(request + size, &params, sizeof(params));
+        size += sizeof(params);
+    }
+
+    memcpy(request + size, name, name_len);
+    size += name_len;
+
+    if (safe_write(sock, request, size, "server") < 0)
+        return -1;
+
+    if (bench.wide) {
+        struct response_info64 r_info;
+
+        if (safe_read(sock, &r_info, sizeof(struct response_info64), "server") < 0)
+            return -1;
+
+        msg_start = ntohs(r_info.msg_start);
+        second_param = be64toh(r_info.second_param);
+    } else {
+        struct response_info r_info;
+
+        if (safe_read(sock, &r_info, sizeof(struct response_info), "server") < 0)
+            return -1;
+
+        msg_start = ntohs(r_info.msg_start);
+        second_param = ntohl(r_info.second_param);
+    }
+
+    *received = 0;
+
+    if (msg_start == 2)
+        return 0;
+
+    if (msg_start != 3 || second_param > len) {
+        fprintf(stderr, "invalid response from server\n");
+        return -1;
+    }
+
+    *received = second_param;
+    return drain(sock, buffer, second_param);
+}
+
+// whether byte at offset of file name exists, by asking for it
+int byte_exists(struct worker* worker, char* name, uint64_t offset, bool* exists) {
+    uint64_t received;
+
+    if (request_range(worker->sock, worker->buffer, name, offset, 1, &received) < 0)
+        return -1;
+
+    *exists = received == 1;
+    return 0;
+}
+
+// finds the size of file by asking for single bytes at growing offsets until
+// one is refused, then bisecting; the list does not tell sizes. Files too big
+// for the classic version are used up to its largest offset
+int probe_size(struct worker* worker, struct file* file) {
+    uint64_t limit = bench.wide ? UINT64_MAX / 2 : UINT32_MAX;
+    uint64_t present = 0;            // offset known to exist
+    uint64_t missing = 1;            // offset known not to, once checked
+    bool exists;
+
+    file->size = 0;
+
+    if (byte_exists(worker, file->name, 0, &exists) < 0)
+        return -1;
+
+    if (!exists)
+        return 0;
+
+    while (true) {
+        if (byte_exists(worker, file->name, missing, &exists) < 0)
+            return -1;
+
+        if (!exists)
+            break;
+
+        present = missing;
+
+        if (missing >= limit) {
+            file->size = limit;
+            return 0;
+        }
+
+        missing = missing * 2 < limit ? missing * 2 : limit;
+    }
+
+    while (missing - present > 1) {
+        uint64_t middle = present + (missing - present) / 2;
+
+        if (byte_exists(worker, file->name, middle, &exists) < 0)
+            return -1;
+
+        if (exists)
+            present = middle;
+        else
+            missing = middle;
+    }
+
+    file->size = present + 1;
+    return 0;
+}
+
+struct file* choose_file(struct worker* worker) {
+    size_t rank;
+
+    if (bench.zipf) {
+        double u = random_fraction(&worker->rng);
+        size_t low = 0;
+        size_t high = bench.ranked_num - 1;
+
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+
+            if (bench.cdf[middle] > u)
+                high = middle;
+            else
+                low = middle + 1;
+        }
+
+        rank = low;
+    } else {
+        rank = next_random(&worker->rng) % bench.ranked_num;
+    }
+
+    return &bench.files[bench.ranked[rank]];
+}
+
+// sends one request of the configured mix; returns -1 on error
+int send_request(struct worker* worker, enum request_kind* kind, uint64_t* received,
+                 bool* refused) {
+    *refused = false;
+
+    if ((long) random_between(&worker->rng, 1, 100) <= bench.list_percent) {
+        *kind = KIND_LIST;
+        return request_list(worker->sock, worker->buffer, NULL, received);
+    }
+
+    struct file* file = choose_file(worker);
+    uint64_t len = random_between(&worker->rng, bench.range_min, bench.range_max);
+
+    if (len > file->size)
+        len = file->size;
+
+    uint64_t begin = random_between(&worker->rng, 0, file->size - len);
+
+    *kind = KIND_RANGE;
+
+    if (request_range(worker->sock, worker->buffer, file->name, begin, len, received) < 0)
+        return -1;
+
+    // the file has been cut or removed since its size was found
+    *refused = *received == 0;
+    return 0;
+}
+
+// sends requests until the end of the run, reconnecting after errors
+void run_requests(struct worker* worker) {
+    while (worker->sock >= 0) {
+        uint64_t start = now_ns();
+
+        if (start >= bench.end)
+            break;
+
+        enum request_kind kind;
+        uint64_t received;
+        bool refused;
+        int ret = send_request(worker, &kind, &received, &refused);
+        uint64_t finish = now_ns();
+
+        // only requests started after the warmup count
+        bool measured = start >= bench.measure_start;
+
+        if (ret < 0) {
+            if (measured)
+                ++worker->errors;
+
+            close(worker->sock);
+            worker->sock = connect_to_server();
+            continue;
+        }
+
+        if (!measured)
+            continue;
+
+        ++worker->requests;
+        worker->bytes += received;
+        worker->refused += refused;
+        histogram_add(&worker->latency[kind], finish - start);
+    }
+}
+
+void* run_worker(void* arg) {
+    struct worker* worker = arg;
+
+    worker->sock = connect_to_server();
+
+    // files are shared out between connections for finding their sizes
+    for (size_t i = worker->id; worker->sock >= 0 && i < bench.files_num;
+         i += bench.connections) {
+        if (probe_size(worker, &bench.files[i]) < 0) {
+            close(worker->sock);
+            worker->sock = -1;
+        }
+    }
+
+    if (worker->sock < 0)
+        ++worker->errors;
+
+    pthread_barrier_wait(&bench.barrier);  // sizes known
+    pthread_barrier_wait(&bench.barrier);  // start set
+
+    run_requests(worker);
+
+    if (worker->sock >= 0)
+        close(worker->sock);
+
+    return NULL;
+}
+
+// fetches the file list and splits it into bench.files
+int load_file_list(void) {
+    int sock = connect_to_server();
+    uint64_t len;
+
+    if (sock < 0)
+        return -1;
+
+    if (request_list(sock, NULL, &bench.list, &len) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    close(sock);
+
+    size_t count = len > 0 ? 1 : 0;
+
+    for (uint64_t i = 0; i < len; i++)
+        count += bench.list[i] == '|';
+
+    if (bench.files_limit > 0 && count > (size_t) bench.files_limit)
+        count = bench.files_limit;
+
+    bench.files = calloc(count > 0 ? count : 1, sizeof(struct file));
+
+    if (!bench.files) {
+        fprintf(stderr, "malloc for files failed\n");
+        return -1;
+    }
+
+    char* name = bench.list;
+
+    for (size_t i = 0; i < count; i++) {
+        char* end = strchr(name, '|');
+
+        if (end)
+            *end = '\0';
+
+        bench.files[i].name = name;
+        name = end ? end + 1 : name + strlen(name);
+    }
+
+    bench.files_num = count;
+    return 0;
+}
+
+// orders non-empty files by popularity, shuffled so that it does not follow
+// the order of the list, and prepares the zipfian distribution over them
+int rank_files(void) {
+    uint64_t rng = bench.seed;
+
+    bench.ranked = malloc((bench.files_num + 1) * sizeof(size_t));
+    bench.cdf = malloc((bench.files_num + 1) * sizeof(double));
+
+    if (!bench.ranked || !bench.cdf) {
+        fprintf(stderr, "malloc for file popularity failed\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < bench.files_num; i++)
+        if (bench.files[i].size > 0)
+            bench.ranked[bench.ranked_num++] = i;
+
+    for (size_t i = bench.ranked_num; i > 1; i--) {
+        size_t j = next_random(&rng) % i;
+        size_t swapped = bench.ranked[i - 1];
+
+        bench.ranked[i - 1] = bench.ranked[j];
+        bench.ranked[j] = swapped;
+    }
+
+    double total = 0;
+
+    for (size_t i = 0; i < bench.ranked_num; i++) {
+        total += 1.0 / pow(i + 1, bench.zipf_exponent);
+        bench.cdf[i] = total;
+    }
+
+    for (size_t i = 0; i < bench.ranked_num; i++)
+        bench.cdf[i] /= total;
+
+    return 0;
+}
+
+void print_latency(const char* label, struct histogram* histogram) {
+    if (histogram->num == 0)
+        return;
+
+    printf("%s latency: mean %.3f ms, p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, "
+           "max %.3f ms\n",
+           label, histogram->sum / 1e6 / histogram->num,
+           histogram_quantile(histogram, 0.5) / 1e6, histogram_quantile(histogram, 0.99) / 1e6,
+           histogram_quantile(histogram, 0.999) / 1e6, histogram->max / 1e6);
+}
+
+void write_json_latency(FILE* out, const char* label, struct histogram* histogram) {
+    fprintf(out, "  \"%s\": {\"requests\": %" PRIu64 ", \"mean\": %.1f, \"p50\": %.1f, "
+                 "\"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+            label, histogram->num,
+            histogram->num > 0 ? histogram->sum / 1e3 / histogram->num : 0.0,
+            histogram_quantile(histogram, 0.5) / 1e3, histogram_quantile(histogram, 0.9) / 1e3,
+            histogram_quantile(histogram, 0.99) / 1e3,
+            histogram_quantile(histogram, 0.999) / 1e3, histogram->max / 1e3);
+}
+
+// writes the configuration and results of the run to path as one JSON object;
+// latencies are in microseconds
+int write_json(char* const path, struct worker* total, struct histogram* latency,
+               double elapsed) {
+    FILE* out = fopen(path, "w");
+
+    if (!out) {
+        syserr_noexit("fopen %s", path);
+        return -1;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"server\": \"%s\",\n  \"port\": \"%s\",\n", bench.server, bench.port);
+    fprintf(out, "  \"connections\": %ld,\n  \"duration_s\": %.3f,\n  \"warmup_s\": %.3f,\n",
+            bench.connections, bench.duration, bench.warmup);
+    fprintf(out, "  \"list_percent\": %ld,\n  \"range_min\": %" PRIu64 ",\n"
+                 "  \"range_max\": %" PRIu64 ",\n",
+            bench.list_percent, bench.range_min, bench.range_max);
+    fprintf(out, "  \"popularity\": \"%s\",\n  \"zipf_exponent\": %.3f,\n",
+            bench.zipf ? "zipf" : "uniform", bench.zipf_exponent);
+    fprintf(out, "  \"files\": %zu,\n  \"wide\": %s,\n  \"seed\": %" PRIu64 ",\n",
+            bench.ranked_num, bench.wide ? "true" : "false", bench.seed);
+    fprintf(out, "  \"elapsed_s\": %.3f,\n  \"requests\": %" PRIu64 ",\n"
+                 "  \"refused\": %" PRIu64 ",\n  \"errors\": %" PRIu64 ",\n"
+                 "  \"bytes\": %" PRIu64 ",\n",
+            elapsed, total->requests, total->refused, total->errors, total->bytes);
+    fprintf(out, "  \"requests_per_s\": %.1f,\n  \"mb_per_s\": %.3f,\n",
+            total->requests / elapsed, total->bytes / elapsed / 1e6);
+    write_json_latency(out, "latency_us", latency);
+
+    for (int kind = 0; kind < KINDS; kind++) {
+        char label[32];
+
+        snprintf(label, sizeof(label), "%s_latency_us", kind_names[kind]);
+        fprintf(out, ",\n");
+        write_json_latency(out, label, &total->latency[kind]);
+    }
+
+    fprintf(out, "\n}\n");
+
+    if (fclose(out) != 0) {
+        syserr_noexit("fclose %s", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+double parse_seconds(char* const str) {
+    char* endptr;
+    double seconds = strtod(str, &endptr);
+
+    if (*endptr != '\0' || !(seconds >= 0) || seconds > 24 * 3600)
+        fatal("time must be between 0 and 86400 seconds");
+
+    return seconds;
+}
+
+void parse_range_size(char* const str) {
+    char* endptr;
+
+    errno = 0;
+    bench.range_min = strtoull(str, &endptr, 10);
+    bench.range_max = bench.range_min;
+
+    if (*endptr == '-')
+        bench.range_max = strtoull(endptr + 1, &endptr, 10);
+
+    if (*endptr != '\0' || errno != 0 || bench.range_min == 0
+        || bench.range_max < bench.range_min)
+        fatal("range size must be <bytes> or <min>-<max>, both positive");
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"connections", required_argument, NULL, 'n'},
+        {"duration", required_argument, NULL, 'd'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"list-percent", required_argument, NULL, 'l'},
+        {"range-size", required_argument, NULL, 'r'},
+        {"popularity", required_argument, NULL, 'p'},
+        {"zipf-exponent", required_argument, NULL, 'z'},
+        {"files", required_argument, NULL, 'f'},
+        {"wide", no_argument, NULL, 'W'},
+        {"seed", required_argument, NULL, 's'},
+        {"json", required_argument, NULL, 'j'},
+        {NULL, 0, NULL, 0}
+    };
+
+    char* json_path = NULL;
+    char* endptr;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        if (opt == 'n') {
+            bench.connections = strtol(optarg, &endptr, 10);
+
+            if (*endptr != '\0' || bench.connections < 1 || bench.connections > MAX_CONNECTIONS)
+                fatal("number of connections must be between 1 and %d", MAX_CONNECTIONS);
+        } else if (opt == 'd') {
+            bench.duration = parse_seconds(optarg);
+
+            if (bench.duration == 0)
+                fatal("duration must be positive");
+        } else if (opt == 'w') {
+            bench.warmup = parse_seconds(optarg);
+        } else if (opt == 'l') {
+            bench.list_percent = strtol(optarg, &endptr, 10);
+
+            if (*endptr != '\0' || bench.list_percent < 0 || bench.list_percent > 100)
+                fatal("list percent must be between 0 and 100");
+        } else if (opt == 'r') {
+            parse_range_size(optarg);
+        } else if (opt == 'p') {
+            if (strcmp(optarg, "zipf") == 0)
+                bench.zipf = true;
+            else if (strcmp(optarg, "uniform") != 0)
+                fatal(USAGE, argv[0]);
+        } else if (opt == 'z') {
+            bench.zipf_exponent = strtod(optarg, &endptr);
+
+            if (*endptr != '\0' || !(bench.zipf_exponent > 0) || bench.zipf_exponent > 10)
+                fatal("zipf exponent must be above 0 and at most 10");
+        } else if (opt == 'f') {
+            bench.files_limit = strtol(optarg, &endptr, 10);
+
+            if (*endptr != '\0' || bench.files_limit < 1)
+                fatal("number of files must be positive");
+        } else if (opt == 'W') {
+            bench.wide = true;
+        } else if (opt == 's') {
+            bench.seed = strtoull(optarg, &endptr, 10);
+
+            if (*endptr != '\0')
+                fatal("seed must be a number");
+        } else if (opt == 'j') {
+            json_path = optarg;
+        } else {
+            fatal(USAGE, argv[0]);
+        }
+    }
+
+    if (argc - optind < 1 || argc - optind > 2)
+        fatal(USAGE, argv[0]);
+
+    if (!bench.wide && bench.range_max > UINT32_MAX)
+        fatal("ranges over 4 GiB need --wide");
+
+    struct addrinfo addr_hints;
+    int err;
+
+    memset(&addr_hints, 0, sizeof(struct addrinfo));
+    addr_hints.ai_family = AF_INET; // IPv4
+    addr_hints.ai_socktype = SOCK_STREAM;
+    addr_hints.ai_protocol = IPPROTO_TCP;
+    bench.server = argv[optind];
+    bench.port = argc - optind == 2 ? argv[optind + 1] : "6543";
+    err = getaddrinfo(bench.server, bench.port, &addr_hints, &bench.addr);
+
+    if (err == EAI_SYSTEM)
+        syserr("getaddrinfo: %s", gai_strerror(err));
+    else if (err != 0)
+        fatal("getaddrinfo: %s", gai_strerror(err));
+
+    if (load_file_list() < 0)
+        return 1;
+
+    struct worker* workers = calloc(bench.connections, sizeof(struct worker));
+
+    if (!workers || pthread_barrier_init(&bench.barrier, NULL, bench.connections + 1) != 0)
+        fatal("cannot prepare workers");
+
+    printf("finding sizes of %zu files over %ld connection(s)...\n", bench.files_num,
+           bench.connections);
+
+    for (long i = 0; i < bench.connections; i++) {
+        workers[i].id = i;
+        // distinct, non-zero seeds for each connection
+        workers[i].rng = (bench.seed + i + 1) * 0x9E3779B97F4A7C15ULL | 1;
+        workers[i].buffer = malloc(MAX_CHUNK_SIZE);
+
+        if (!workers[i].buffer)
+            fatal("malloc for receive buffer failed");
+
+        if ((err = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) != 0) {
+            errno = err;
+            syserr("pthread_create");
+        }
+    }
+
+    pthread_barrier_wait(&bench.barrier);
+
+    int result = rank_files();
+
+    if (result == 0 && bench.list_percent < 100 && bench.ranked_num == 0) {
+        fprintf(stderr, "no files to ask for ranges of\n");
+        result = -1;
+    }
+
+    bench.measure_start = now_ns() + (uint64_t) (bench.warmup * 1e9);
+    bench.end = result < 0 ? 0 : bench.measure_start + (uint64_t) (bench.duration * 1e9);
+
+    if (result == 0)
+        printf("running for %.1f s after %.1f s of warmup...\n", bench.duration, bench.warmup);
+
+    pthread_barrier_wait(&bench.barrier);
+
+    struct worker total;
+    struct histogram latency;
+
+    memset(&total, 0, sizeof(struct worker));
+    memset(&latency, 0, sizeof(struct histogram));
+
+    for (long i = 0; i < bench.connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+
+        total.requests += workers[i].requests;
+        total.bytes += workers[i].bytes;
+        total.refused += workers[i].refused;
+        total.errors += workers[i].errors;
+
+        for (int kind = 0; kind < KINDS; kind++) {
+            histogram_merge(&total.latency[kind], &workers[i].latency[kind]);
+            histogram_merge(&latency, &workers[i].latency[kind]);
+        }
+
+        free(workers[i].buffer);
+    }
+
+    double elapsed = (now_ns() - bench.measure_start) / 1e9;
+
+    if (result == 0) {
+        printf("%" PRIu64 " requests in %.3f s over %ld connection(s): %.1f requests/s, "
+               "%.2f MB/s\n",
+               total.requests, elapsed, bench.connections, total.requests / elapsed,
+               total.bytes / elapsed / 1e6);
+        print_latency("overall", &latency);
+
+        for (int kind = 0; kind < KINDS; kind++)
+            print_latency(kind_names[kind], &total.latency[kind]);
+
+        printf("%" PRIu64 " refused, %" PRIu64 " errors\n", total.refused, total.errors);
+
+        if (json_path && write_json(json_path, &total, &latency, elapsed) < 0)
+            result = -1;
+    }
+
+    pthread_barrier_destroy(&bench.barrier);
+    free(workers);
+    free(bench.files);
+    free(bench.ranked);
+    free(bench.cdf);
+    free(bench.list);
+    freeaddrinfo(bench.addr);
+
+    return result < 0 || total.errors > 0 ? 1 : 0;
+}
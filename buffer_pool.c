@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "err.h"
+#include "utilities.h"
+#include "buffer_pool.h"
+
+#define SLAB_SIZE (2*1024*1024) // one huge page on x86-64
+#define BUFFERS_PER_SLAB (SLAB_SIZE / MAX_CHUNK_SIZE)
+#define THREAD_CACHE_MAX 8
+
+// a free buffer keeps the link to the next one in its first bytes
+struct free_buffer {
+    struct free_buffer* next;
+};
+
+struct free_list {
+    struct free_buffer* head;
+    int count;
+};
+
+static size_t memory_limit = 1024UL*1024*1024;
+
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct free_list global_free;
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static __thread struct free_list thread_free;
+
+static struct buffer_pool_stats stats;
+
+static void push(struct free_list* list, char* buffer) {
+    struct free_buffer* free_buffer = (struct free_buffer*) buffer;
+    free_buffer->next = list->head;
+    list->head = free_buffer;
+    ++list->count;
+}
+
+static char* pop(struct free_list* list) {
+    struct free_buffer* free_buffer = list->head;
+
+    if (free_buffer) {
+        list->head = free_buffer->next;
+        --list->count;
+    }
+
+    return (char*) free_buffer;
+}
+
+// gives buffers cached by an exiting thread back to the global list
+static void flush_thread_cache(void* arg) {
+    (void) arg;
+    char* buffer;
+
+    pthread_mutex_lock(&global_lock);
+    while ((buffer = pop(&thread_free)))
+        push(&global_free, buffer);
+    pthread_mutex_unlock(&global_lock);
+}
+
+static void create_thread_key(void) {
+    pthread_key_create(&thread_key, flush_thread_cache);
+}
+
+// maps a new slab and puts its buffers on the global list; global_lock must be held
+static int add_slab(void) {
+    if (memory_limit != 0 && stats.slab_bytes + SLAB_SIZE > memory_limit)
+        return -1;
+
+    bool huge = true;
+    char* slab = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (slab == MAP_FAILED) {
+        // no reserved huge pages; ask for transparent ones instead
+        huge = false;
+        char* mapped = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (mapped == MAP_FAILED) {
+            syserr_noexit("mmap");
+            return -1;
+        }
+
+        // a plain mapping is only page aligned, and a huge page can back
+        // the slab only if it starts on a huge page boundary; the rest of
+        // twice the size mapped is given back
+        slab = (char*) (((uintptr_t) mapped + SLAB_SIZE - 1) & ~((uintptr_t) SLAB_SIZE - 1));
+
+        if (slab > mapped)
+            munmap(mapped, slab - mapped);
+
+        munmap(slab + SLAB_SIZE, mapped + SLAB_SIZE - slab);
+        madvise(slab, SLAB_SIZE, MADV_HUGEPAGE);
+    }
+
+    for (int i = 0; i < BUFFERS_PER_SLAB; i++)
+        push(&global_free, slab + i * MAX_CHUNK_SIZE);
+
+    __atomic_add_fetch(&stats.slab_bytes, SLAB_SIZE, __ATOMIC_RELAXED);
+    if (huge)
+        __atomic_add_fetch(&stats.huge_slabs, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void buffer_pool_set_limit(size_t max_bytes) {
+    memory_limit = max_bytes;
+}
+
+char* buffer_get(void) {
+    __atomic_add_fetch(&stats.gets, 1, __ATOMIC_RELAXED);
+
+    char* buffer = pop(&thread_free);
+
+    if (!buffer) {
+        pthread_mutex_lock(&global_lock);
+
+        if (!global_free.head)
+            add_slab();
+
+        buffer = pop(&global_free);
+        pthread_mutex_unlock(&global_lock);
+    }
+
+    if (!buffer) {
+        __atomic_add_fetch(&stats.failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    uint64_t in_use = __atomic_add_fetch(&stats.in_use, 1, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n(&stats.peak_in_use, __ATOMIC_RELAXED);
+
+    while (in_use > peak && !__atomic_compare_exchange_n(&stats.peak_in_use, &peak, in_use,
+                                                         true, __ATOMIC_RELAXED,
+                                                         __ATOMIC_RELAXED)) { }
+
+    return buffer;
+}
+
+void buffer_put(char* buffer) {
+    if (!buffer)
+        return;
+
+    __atomic_sub_fetch(&stats.in_use, 1, __ATOMIC_RELAXED);
+
+    if (thread_free.count < THREAD_CACHE_MAX) {
+        if (thread_free.count == 0) {
+            // make sure the cache is flushed when the thread exits
+            pthread_once(&thread_key_once, create_thread_key);
+            pthread_setspecific(thread_key, &thread_free);
+        }
+
+        push(&thread_free, buffer);
+        return;
+    }
+
+    pthread_mutex_lock(&global_lock);
+    push(&global_free, buffer);
+    pthread_mutex_unlock(&global_lock);
+}
+
+void buffer_pool_get_stats(struct buffer_pool_stats* result) {
+    result->slab_bytes = __atomic_load_n(&stats.slab_bytes, __ATOMIC_RELAXED);
+    result->huge_slabs = __atomic_load_n(&stats.huge_slabs, __ATOMIC_RELAXED);
+    result->in_use = __atomic_load_n(&stats.in_use, __ATOMIC_RELAXED);
+    result->peak_in_use = __atomic_load_n(&stats.peak_in_use, __ATOMIC_RELAXED);
+    result->gets = __atomic_load_n(&stats.gets, __ATOMIC_RELAXED);
+    result->failures = __atomic_load_n(&stats.failures, __ATOMIC_RELAXED);
+}
+
+void buffer_pool_print_stats(void) {
+    struct buffer_pool_stats current;
+    buffer_pool_get_stats(&current);
+
+    printf("buffer pool: %lu KiB mapped (%lu huge page slabs), %lu buffers in use "
+           "(peak %lu), %lu gets, %lu refused\n",
+           current.slab_bytes / 1024, current.huge_slabs, current.in_use,
+           current.peak_in_use, current.gets, current.failures);
+}
@@ -0,0 +1,35 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Transfer buffers of MAX_CHUNK_SIZE bytes, aligned to their size. They are
+ * carved from slabs backed by huge pages when possible, and kept on per-thread
+ * free lists when returned. */
+
+struct buffer_pool_stats {
+    uint64_t slab_bytes;       // memory mapped for buffers
+    uint64_t huge_slabs;       // slabs backed by huge pages
+    uint64_t in_use;           // buffers borrowed at the moment
+    uint64_t peak_in_use;
+    uint64_t gets;
+    uint64_t failures;         // gets refused because of the memory limit
+};
+
+/* Limits memory mapped for buffers to max_bytes (0 means no limit).
+ * Should be called before first buffer_get. */
+void buffer_pool_set_limit(size_t max_bytes);
+
+/* Returns a buffer of MAX_CHUNK_SIZE bytes, or NULL if the memory limit is
+ * reached or mapping failed. */
+char* buffer_get(void);
+
+/* Returns buffer to the pool; does nothing for NULL. */
+void buffer_put(char* buffer);
+
+void buffer_pool_get_stats(struct buffer_pool_stats* stats);
+
+void buffer_pool_print_stats(void);
+
+#endif //BUFFER_POOL_H
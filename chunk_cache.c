@@ -0,0 +1,664 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "err.h"
+#include "chunk_cache.h"
+#include "metrics.h"
+#include "log.h"
+
+// timestamps of files are too coarse to tell apart changes made within the
+// same tick, so chunks of files modified this recently are sent but not kept
+#define RACY_SECONDS 1
+
+// threads reading missing chunks for the epoll engine
+#define LOADER_THREADS 4
+
+enum chunk_state {
+    CHUNK_LOADING,
+    CHUNK_READY,
+    CHUNK_FAILED
+};
+
+struct chunk {
+    struct chunk* next;        // in the bucket
+    struct chunk* newer;       // in the LRU list
+    struct chunk* older;
+    dev_t dev;
+    ino_t ino;
+    uint64_t index;
+    struct timespec mtime;     // of the file when the chunk was read
+    uint64_t file_size;
+    int refs;                  // fragments using the chunk, loaders and the cache
+    int state;                 // enum chunk_state, set when the read completes
+    int* waiters;              // eventfds of connections waiting for the read
+    int waiters_num;
+    int waiters_size;
+    size_t len;
+    char data[];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;     // signalled when a chunk's read is done
+    bool enabled;
+    size_t max_bytes;
+    struct chunk** buckets;
+    size_t buckets_num;
+    struct chunk* newest;
+    struct chunk* oldest;
+    struct chunk_cache_stats stats;
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .loaded = PTHREAD_COND_INITIALIZER
+};
+
+// missing chunks of one fragment, read by a loader thread; the descriptor is
+// a duplicate, so that the connection may end in the meantime
+struct load_job {
+    struct load_job* next;
+    int fd;
+    struct chunk* chunks[MAX_FRAGMENT_CHUNKS];
+    int chunks_num;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool started;
+    struct load_job* head;
+    struct load_job* tail;
+} loaders = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static struct chunk** chunk_find(dev_t dev, ino_t ino, uint64_t index) {
+    uint64_t hash = (dev * 0x9E3779B97F4A7C15ULL) ^ (ino * 0xC2B2AE3D27D4EB4FULL)
+                    ^ (index * 0x165667B19E3779F9ULL);
+    struct chunk** chunk = &cache.buckets[(hash ^ (hash >> 29)) & (cache.buckets_num - 1)];
+
+    while (*chunk && ((*chunk)->ino != ino || (*chunk)->index != index || (*chunk)->dev != dev))
+        chunk = &(*chunk)->next;
+
+    return chunk;
+}
+
+static void lru_unlink(struct chunk* chunk) {
+    if (chunk->newer)
+        chunk->newer->older = chunk->older;
+    else
+        cache.newest = chunk->older;
+
+    if (chunk->older)
+        chunk->older->newer = chunk->newer;
+    else
+        cache.oldest = chunk->newer;
+}
+
+static void lru_push(struct chunk* chunk) {
+    chunk->newer = NULL;
+    chunk->older = cache.newest;
+
+    if (cache.newest)
+        cache.newest->newer = chunk;
+    else
+        cache.oldest = chunk;
+
+    cache.newest = chunk;
+}
+
+static void chunk_put(struct chunk* chunk) {
+    if (__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(chunk->waiters);
+        free(chunk);
+    }
+}
+
+// drops the chunk pointed to by link from the cache; fragments still sending
+// it keep it alive. cache.lock must be held
+static void chunk_remove(struct chunk** link) {
+    struct chunk* chunk = *link;
+
+    *link = chunk->next;
+    lru_unlink(chunk);
+    cache.stats.bytes -= chunk->len;
+    chunk_put(chunk);
+}
+
+// whether chunk was read from the version of its file with mtime and size
+static bool chunk_current(struct chunk* chunk, struct timespec mtime, uint64_t file_size) {
+    return chunk->mtime.tv_sec == mtime.tv_sec && chunk->mtime.tv_nsec == mtime.tv_nsec
+           && chunk->file_size == file_size;
+}
+
+// adds chunk to the cache, evicting the least recently used ones if needed;
+// cache.lock must be held and chunk must not be cached yet
+static void chunk_insert(struct chunk* chunk) {
+    if (chunk->len > cache.max_bytes)
+        return;
+
+    while (cache.stats.bytes + chunk->len > cache.max_bytes) {
+        struct chunk* oldest = cache.oldest;
+
+        chunk_remove(chunk_find(oldest->dev, oldest->ino, oldest->index));
+        ++cache.stats.evictions;
+    }
+
+    struct chunk** link = chunk_find(chunk->dev, chunk->ino, chunk->index);
+
+    __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+    chunk->next = *link;
+    *link = chunk;
+    lru_push(chunk);
+    cache.stats.bytes += chunk->len;
+}
+
+// returns chunk index of the file described by f_stat, pinned: a cached one,
+// possibly still being read for another fragment, or a new one cached before
+// it is read, which sets *owned; used bytes of it are going to be sent.
+// Returns NULL if memory cannot be allocated
+static struct chunk* chunk_acquire(const struct stat* f_stat, uint64_t index, size_t used,
+                                   bool* owned) {
+    pthread_mutex_lock(&cache.lock);
+
+    struct chunk** link = chunk_find(f_stat->st_dev, f_stat->st_ino, index);
+    struct chunk* chunk = *link;
+
+    if (chunk && !chunk_current(chunk, f_stat->st_mtim, f_stat->st_size)) {
+        chunk_remove(link);
+        ++cache.stats.invalidations;
+        chunk = NULL;
+    }
+
+    *owned = !chunk;
+
+    if (chunk) {
+        __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+        lru_unlink(chunk);
+        lru_push(chunk);
+        cache.stats.bytes_saved += used;
+
+        if (chunk->state == CHUNK_LOADING)
+            ++cache.stats.coalesced;
+        else
+            ++cache.stats.hits;
+
+        pthread_mutex_unlock(&cache.lock);
+        return chunk;
+    }
+
+    ++cache.stats.misses;
+
+    uint64_t start = index * CHUNK_SIZE;
+    size_t len = f_stat->st_size - start < CHUNK_SIZE ? f_stat->st_size - start : CHUNK_SIZE;
+
+    chunk = malloc(sizeof(struct chunk) + len);
+
+    if (!chunk) {
+        pthread_mutex_unlock(&cache.lock);
+        fprintf(stderr, "malloc for chunk failed\n");
+        return NULL;
+    }
+
+    chunk->dev = f_stat->st_dev;
+    chunk->ino = f_stat->st_ino;
+    chunk->index = index;
+    chunk->mtime = f_stat->st_mtim;
+    chunk->file_size = f_stat->st_size;
+    chunk->refs = 1;
+    chunk->state = CHUNK_LOADING;
+    chunk->waiters = NULL;
+    chunk->waiters_num = 0;
+    chunk->waiters_size = 0;
+    chunk->len = len;
+
+    // others wanting the chunk find it and wait for this read
+    chunk_insert(chunk);
+
+    pthread_mutex_unlock(&cache.lock);
+    return chunk;
+}
+
+// ends the read of chunk, dropping it from the cache unless it is to be kept,
+// and wakes up connections waiting for it
+static void chunk_done(struct chunk* chunk, bool loaded, bool keep) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&cache.lock);
+
+    __atomic_store_n(&chunk->state, loaded ? CHUNK_READY : CHUNK_FAILED, __ATOMIC_RELEASE);
+
+    struct chunk** link = chunk_find(chunk->dev, chunk->ino, chunk->index);
+
+    if ((!loaded || !keep) && *link == chunk)
+        chunk_remove(link);
+
+    // their descriptors stay open while they are registered, as a fragment
+    // unregisters before its connection closes them
+    for (int i = 0; i < chunk->waiters_num; i++)
+        if (write(chunk->waiters[i], &one, sizeof(one)) < 0)
+            syserr_noexit("writing to eventfd");
+
+    chunk->waiters_num = 0;
+    pthread_cond_broadcast(&cache.loaded);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// records res, the length read to chunk or -errno; the chunk stays cached
+// unless its file was modified too recently. Returns -1 if it was not read
+// whole
+static int chunk_loaded(struct chunk* chunk, int64_t res) {
+    bool loaded = res >= 0 && (uint64_t) res == chunk->len;
+
+    if (res < 0) {
+        errno = -res;
+        syserr_noexit("reading file chunk");
+    } else if (!loaded) {
+        fprintf(stderr, "file got shorter while its chunk was read\n");
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    chunk_done(chunk, loaded, now.tv_sec - chunk->mtime.tv_sec > RACY_SECONDS);
+    return loaded ? 0 : -1;
+}
+
+// reads chunk from file fd; returns -1 if it was not read whole
+static int chunk_pread(int fd, struct chunk* chunk) {
+    ssize_t len = pread(fd, chunk->data, chunk->len, chunk->index * CHUNK_SIZE);
+
+    return chunk_loaded(chunk, len < 0 ? -errno : len);
+}
+
+// registers eventfd notify_fd to be written when chunk is read, unless it is
+// already; cache.lock must be held. Returns -1 if memory cannot be allocated
+static int chunk_add_waiter(struct chunk* chunk, int notify_fd) {
+    for (int i = 0; i < chunk->waiters_num; i++)
+        if (chunk->waiters[i] == notify_fd)
+            return 0;
+
+    if (chunk->waiters_num == chunk->waiters_size) {
+        int size = chunk->waiters_size > 0 ? 2 * chunk->waiters_size : 4;
+        int* waiters = realloc(chunk->waiters, size * sizeof(int));
+
+        if (!waiters) {
+            fprintf(stderr, "malloc for chunk waiters failed\n");
+            return -1;
+        }
+
+        chunk->waiters = waiters;
+        chunk->waiters_size = size;
+    }
+
+    chunk->waiters[chunk->waiters_num++] = notify_fd;
+    return 0;
+}
+
+// unregisters notify_fd from chunk; cache.lock must be held
+static void chunk_remove_waiter(struct chunk* chunk, int notify_fd) {
+    for (int i = 0; i < chunk->waiters_num; i++) {
+        if (chunk->waiters[i] == notify_fd) {
+            chunk->waiters[i] = chunk->waiters[--chunk->waiters_num];
+            return;
+        }
+    }
+}
+
+static void* run_loader(void* arg) {
+    (void) arg;
+
+    while (true) {
+        pthread_mutex_lock(&loaders.lock);
+
+        while (!loaders.head)
+            pthread_cond_wait(&loaders.cond, &loaders.lock);
+
+        struct load_job* job = loaders.head;
+        loaders.head = job->next;
+
+        if (!loaders.head)
+            loaders.tail = NULL;
+
+        pthread_mutex_unlock(&loaders.lock);
+
+        for (int i = 0; i < job->chunks_num; i++) {
+            chunk_pread(job->fd, job->chunks[i]);
+            chunk_put(job->chunks[i]);
+        }
+
+        close(job->fd);
+        free(job);
+    }
+
+    return NULL;
+}
+
+// starts the loader threads unless they run already; loaders.lock must be held
+static int start_loaders(void) {
+    if (loaders.started)
+        return 0;
+
+    for (int i = 0; i < LOADER_THREADS; i++) {
+        pthread_t thread;
+
+        if ((errno = pthread_create(&thread, NULL, run_loader, NULL)) != 0) {
+            syserr_noexit("pthread_create");
+            // the threads started so far serve the queue
+            loaders.started = i > 0;
+            return i > 0 ? 0 : -1;
+        }
+
+        pthread_detach(thread);
+    }
+
+    loaders.started = true;
+    return 0;
+}
+
+int chunk_cache_init(size_t max_bytes) {
+    size_t buckets_num = 1;
+
+    while (buckets_num < max_bytes / CHUNK_SIZE)
+        buckets_num *= 2;
+
+    cache.buckets = calloc(buckets_num, sizeof(struct chunk*));
+
+    if (!cache.buckets) {
+        fprintf(stderr, "malloc for chunk cache failed\n");
+        return -1;
+    }
+
+    cache.buckets_num = buckets_num;
+    cache.max_bytes = max_bytes;
+    cache.enabled = true;
+    return 0;
+}
+
+int chunk_cache_get(const struct stat* f_stat, uint64_t offset, uint64_t len, void* header,
+                    size_t header_len, struct cached_fragment* fragment) {
+    if (!cache.enabled || len == 0)
+        return 0;
+
+    uint64_t first = offset / CHUNK_SIZE;
+    uint64_t last = (offset + len - 1) / CHUNK_SIZE;
+
+    if (last - first >= MAX_FRAGMENT_CHUNKS)
+        return 0;
+
+    // the file may have been cut since the request was checked
+    if (offset + len > (uint64_t) f_stat->st_size)
+        return 0;
+
+    fragment->chunks_num = 0;
+    fragment->next_read = 0;
+    fragment->notify_fd = -1;
+    fragment->iov[0].iov_base = header;
+    fragment->iov[0].iov_len = header_len;
+    fragment->iov_first = 0;
+    fragment->iov_num = 1;
+
+    for (uint64_t index = first; index <= last; index++) {
+        uint64_t chunk_start = index * CHUNK_SIZE;
+        size_t begin = index == first ? offset - chunk_start : 0;
+        size_t end = index == last ? offset + len - chunk_start : CHUNK_SIZE;
+        bool owned;
+        struct chunk* chunk = chunk_acquire(f_stat, index, end - begin, &owned);
+
+        if (!chunk) {
+            chunk_cache_release(fragment);
+            return -1;
+        }
+
+        fragment->owned[fragment->chunks_num] = owned;
+        fragment->chunks[fragment->chunks_num++] = chunk;
+        fragment->iov[fragment->iov_num].iov_base = chunk->data + begin;
+        fragment->iov[fragment->iov_num].iov_len = end - begin;
+        ++fragment->iov_num;
+    }
+
+    return fragment_ready(fragment) > 0 ? 1 : FRAGMENT_PENDING;
+}
+
+int fragment_read(int fd, struct cached_fragment* fragment) {
+    for (int i = 0; i < fragment->chunks_num; i++) {
+        if (fragment->owned[i]) {
+            fragment->owned[i] = false;
+
+            if (chunk_pread(fd, fragment->chunks[i]) < 0)
+                return -1;
+        }
+    }
+
+    // the rest is read by other workers, each of which reads its own chunks
+    // before waiting for any
+    pthread_mutex_lock(&cache.lock);
+
+    for (int i = 0; i < fragment->chunks_num; i++)
+        while (fragment->chunks[i]->state == CHUNK_LOADING)
+            pthread_cond_wait(&cache.loaded, &cache.lock);
+
+    pthread_mutex_unlock(&cache.lock);
+    return fragment_ready(fragment) < 0 ? -1 : 0;
+}
+
+int fragment_load(int fd, struct cached_fragment* fragment) {
+    struct load_job* job = malloc(sizeof(struct load_job));
+
+    if (!job) {
+        fprintf(stderr, "malloc for chunk load failed\n");
+        return -1;
+    }
+
+    job->next = NULL;
+    job->chunks_num = 0;
+
+    for (int i = 0; i < fragment->chunks_num; i++)
+        if (fragment->owned[i])
+            job->chunks[job->chunks_num++] = fragment->chunks[i];
+
+    if (job->chunks_num == 0) {
+        free(job);
+        return 0;
+    }
+
+    if ((job->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        syserr_noexit("fcntl");
+        free(job);
+        return -1;
+    }
+
+    pthread_mutex_lock(&loaders.lock);
+
+    if (start_loaders() < 0) {
+        pthread_mutex_unlock(&loaders.lock);
+        close(job->fd);
+        free(job);
+        return -1;
+    }
+
+    // the loader owns the chunks from now on and keeps them alive if the
+    // fragment is released first
+    for (int i = 0; i < fragment->chunks_num; i++) {
+        if (fragment->owned[i]) {
+            __atomic_add_fetch(&fragment->chunks[i]->refs, 1, __ATOMIC_RELAXED);
+            fragment->owned[i] = false;
+        }
+    }
+
+    if (loaders.tail)
+        loaders.tail->next = job;
+    else
+        loaders.head = job;
+
+    loaders.tail = job;
+    pthread_cond_signal(&loaders.cond);
+    pthread_mutex_unlock(&loaders.lock);
+    return 0;
+}
+
+bool fragment_next_read(struct cached_fragment* fragment, struct iovec* buffer,
+                        uint64_t* offset) {
+    while (fragment->next_read < fragment->chunks_num && !fragment->owned[fragment->next_read])
+        ++fragment->next_read;
+
+    if (fragment->next_read >= fragment->chunks_num)
+        return false;
+
+    struct chunk* chunk = fragment->chunks[fragment->next_read];
+
+    buffer->iov_base = chunk->data;
+    buffer->iov_len = chunk->len;
+    *offset = chunk->index * CHUNK_SIZE;
+    return true;
+}
+
+int fragment_read_done(struct cached_fragment* fragment, int64_t res) {
+    fragment->owned[fragment->next_read] = false;
+    return chunk_loaded(fragment->chunks[fragment->next_read++], res);
+}
+
+int fragment_ready(struct cached_fragment* fragment) {
+    int ready = 1;
+
+    for (int i = 0; i < fragment->chunks_num; i++) {
+        int state = __atomic_load_n(&fragment->chunks[i]->state, __ATOMIC_ACQUIRE);
+
+        if (state == CHUNK_FAILED)
+            return -1;
+
+        if (state == CHUNK_LOADING)
+            ready = 0;
+    }
+
+    return ready;
+}
+
+int fragment_wait(struct cached_fragment* fragment, int notify_fd) {
+    int ready = fragment_ready(fragment);
+
+    if (ready != 0)
+        return ready;
+
+    pthread_mutex_lock(&cache.lock);
+
+    // chunks are marked read under the lock, so none is missed in between
+    for (int i = 0; i < fragment->chunks_num; i++) {
+        struct chunk* chunk = fragment->chunks[i];
+
+        if (chunk->state == CHUNK_LOADING && chunk_add_waiter(chunk, notify_fd) < 0) {
+            pthread_mutex_unlock(&cache.lock);
+            return -1;
+        }
+    }
+
+    fragment->notify_fd = notify_fd;
+    ready = fragment_ready(fragment);
+    pthread_mutex_unlock(&cache.lock);
+    return ready;
+}
+
+bool fragment_advance(struct cached_fragment* fragment, size_t len) {
+    while (fragment->iov_first < fragment->iov_num) {
+        struct iovec* iov = &fragment->iov[fragment->iov_first];
+        size_t part = len < iov->iov_len ? len : iov->iov_len;
+
+        iov->iov_base = (char*) iov->iov_base + part;
+        iov->iov_len -= part;
+        len -= part;
+
+        if (iov->iov_len > 0)
+            break;
+
+        ++fragment->iov_first;
+    }
+
+    return fragment->iov_first == fragment->iov_num;
+}
+
+int fragment_write(int sock, struct cached_fragment* fragment) {
+    while (fragment->iov_first < fragment->iov_num) {
+        ssize_t len = writev(sock, fragment->iov + fragment->iov_first,
+                             fragment->iov_num - fragment->iov_first);
+
+        if (len == 0) {
+            log_info("client has disconnected\n");
+            return -1;
+        }
+
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            if (errno == EINTR)
+                continue;
+
+            syserr_noexit("writing to client socket");
+            return -1;
+        }
+
+        metrics_add_sent(len);
+        fragment_advance(fragment, len);
+    }
+
+    return 1;
+}
+
+void chunk_cache_release(struct cached_fragment* fragment) {
+    for (int i = 0; i < fragment->chunks_num; i++) {
+        struct chunk* chunk = fragment->chunks[i];
+
+        // a chunk this fragment was to read but never did fails for those
+        // waiting for it, as after a failed read
+        if (fragment->owned[i])
+            chunk_done(chunk, false, false);
+    }
+
+    if (fragment->notify_fd >= 0 && fragment->chunks_num > 0) {
+        pthread_mutex_lock(&cache.lock);
+
+        for (int i = 0; i < fragment->chunks_num; i++)
+            chunk_remove_waiter(fragment->chunks[i], fragment->notify_fd);
+
+        pthread_mutex_unlock(&cache.lock);
+    }
+
+    for (int i = 0; i < fragment->chunks_num; i++)
+        chunk_put(fragment->chunks[i]);
+
+    fragment->chunks_num = 0;
+    fragment->next_read = 0;
+    fragment->notify_fd = -1;
+    fragment->iov_first = 0;
+    fragment->iov_num = 0;
+}
+
+void chunk_cache_get_stats(struct chunk_cache_stats* stats) {
+    pthread_mutex_lock(&cache.lock);
+    *stats = cache.stats;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void chunk_cache_print_stats(void) {
+    struct chunk_cache_stats current;
+    chunk_cache_get_stats(&current);
+
+    uint64_t lookups = current.hits + current.misses;
+
+    printf("chunk cache: %lu KiB held, %lu hits, %lu misses (%.1f%% hit rate), "
+           "%lu reads coalesced, %lu KiB saved, %lu evicted, %lu invalidated\n",
+           current.bytes / 1024, current.hits, current.misses,
+           lookups > 0 ? 100.0 * current.hits / lookups : 0.0, current.coalesced,
+           current.bytes_saved / 1024, current.evictions, current.invalidations);
+}
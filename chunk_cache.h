@@ -0,0 +1,113 @@
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H
+
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Aligned chunks of file contents kept in memory, so that small files and
+ * leading ranges requested over and over are sent without reading them.
+ * Chunks are keyed by file (device and inode) and chunk index; those read
+ * before the last change of the file's mtime or size are dropped. Evicted in
+ * LRU order when the memory limit is reached.
+ * A chunk is read once however many connections want it at the same time:
+ * the others wait for that read and send from the same buffer. */
+
+#define CHUNK_SIZE (64*1024)
+
+/* Fragments spanning more chunks are sent from the file as before. */
+#define MAX_FRAGMENT_CHUNKS 4
+
+/* Returned by chunk_cache_get when chunks of the fragment have to be read,
+ * or are being read for another fragment. */
+#define FRAGMENT_PENDING 2
+
+struct chunk;
+
+/* Response to a file request served from the cache: the header followed by
+ * slices of chunks, which stay pinned until the fragment is released. */
+struct cached_fragment {
+    struct chunk* chunks[MAX_FRAGMENT_CHUNKS];
+    bool owned[MAX_FRAGMENT_CHUNKS];   // missing from the cache, to be read for this fragment
+    int chunks_num;
+    int next_read;             // owned chunk read by the caller (io_uring)
+    int notify_fd;             // registered on chunks being read for others, -1 if none
+    struct iovec iov[MAX_FRAGMENT_CHUNKS + 1];
+    int iov_first;             // first iovec not written entirely
+    int iov_num;
+};
+
+struct chunk_cache_stats {
+    uint64_t bytes;            // held by cached chunks
+    uint64_t hits;             // chunks found in the cache
+    uint64_t misses;           // chunks read from files
+    uint64_t coalesced;        // chunks waited for while another connection read them
+    uint64_t bytes_saved;      // sent from chunks found in the cache
+    uint64_t evictions;
+    uint64_t invalidations;    // chunks dropped as their file changed
+};
+
+/* Enables the cache, holding up to max_bytes of chunks. Should be called
+ * before the workers start. Returns -1 if memory cannot be allocated. */
+int chunk_cache_init(size_t max_bytes);
+
+/* Prepares fragment to send header of header_len bytes followed by len bytes
+ * starting at offset of the file with stat result f_stat. The header is not
+ * copied and has to stay in place until it is sent.
+ * Returns 1 if the fragment is ready, FRAGMENT_PENDING if chunks missing from
+ * the cache have to be read first with one of the functions below, 0 if it is
+ * not served from the cache (cache disabled, fragment too long or file shorter
+ * than expected) and -1 on error. */
+int chunk_cache_get(const struct stat* f_stat, uint64_t offset, uint64_t len, void* header,
+                    size_t header_len, struct cached_fragment* fragment);
+
+/* Reads the missing chunks of fragment from file fd on the calling thread,
+ * then blocks until chunks read for other fragments are ready; for workers
+ * serving a single client. Returns -1 if any cannot be read whole. */
+int fragment_read(int fd, struct cached_fragment* fragment);
+
+/* Hands the missing chunks of fragment to loader threads, which read them
+ * from file fd; fd may be closed by the caller at once. The caller learns
+ * about the end of the reads through fragment_wait. Returns -1 on error. */
+int fragment_load(int fd, struct cached_fragment* fragment);
+
+/* For reads issued by the caller: sets *buffer and *offset to the next
+ * missing chunk of fragment and its offset in the file, or returns false if
+ * there are none left. */
+bool fragment_next_read(struct cached_fragment* fragment, struct iovec* buffer,
+                        uint64_t* offset);
+
+/* Completes the read of the chunk given by fragment_next_read, which returned
+ * res, a length or -errno. Returns -1 if the chunk could not be read whole. */
+int fragment_read_done(struct cached_fragment* fragment, int64_t res);
+
+/* Returns 1 if all chunks of fragment were read, 0 if some are still being
+ * read and -1 if any failed. */
+int fragment_ready(struct cached_fragment* fragment);
+
+/* As fragment_ready, but if some chunks are still being read, registers
+ * eventfd notify_fd to get 1 added when each of them is done. The descriptor
+ * must stay open until the fragment is released; it may be registered again
+ * after a wakeup. */
+int fragment_wait(struct cached_fragment* fragment, int notify_fd);
+
+/* Moves past len bytes of fragment, written by the caller. Returns true when
+ * all of it was written. */
+bool fragment_advance(struct cached_fragment* fragment, size_t len);
+
+/* Writes as much of fragment to sock as it takes. Returns 1 when all of it was
+ * written, 0 if socket would block and -1 on error. */
+int fragment_write(int sock, struct cached_fragment* fragment);
+
+/* Unpins chunks of fragment and unregisters its eventfd; chunks it was to
+ * read but did not fail for those waiting for them. Does nothing for an empty
+ * fragment. */
+void chunk_cache_release(struct cached_fragment* fragment);
+
+void chunk_cache_get_stats(struct chunk_cache_stats* stats);
+
+void chunk_cache_print_stats(void);
+
+#endif //CHUNK_CACHE_H
@@ -5,6 +5,8 @@
  * @author Jan Kociniak <jk394348@students.mimuw.edu.pl>
  * @date 01.06.2018
  */
+#include <string.h>
+
 #include "dynamic_string.h"
 
 dyn_str dyn_str_init(void) {
@@ -13,8 +15,10 @@ dyn_str dyn_str_init(void) {
     if (new_dyn_str != NULL) {
         new_dyn_str->str = malloc(sizeof(char));
 
-        if (new_dyn_str->str == NULL)
+        if (new_dyn_str->str == NULL) {
+            free(new_dyn_str);
             return NULL;
+        }
 
         new_dyn_str->str[0] = '\0';
         new_dyn_str->size = 1;
@@ -40,10 +44,69 @@ bool dyn_str_add(dyn_str str, char c) {
     return true;
 }
 
+bool dyn_str_reserve(dyn_str str, size_t capacity) {
+    if (capacity + 1 <= str->size)
+        return true;
+
+    void *str_new = realloc(str->str, capacity + 1);
+
+    if (str_new == NULL)
+        return false;
+
+    str->str = str_new;
+    str->size = capacity + 1;
+    return true;
+}
+
+bool dyn_str_append(dyn_str str, const char* src, size_t len) {
+    if (str->used + len > str->size) {
+        size_t new_size = str->size * 2;
+
+        if (new_size < str->used + len)
+            new_size = str->used + len;
+
+        if (!dyn_str_reserve(str, new_size - 1))
+            return false;
+    }
+
+    memcpy(str->str + str->used - 1, src, len);
+    str->used += len;
+    str->str[str->used - 1] = '\0';
+    return true;
+}
+
+bool dyn_str_shrink_to_fit(dyn_str str) {
+    if (str->used == str->size)
+        return true;
+
+    void *str_new = realloc(str->str, str->used);
+
+    if (str_new == NULL)
+        return false;
+
+    str->str = str_new;
+    str->size = str->used;
+    return true;
+}
+
+void dyn_str_clear(dyn_str str) {
+    if (str != NULL) {
+        str->str[0] = '\0';
+        str->used = 1;
+    }
+}
+
 void dyn_str_reset(dyn_str str) {
     if (str != NULL) {
+        char* str_new = malloc(sizeof(char));
+
+        if (str_new == NULL) {
+            dyn_str_clear(str);
+            return;
+        }
+
         free(str->str);
-        str->str = malloc(sizeof(char));
+        str->str = str_new;
 
         str->str[0] = '\0';
         str->size = 1;
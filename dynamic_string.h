@@ -43,10 +43,49 @@ dyn_str dyn_str_init(void);
  */
 bool dyn_str_add(dyn_str str, char c);
 
+/** @brief Dodaje ciąg znaków na koniec tablicy.
+ * Kopiuje @p len znaków spod adresu @p src jednym wywołaniem @p memcpy.
+ * Jeśli tablica jest za mała, realokuje pamięć na co najmniej dwukrotnie
+ * większy obszar.
+ * @param[in,out] str  –   Wskaźnik na strukturę @p dynamicString;
+ * @param[in] src      –   Wskaźnik na znaki do dodania;
+ * @param[in] len      –   Liczba znaków do dodania.
+ * @return Wartość @p true, jeśli udało się dodać znaki.
+ *         Wartość @p false, jeśli nie udało się zaalokować pamięci.
+ */
+bool dyn_str_append(dyn_str str, const char* src, size_t len);
+
+/** @brief Zapewnia miejsce na co najmniej @p capacity znaków.
+ * Liczba @p capacity nie obejmuje kończącego znaku '\0'. Nie zmienia
+ * zawartości tablicy.
+ * @param[in,out] str      –   Wskaźnik na strukturę @p dynamicString;
+ * @param[in] capacity     –   Wymagana liczba znaków.
+ * @return Wartość @p true, jeśli tablica ma wymaganą pojemność.
+ *         Wartość @p false, jeśli nie udało się zaalokować pamięci.
+ */
+bool dyn_str_reserve(dyn_str str, size_t capacity);
+
+/** @brief Zmniejsza tablicę do rozmiaru przechowywanego napisu.
+ * @param[in,out] str  –   Wskaźnik na strukturę @p dynamicString.
+ * @return Wartość @p true, jeśli udało się zrealokować pamięć.
+ *         Wartość @p false w przeciwnym przypadku; tablica pozostaje wtedy
+ *         bez zmian.
+ */
+bool dyn_str_shrink_to_fit(dyn_str str);
+
+/** @brief Usuwa zawartość tablicy, zachowując zaalokowaną pamięć.
+ * Pozwala wielokrotnie budować napisy w tej samej tablicy bez ponownego
+ * powiększania jej od jednego znaku. Nic nie robi, jeśli wskaźnik ma wartość
+ * NULL.
+ * @param[in,out] str  –   Wskaźnik na strukturę @p dynamicString.
+ */
+void dyn_str_clear(dyn_str str);
+
 /** @brief Resetuje tablicę do początkowego stanu.
  * Zwalnia całą pamięć przeznaczoną na przechowywanie znaków i alokuje obszar
  * potrzebny na przechowanie jednego znaku. Resetuje liczniki @p size i @p used
- * do wartości 1. Nic nie robi, jeśli wskaźnik ma wartość NULL.
+ * do wartości 1. Jeśli nie uda się zaalokować nowego obszaru, zachowuje stary
+ * i tylko usuwa jego zawartość. Nic nie robi, jeśli wskaźnik ma wartość NULL.
  * @param[in] str  –  Wskaźnik na strukturę @p dynamicString.
  */
 void dyn_str_reset(dyn_str str);
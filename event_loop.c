@@ -0,0 +1,1111 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "err.h"
+#include "event_loop.h"
+#include "requests.h"
+#include "buffer_pool.h"
+#include "chunk_cache.h"
+#include "file_map.h"
+#include "metrics.h"
+#include "log.h"
+
+#define MAX_EVENTS 256
+
+// requests of a framed connection served at once; reading of further
+// requests waits until one of them is finished
+#define MAX_STREAMS 64
+
+enum conn_state {
+    READ_FRAME_ID,             // framed connections only
+    READ_TYPE,
+    READ_VERSION,
+    READ_BATCH_COUNT,
+    READ_PARAMS,
+    READ_NAME,
+    LOAD_CACHED,               // waiting for chunks being read by loaders or for others
+    SEND_HEADER,
+    SEND_CACHED,               // header and fragment from the chunk cache
+    SEND_BATCH_HEADERS,
+    SEND_LIST,
+    SEND_BODY,
+    SEND_STATS
+};
+
+// file fragment being sent
+struct body {
+    int file_fd;
+    uint64_t file_pos;
+    uint64_t bytes_left;
+    struct file_map* map;      // sent from if the file is mapped
+    uint64_t prefetched;       // how far the kernel was asked to read ahead
+    int prefetch_depth;
+    bool use_sendfile;
+    bool sendfile_unsupported;
+    size_t chunk_len;          // length of the chunk being sent, progress in done
+    size_t done;
+    char* buffer;              // borrowed from the pool only while copying
+    bool buf_filled;
+};
+
+// request of a framed connection: its response frame, then data frames of
+// its body
+struct stream {
+    uint32_t id;
+    struct stream* next;
+    bool response_sent;
+    char response[sizeof(struct response_info)];   // framing uses classic messages
+    uint64_t send_start;       // when sending of a file response began, 0 for a list
+    struct list_response file_list;
+    dyn_str list_buf;
+    struct body body;
+};
+
+// state of one client connection; the request currently served is described
+// by the fields below, progress within the current state is kept in done
+struct connection {
+    int sock;
+    int epoll_fd;
+    uint32_t events;           // events the socket is registered for
+    enum conn_state state;
+    size_t done;
+
+    bool wide;                 // wide protocol version negotiated
+    uint16_t req_type;
+    uint64_t phase_start;      // when the current phase of the request began
+    uint16_t version;
+    char params[MAX_PARAMS_SIZE];
+    struct file_request f_info;
+    char file_name[MAX_PATH_LEN + 1];
+    uint16_t batch_count;
+    struct batch_request batch;
+
+    char header[MAX_RESPONSE_SIZE];
+    size_t header_len;
+    struct list_response file_list;
+    dyn_str list_buf;          // reused for list responses built on request
+    dyn_str stats_buf;         // reused for stats responses
+    struct body body;
+    struct cached_fragment fragment;
+    int load_fd;               // eventfd written by chunk loaders, -1 until needed
+
+    // framed connections: streams are sent a frame at a time, round robin
+    bool framed;
+    bool switch_to_framed;     // once the version response is sent
+    uint32_t frame_id;         // id of the request being read
+    bool read_closed;          // the client sent all its requests
+    struct stream* streams;    // the first one sends the next frame
+    struct stream* streams_tail;
+    int streams_num;
+    struct frame_header frame;
+    size_t frame_done;         // progress of the frame being sent, except data
+                               // sent by body, which keeps its own
+    bool frame_started;
+};
+
+// stands for a connection deleted while the rest of its events were pending
+static struct connection deleted_conn;
+
+static void body_init(struct body* body) {
+    memset(body, 0, sizeof(struct body));
+    body->file_fd = -1;
+}
+
+static void body_release(struct body* body) {
+    if (body->file_fd >= 0) {
+        close(body->file_fd);
+        body->file_fd = -1;
+    }
+
+    buffer_put(body->buffer);
+    body->buffer = NULL;
+    file_map_put(body->map);
+    body->map = NULL;
+}
+
+static void stream_delete(struct stream* stream) {
+    file_list_release(&stream->file_list);
+    dyn_str_delete(stream->list_buf);
+    body_release(&stream->body);
+    free(stream);
+}
+
+static struct connection* conn_new(int sock, int epoll_fd) {
+    struct connection* conn = calloc(1, sizeof(struct connection));
+
+    if (!conn)
+        return NULL;
+
+    conn->sock = sock;
+    conn->epoll_fd = epoll_fd;
+    conn->load_fd = -1;
+    conn->events = EPOLLIN;
+    conn->state = READ_TYPE;
+    body_init(&conn->body);
+    metrics_connection_opened();
+    return conn;
+}
+
+static void conn_end_request(struct connection* conn) {
+    file_list_release(&conn->file_list);
+    batch_free(&conn->batch);
+    body_release(&conn->body);
+    chunk_cache_release(&conn->fragment);
+    conn->state = READ_TYPE;
+    conn->done = 0;
+}
+
+static void conn_delete(struct connection* conn) {
+    conn_end_request(conn);
+
+    while (conn->streams) {
+        struct stream* stream = conn->streams;
+        conn->streams = stream->next;
+        stream_delete(stream);
+    }
+
+    safe_close(conn->sock);
+
+    // conn_end_request unregistered it from chunks being read
+    if (conn->load_fd >= 0)
+        close(conn->load_fd);
+
+    dyn_str_delete(conn->list_buf);
+    dyn_str_delete(conn->stats_buf);
+    free(conn);
+    metrics_connection_closed();
+}
+
+static void start_body(struct body* body, struct server_config* config,
+                       const struct stat* f_stat, uint64_t offset, uint64_t len) {
+    body->file_pos = offset;
+    body->bytes_left = len;
+    body->map = file_map_get(body->file_fd, f_stat, offset + len);
+    body->prefetched = 0;
+    body->prefetch_depth = config->prefetch_depth;
+    body->use_sendfile = config->use_sendfile;
+    body->sendfile_unsupported = false;
+    body->chunk_len = 0;
+    body->done = 0;
+}
+
+static int handle_list_request(struct connection* conn, struct server_config* config) {
+    log_debug("received a request for file list\n");
+
+    if (file_list_get(config->dir_path, &conn->list_buf, conn->wide, &conn->file_list) < 0)
+        return -1;
+
+    log_debug("successfully prepared file list\n");
+
+    if (conn->wide) {
+        struct fl_info64 info;
+
+        file_list_wide_header(&conn->file_list, &info);
+        memcpy(conn->header, &info, sizeof(struct fl_info64));
+        conn->header_len = sizeof(struct fl_info64);
+        conn->state = SEND_HEADER;
+        return 0;
+    }
+
+    conn->state = SEND_LIST;
+    return 0;
+}
+
+// has the missing chunks of the connection's fragment read by loader threads;
+// the connection is woken up through its eventfd when they, and chunks read
+// for other connections, are ready
+static int load_fragment(struct connection* conn) {
+    if (conn->load_fd < 0) {
+        conn->load_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (conn->load_fd < 0) {
+            syserr_noexit("eventfd");
+            return -1;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = conn;
+
+        if (epoll_ctl(conn->epoll_fd, EPOLL_CTL_ADD, conn->load_fd, &event) < 0) {
+            syserr_noexit("epoll_ctl");
+            close(conn->load_fd);
+            conn->load_fd = -1;
+            return -1;
+        }
+    }
+
+    if (fragment_load(conn->body.file_fd, &conn->fragment) < 0)
+        return -1;
+
+    conn->state = LOAD_CACHED;
+    return 0;
+}
+
+static int handle_file_request(struct connection* conn, struct server_config* config) {
+    struct file_response r_info;
+    struct stat f_stat;
+
+    conn->file_name[conn->f_info.name_len] = '\0';
+    metrics_phase_done(METRICS_PARSE, conn->phase_start);
+    conn->phase_start = metrics_now();
+
+    if (check_file_request(config->dir_path, &conn->f_info, conn->file_name,
+                           &r_info, &conn->body.file_fd, &f_stat) < 0)
+        return -1;
+
+    metrics_phase_done(METRICS_OPEN, conn->phase_start);
+    conn->phase_start = metrics_now();
+
+    conn->header_len = encode_response(&r_info, conn->wide, conn->header);
+    conn->state = SEND_HEADER;
+
+    if (r_info.msg_start != 3)
+        return 0;
+
+    int cached = chunk_cache_get(&f_stat, conn->f_info.begin_addr,
+                                 r_info.second_param, conn->header, conn->header_len,
+                                 &conn->fragment);
+    if (cached < 0)
+        return -1;
+
+    if (cached == FRAGMENT_PENDING)
+        return load_fragment(conn);
+
+    if (cached > 0)
+        conn->state = SEND_CACHED;
+    else
+        start_body(&conn->body, config, &f_stat, conn->f_info.begin_addr, r_info.second_param);
+
+    return 0;
+}
+
+static int handle_stats_request(struct connection* conn) {
+    log_debug("received a request for stats\n");
+
+    if (metrics_response(&conn->stats_buf) < 0)
+        return -1;
+
+    conn->state = SEND_STATS;
+    return 0;
+}
+
+static void handle_version_request(struct connection* conn) {
+    struct file_response r_info;
+    uint16_t version = choose_version(conn->version, true);
+
+    log_debug("client speaks protocol version %u, using %u\n", conn->version, version);
+
+    r_info.msg_start = 4;
+    r_info.second_param = version;
+    conn->header_len = encode_response(&r_info, false, conn->header);
+    conn->switch_to_framed = version == PROTOCOL_FRAMED;
+    conn->wide = version == PROTOCOL_WIDE;
+    conn->state = SEND_HEADER;
+}
+
+static int handle_batch_count(struct connection* conn) {
+    log_debug("received a batch request for %u files\n", conn->batch_count);
+
+    if (conn->batch_count == 0) {
+        conn_end_request(conn);
+        return 0;
+    }
+
+    if (conn->batch_count > MAX_BATCH_ENTRIES) {
+        log_warn("too many entries in batch request\n");
+        return -1;
+    }
+
+    if (batch_init(&conn->batch, conn->batch_count, conn->wide) < 0)
+        return -1;
+
+    conn->state = READ_PARAMS;
+    return 0;
+}
+
+// adds the entry just read to the batch; once all are read, checks them
+static int handle_batch_entry(struct connection* conn, struct server_config* config) {
+    struct batch_request* batch = &conn->batch;
+
+    conn->file_name[conn->f_info.name_len] = '\0';
+
+    if (batch_add(batch, &conn->f_info, conn->file_name) < 0)
+        return -1;
+
+    if (batch->added < batch->count) {
+        conn->state = READ_PARAMS;
+        return 0;
+    }
+
+    metrics_phase_done(METRICS_PARSE, conn->phase_start);
+    conn->phase_start = metrics_now();
+
+    for (uint16_t i = 0; i < batch->count; i++)
+        if (batch_check(config->dir_path, batch, i) < 0)
+            return -1;
+
+    metrics_phase_done(METRICS_OPEN, conn->phase_start);
+    conn->phase_start = metrics_now();
+    conn->state = SEND_BATCH_HEADERS;
+    return 0;
+}
+
+// starts sending the body of the next accepted batch entry, or ends the
+// request if there are none left
+static int start_batch_body(struct connection* conn, struct server_config* config) {
+    struct batch_request* batch = &conn->batch;
+
+    while (batch->next < batch->count && batch->entries[batch->next].body_len == 0)
+        ++batch->next;
+
+    if (batch->next == batch->count) {
+        metrics_phase_done(METRICS_SEND, conn->phase_start);
+        log_debug("successfully sent batch response\n");
+        conn_end_request(conn);
+        return 0;
+    }
+
+    struct batch_entry* entry = &batch->entries[batch->next++];
+    struct stat f_stat;
+
+    if (batch_open(config->dir_path, batch, batch->next - 1, &conn->body.file_fd, &f_stat) < 0) {
+        conn->body.file_fd = -1;
+        return -1;
+    }
+
+    start_body(&conn->body, config, &f_stat, entry->f_info.begin_addr, entry->body_len);
+    conn->done = 0;
+    conn->state = SEND_BODY;
+    log_debug("sending... bytes left: %lu\n", conn->body.bytes_left);
+    return 0;
+}
+
+// sends the next chunk of requested file fragment, from the file's mapping if
+// it is mapped, otherwise with sendfile if possible and by copying through a
+// buffer if not; a new chunk is at most
+// MAX_CHUNK_SIZE bytes long unless the caller set chunk_len for it already.
+// Returns 1 when a whole chunk was written, 0 if socket would block and -1 on
+// error
+static int send_body_chunk(int sock, struct body* body) {
+    int ret;
+
+    if (body->done == body->chunk_len) {
+        body->chunk_len = body->bytes_left < MAX_CHUNK_SIZE ? body->bytes_left
+                                                            : MAX_CHUNK_SIZE;
+        body->done = 0;
+        body->buf_filled = false;
+    }
+
+    if (body->map) {
+        if (body->done == 0)
+            file_map_advise(body->map, body->file_pos, body->bytes_left);
+
+        ret = nb_write(sock, file_map_data(body->map) + body->file_pos, body->chunk_len,
+                       &body->done, "client");
+
+        if (ret == 1) {
+            body->file_pos += body->chunk_len;
+            body->bytes_left -= body->chunk_len;
+            metrics_add_sent(body->chunk_len);
+        }
+
+        return ret;
+    }
+
+    // the next chunks are read while this one is sent
+    if (body->done == 0)
+        prefetch_file(body->file_fd, body->file_pos, body->bytes_left, &body->prefetched,
+                      body->prefetch_depth);
+
+    // with no free buffer in the pool, a copying transfer goes on with sendfile
+    if (!body->use_sendfile && !body->buffer && !body->sendfile_unsupported
+        && !(body->buffer = buffer_get())) {
+        log_warn("no transfer buffer available, using sendfile instead\n");
+        body->use_sendfile = true;
+    }
+
+    if (body->use_sendfile) {
+        ret = nb_sendfile(sock, body->file_fd, &body->file_pos,
+                          body->chunk_len, &body->done, "client");
+
+        if (ret != SENDFILE_UNSUPPORTED) {
+            if (ret == 1) {
+                body->bytes_left -= body->chunk_len;
+                metrics_add_sent(body->chunk_len);
+            }
+
+            return ret;
+        }
+
+        log_warn("sendfile not supported for this file, copying instead\n");
+        body->use_sendfile = false;
+        body->sendfile_unsupported = true;
+    }
+
+    if (!body->buffer && !(body->buffer = buffer_get())) {
+        fprintf(stderr, "no transfer buffer available\n");
+        return -1;
+    }
+
+    if (!body->buf_filled) {
+        // sendfile may have sent a part of this chunk already
+        size_t len_to_read = body->chunk_len - body->done;
+        ssize_t len = pread(body->file_fd, body->buffer + body->done, len_to_read,
+                            body->file_pos);
+
+        if (len < 0 || (size_t) len != len_to_read) {
+            syserr_noexit("pread");
+            return -1;
+        }
+
+        body->file_pos += len_to_read;
+        body->buf_filled = true;
+    }
+
+    ret = nb_write(sock, body->buffer, body->chunk_len, &body->done, "client");
+
+    if (ret == 1) {
+        body->bytes_left -= body->chunk_len;
+        metrics_add_sent(body->chunk_len);
+    }
+
+    return ret;
+}
+
+static int read_file_params(struct connection* conn) {
+    int ret = nb_read(conn->sock, conn->params, file_params_size(conn->wide),
+                      &conn->done, "client");
+    if (ret <= 0)
+        return ret;
+
+    decode_file_params(conn->params, conn->wide, &conn->f_info);
+    conn->done = 0;
+
+    if (conn->f_info.name_len > MAX_PATH_LEN) {
+        log_warn("the name requested by client is too long\n");
+        return -1;
+    }
+
+    conn->state = READ_NAME;
+    return 1;
+}
+
+// adds a stream answering request conn->req_type of the framed connection
+static int add_stream(struct connection* conn, struct server_config* config) {
+    struct stream* stream = calloc(1, sizeof(struct stream));
+    struct file_response r_info;
+
+    if (!stream) {
+        fprintf(stderr, "malloc for stream failed\n");
+        return -1;
+    }
+
+    stream->id = conn->frame_id;
+    body_init(&stream->body);
+
+    if (conn->req_type == 1) {
+        log_debug("received a request for file list (stream %u)\n", stream->id);
+
+        // streams have their own buffers, as several lists may be in flight
+        if (file_list_get(config->dir_path, &stream->list_buf, false,
+                          &stream->file_list) < 0) {
+            stream_delete(stream);
+            return -1;
+        }
+    } else {
+        struct stat f_stat;
+
+        log_debug("received a request for file (stream %u)\n", stream->id);
+        conn->file_name[conn->f_info.name_len] = '\0';
+        metrics_phase_done(METRICS_PARSE, conn->phase_start);
+        conn->phase_start = metrics_now();
+
+        if (check_file_request(config->dir_path, &conn->f_info, conn->file_name,
+                               &r_info, &stream->body.file_fd, &f_stat) < 0) {
+            stream_delete(stream);
+            return -1;
+        }
+
+        metrics_phase_done(METRICS_OPEN, conn->phase_start);
+        stream->send_start = metrics_now();
+
+        if (r_info.msg_start == 3)
+            start_body(&stream->body, config, &f_stat, conn->f_info.begin_addr,
+                       r_info.second_param);
+
+        encode_response(&r_info, false, stream->response);
+    }
+
+    if (conn->streams_tail)
+        conn->streams_tail->next = stream;
+    else
+        conn->streams = stream;
+
+    conn->streams_tail = stream;
+    ++conn->streams_num;
+    conn->state = READ_FRAME_ID;
+    return 0;
+}
+
+// reads the next part of a request of a framed connection; returns 1 if it
+// was read, 0 if socket would block and -1 on error
+static int read_framed_request(struct connection* conn, struct server_config* config) {
+    int ret;
+
+    switch (conn->state) {
+        case READ_FRAME_ID:
+            ret = nb_read(conn->sock, &conn->frame_id, sizeof(uint32_t),
+                          &conn->done, "client");
+
+            // shutting down sending between requests is no error; the
+            // streams in flight are still answered
+            if (ret == PEER_CLOSED && conn->done == 0) {
+                conn->read_closed = true;
+                return 0;
+            }
+
+            if (ret <= 0)
+                return ret;
+
+            conn->frame_id = ntohl(conn->frame_id);
+            conn->done = 0;
+            conn->state = READ_TYPE;
+            return 1;
+
+        case READ_TYPE:
+            ret = nb_read(conn->sock, &conn->req_type, sizeof(uint16_t),
+                          &conn->done, "client");
+            if (ret <= 0)
+                return ret;
+
+            conn->req_type = ntohs(conn->req_type);
+            conn->done = 0;
+            metrics_count_request(conn->req_type);
+            conn->phase_start = metrics_now();
+
+            if (conn->req_type == 1)
+                return add_stream(conn, config) < 0 ? -1 : 1;
+
+            if (conn->req_type == 2) {
+                conn->state = READ_PARAMS;
+                return 1;
+            }
+
+            // the length of an unknown request is unknown, so framing is lost
+            log_warn("invalid request format\n");
+            return -1;
+
+        case READ_PARAMS:
+            return read_file_params(conn);
+
+        case READ_NAME:
+            ret = nb_read(conn->sock, conn->file_name, conn->f_info.name_len,
+                          &conn->done, "client");
+            if (ret <= 0)
+                return ret;
+
+            conn->done = 0;
+            return add_stream(conn, config) < 0 ? -1 : 1;
+
+        default:
+            return -1;
+    }
+}
+
+// sends the next frame of the first stream, which then goes to the end of
+// the queue, or is deleted if it has nothing more to send; returns 1 when the
+// frame was sent, 0 if socket would block and -1 on error
+static int send_frame(struct connection* conn) {
+    struct stream* stream = conn->streams;
+    int ret;
+
+    if (!conn->frame_started) {
+        uint32_t len;
+
+        if (!stream->response_sent) {
+            conn->frame.kind = htons(FRAME_RESPONSE);
+            len = stream->file_list.data ? stream->file_list.size
+                                         : sizeof(struct response_info);
+        } else {
+            conn->frame.kind = htons(FRAME_DATA);
+            len = stream->body.bytes_left < FRAME_DATA_SIZE ? stream->body.bytes_left
+                                                            : FRAME_DATA_SIZE;
+            stream->body.chunk_len = len;
+            stream->body.done = 0;
+            stream->body.buf_filled = false;
+        }
+
+        conn->frame.request_id = htonl(stream->id);
+        conn->frame.len = htonl(len);
+        conn->frame_done = 0;
+        conn->frame_started = true;
+    }
+
+    if (!stream->response_sent) {
+        // the frame header and the response go in one write
+        struct iovec iov[2] = {{&conn->frame, sizeof(struct frame_header)}};
+
+        if (stream->file_list.data) {
+            iov[1].iov_base = stream->file_list.data;
+            iov[1].iov_len = stream->file_list.size;
+        } else {
+            iov[1].iov_base = stream->response;
+            iov[1].iov_len = sizeof(stream->response);
+        }
+
+        ret = nb_writev(conn->sock, iov, 2, &conn->frame_done, "client");
+        if (ret <= 0)
+            return ret;
+
+        metrics_add_sent(conn->frame_done);
+        stream->response_sent = true;
+        file_list_release(&stream->file_list);
+    } else {
+        // the frame header is held back to leave with the data
+        if (conn->frame_done < sizeof(struct frame_header)) {
+            ret = nb_write_more(conn->sock, &conn->frame, sizeof(struct frame_header),
+                                &conn->frame_done, "client");
+            if (ret <= 0)
+                return ret;
+        }
+
+        ret = send_body_chunk(conn->sock, &stream->body);
+        if (ret <= 0)
+            return ret;
+
+        metrics_add_sent(sizeof(struct frame_header));
+
+        // frames of many streams are interleaved, so buffers are not kept
+        buffer_put(stream->body.buffer);
+        stream->body.buffer = NULL;
+    }
+
+    conn->frame_started = false;
+    conn->streams = stream->next;
+    stream->next = NULL;
+
+    if (!conn->streams)
+        conn->streams_tail = NULL;
+
+    if (stream->body.bytes_left == 0) {
+        if (stream->send_start)
+            metrics_phase_done(METRICS_SEND, stream->send_start);
+
+        log_debug("successfully sent response to stream %u\n", stream->id);
+        stream_delete(stream);
+        --conn->streams_num;
+        return 1;
+    }
+
+    if (conn->streams_tail)
+        conn->streams_tail->next = stream;
+    else
+        conn->streams = stream;
+
+    conn->streams_tail = stream;
+    return 1;
+}
+
+// reads requests of a framed connection while there is room for their
+// streams, then sends one frame; returns -1 if the connection should be closed,
+// which is also when the client sent all its requests and all are answered
+static int framed_progress(struct connection* conn, struct server_config* config) {
+    int ret = 0;
+
+    while (!conn->read_closed && conn->streams_num < MAX_STREAMS
+           && (ret = read_framed_request(conn, config)) > 0) { }
+
+    if (ret < 0)
+        return -1;
+
+    // let other connections move forward after each frame
+    if (conn->streams && send_frame(conn) < 0)
+        return -1;
+
+    return conn->read_closed && !conn->streams ? -1 : 0;
+}
+
+// advances the connection's state machine as far as possible without blocking;
+// returns -1 if the connection should be closed
+static int conn_progress(struct connection* conn, struct server_config* config) {
+    int ret;
+
+    if (conn->framed)
+        return framed_progress(conn, config);
+
+    while (true) {
+        switch (conn->state) {
+            case READ_TYPE:
+                ret = nb_read(conn->sock, &conn->req_type, sizeof(uint16_t),
+                              &conn->done, "client");
+                if (ret <= 0)
+                    return ret;
+
+                conn->req_type = ntohs(conn->req_type);
+                conn->done = 0;
+                metrics_count_request(conn->req_type);
+                conn->phase_start = metrics_now();
+
+                if (conn->req_type == 1) {
+                    if (handle_list_request(conn, config) < 0)
+                        return -1;
+                } else if (conn->req_type == 2) {
+                    log_debug("received a request for file, waiting for params\n");
+                    conn->state = READ_PARAMS;
+                } else if (conn->req_type == 3) {
+                    conn->state = READ_BATCH_COUNT;
+                } else if (conn->req_type == 4) {
+                    conn->state = READ_VERSION;
+                } else if (conn->req_type == 5) {
+                    if (handle_stats_request(conn) < 0)
+                        return -1;
+                } else {
+                    log_warn("invalid request format\n");
+                }
+                break;
+
+            case READ_VERSION:
+                ret = nb_read(conn->sock, &conn->version, sizeof(uint16_t),
+                              &conn->done, "client");
+                if (ret <= 0)
+                    return ret;
+
+                conn->version = ntohs(conn->version);
+                conn->done = 0;
+                handle_version_request(conn);
+                break;
+
+            case READ_BATCH_COUNT:
+                ret = nb_read(conn->sock, &conn->batch_count, sizeof(uint16_t),
+                              &conn->done, "client");
+                if (ret <= 0)
+                    return ret;
+
+                conn->batch_count = ntohs(conn->batch_count);
+                conn->done = 0;
+
+                if (handle_batch_count(conn) < 0)
+                    return -1;
+                break;
+
+            case READ_PARAMS:
+                ret = read_file_params(conn);
+                if (ret <= 0)
+                    return ret;
+                break;
+
+            case READ_NAME:
+                ret = nb_read(conn->sock, conn->file_name, conn->f_info.name_len,
+                              &conn->done, "client");
+                if (ret <= 0)
+                    return ret;
+
+                conn->done = 0;
+
+                if (conn->req_type == 3) {
+                    if (handle_batch_entry(conn, config) < 0)
+                        return -1;
+                } else if (handle_file_request(conn, config) < 0) {
+                    return -1;
+                }
+                break;
+
+            case SEND_HEADER:
+                // the wide list header goes in one write with the list itself,
+                // that of a file fragment is held back to leave with the body
+                if (conn->file_list.data) {
+                    struct iovec iov[2] = {
+                        {conn->header, conn->header_len},
+                        {conn->file_list.data, conn->file_list.size}
+                    };
+
+                    ret = nb_writev(conn->sock, iov, 2, &conn->done, "client");
+                } else if (conn->body.file_fd >= 0) {
+                    ret = nb_write_more(conn->sock, conn->header, conn->header_len,
+                                        &conn->done, "client");
+                } else {
+                    ret = nb_write(conn->sock, conn->header, conn->header_len,
+                                   &conn->done, "client");
+                }
+                if (ret <= 0)
+                    return ret;
+
+                metrics_add_sent(conn->done);
+                conn->done = 0;
+
+                if (conn->file_list.data) {
+                    log_debug("successfully sent whole list, waiting for request\n");
+                    conn_end_request(conn);
+                    break;
+                }
+
+                if (conn->body.file_fd >= 0) {
+                    log_debug("sending... bytes left: %lu\n", conn->body.bytes_left);
+                    conn->state = SEND_BODY;
+                    break;
+                }
+
+                // a refused file request
+                if (conn->req_type == 2)
+                    metrics_phase_done(METRICS_SEND, conn->phase_start);
+
+                conn_end_request(conn);
+
+                if (conn->switch_to_framed) {
+                    log_debug("switched to framed protocol\n");
+                    conn->framed = true;
+                    conn->state = READ_FRAME_ID;
+                    return framed_progress(conn, config);
+                }
+                break;
+
+            case LOAD_CACHED: {
+                uint64_t count;
+
+                // only the edge matters, the eventfd is emptied for the next one
+                if (read(conn->load_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    syserr_noexit("reading eventfd");
+                    return -1;
+                }
+
+                ret = fragment_wait(&conn->fragment, conn->load_fd);
+                if (ret <= 0)
+                    return ret;
+
+                conn->state = SEND_CACHED;
+                break;
+            }
+
+            case SEND_CACHED:
+                ret = fragment_write(conn->sock, &conn->fragment);
+                if (ret <= 0)
+                    return ret;
+
+                metrics_phase_done(METRICS_SEND, conn->phase_start);
+                log_debug("successfully sent requested file fragment from cache\n");
+                conn_end_request(conn);
+                break;
+
+            case SEND_BATCH_HEADERS:
+                if (batch_has_bodies(&conn->batch))
+                    ret = nb_write_more(conn->sock, conn->batch.headers,
+                                        conn->batch.count * conn->batch.header_size,
+                                        &conn->done, "client");
+                else
+                    ret = nb_write(conn->sock, conn->batch.headers,
+                                   conn->batch.count * conn->batch.header_size,
+                                   &conn->done, "client");
+                if (ret <= 0)
+                    return ret;
+
+                metrics_add_sent(conn->done);
+                log_debug("successfully sent batch response headers\n");
+                conn->done = 0;
+
+                if (start_batch_body(conn, config) < 0)
+                    return -1;
+                break;
+
+            case SEND_LIST:
+                ret = nb_write(conn->sock, conn->file_list.data, conn->file_list.size,
+                               &conn->done, "client");
+                if (ret <= 0)
+                    return ret;
+
+                metrics_add_sent(conn->done);
+                log_debug("successfully sent whole list, waiting for request\n");
+                conn_end_request(conn);
+                break;
+
+            case SEND_BODY:
+                ret = send_body_chunk(conn->sock, &conn->body);
+                if (ret <= 0)
+                    return ret;
+
+                if (conn->body.bytes_left == 0) {
+                    log_debug("successfully sent requested file fragment\n");
+
+                    if (conn->req_type != 3) {
+                        metrics_phase_done(METRICS_SEND, conn->phase_start);
+                        conn_end_request(conn);
+                        break;
+                    }
+
+                    body_release(&conn->body);
+
+                    if (start_batch_body(conn, config) < 0)
+                        return -1;
+                    break;
+                }
+
+                // let other connections move forward before the next chunk
+                return 0;
+
+            case SEND_STATS:
+                ret = nb_write(conn->sock, conn->stats_buf->str, conn->stats_buf->used - 1,
+                               &conn->done, "client");
+                if (ret <= 0)
+                    return ret;
+
+                metrics_add_sent(conn->done);
+                log_debug("successfully sent stats\n");
+                conn_end_request(conn);
+                break;
+
+            default:
+                return -1;
+        }
+    }
+}
+
+// events a connection waits for in its current state
+static uint32_t conn_events(struct connection* conn) {
+    // the eventfd tells when the chunks are read
+    if (conn->state == LOAD_CACHED)
+        return 0;
+
+    if (!conn->framed)
+        return conn->state >= SEND_HEADER ? EPOLLOUT : EPOLLIN;
+
+    uint32_t events = !conn->read_closed && conn->streams_num < MAX_STREAMS ? EPOLLIN : 0;
+
+    if (conn->streams)
+        events |= EPOLLOUT;
+
+    return events;
+}
+
+static int accept_clients(int sock, int epoll_fd) {
+    struct sockaddr_in client_address;
+    socklen_t client_address_len;
+
+    while (true) {
+        client_address_len = sizeof(client_address);
+        int msg_sock = accept4(sock, (struct sockaddr *) &client_address,
+                               &client_address_len, SOCK_NONBLOCK);
+
+        if (msg_sock < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            syserr_noexit("accept");
+            // e.g. out of descriptors; try again on the next event
+            return 0;
+        }
+
+        set_nodelay(msg_sock);
+
+        struct connection* conn = conn_new(msg_sock, epoll_fd);
+
+        if (!conn) {
+            fprintf(stderr, "malloc for connection failed\n");
+            safe_close(msg_sock);
+            continue;
+        }
+
+        struct epoll_event event;
+        event.events = conn->events;
+        event.data.ptr = conn;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, msg_sock, &event) < 0) {
+            syserr_noexit("epoll_ctl");
+            conn_delete(conn);
+            continue;
+        }
+
+        log_info("connection accepted, waiting for request\n");
+    }
+}
+
+// deletes conn, whose socket and eventfd may both have events in one batch;
+// those left in the rest of the batch are marked as handled
+static void conn_delete_in_batch(struct connection* conn, struct epoll_event* rest,
+                                 int rest_num) {
+    for (int i = 0; i < rest_num; i++)
+        if (rest[i].data.ptr == conn)
+            rest[i].data.ptr = &deleted_conn;
+
+    conn_delete(conn);
+}
+
+int run_event_loop(int sock, struct server_config* config) {
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event event;
+
+    if (set_nonblocking(sock) < 0)
+        return -1;
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        syserr_noexit("epoll_create1");
+        return -1;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // listening socket
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0) {
+        syserr_noexit("epoll_ctl");
+        close(epoll_fd);
+        return -1;
+    }
+
+    while (true) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            syserr_noexit("epoll_wait");
+            close(epoll_fd);
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct connection* conn = events[i].data.ptr;
+
+            if (!conn) {
+                accept_clients(sock, epoll_fd);
+                continue;
+            }
+
+            if (conn == &deleted_conn)
+                continue;
+
+            if (conn_progress(conn, config) < 0) {
+                // closing the socket removes it from the epoll set
+                conn_delete_in_batch(conn, events + i + 1, n - i - 1);
+                continue;
+            }
+
+            uint32_t wanted = conn_events(conn);
+
+            if (wanted != conn->events) {
+                event.events = wanted;
+                event.data.ptr = conn;
+
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->sock, &event) < 0) {
+                    syserr_noexit("epoll_ctl");
+                    conn_delete_in_batch(conn, events + i + 1, n - i - 1);
+                    continue;
+                }
+
+                conn->events = wanted;
+            }
+        }
+    }
+}
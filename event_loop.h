@@ -0,0 +1,10 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "requests.h"
+
+/* Serves all clients of listening socket sock from a single thread, using
+ * epoll and non-blocking sockets. Returns only on fatal error. */
+int run_event_loop(int sock, struct server_config* config);
+
+#endif //EVENT_LOOP_H
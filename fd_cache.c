@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "err.h"
+#include "fd_cache.h"
+
+struct fd_entry {
+    struct fd_entry* next;     // in the bucket
+    struct fd_entry* newer;    // in the LRU list
+    struct fd_entry* older;
+    int fd;
+    struct stat f_stat;
+    size_t len;
+    char name[];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    bool enabled;
+    size_t capacity;
+    struct fd_entry** buckets;
+    size_t buckets_num;
+    struct fd_entry* newest;
+    struct fd_entry* oldest;
+    uint64_t generation;
+    struct fd_cache_stats stats;
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static uint64_t hash_name(const char* name, size_t len) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static struct fd_entry** entry_find(const char* name, size_t len) {
+    struct fd_entry** entry = &cache.buckets[hash_name(name, len) & (cache.buckets_num - 1)];
+
+    while (*entry && ((*entry)->len != len || memcmp((*entry)->name, name, len) != 0))
+        entry = &(*entry)->next;
+
+    return entry;
+}
+
+static void lru_unlink(struct fd_entry* entry) {
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        cache.newest = entry->older;
+
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        cache.oldest = entry->newer;
+}
+
+static void lru_push(struct fd_entry* entry) {
+    entry->newer = NULL;
+    entry->older = cache.newest;
+
+    if (cache.newest)
+        cache.newest->newer = entry;
+    else
+        cache.oldest = entry;
+
+    cache.newest = entry;
+}
+
+// removes the entry pointed to by link from its bucket and closes its file;
+// cache.lock must be held
+static void entry_remove(struct fd_entry** link) {
+    struct fd_entry* entry = *link;
+
+    *link = entry->next;
+    lru_unlink(entry);
+    close(entry->fd);
+    free(entry);
+    --cache.stats.entries;
+}
+
+int fd_cache_init(size_t capacity) {
+    size_t buckets_num = 1;
+
+    while (buckets_num < capacity)
+        buckets_num *= 2;
+
+    cache.buckets = calloc(buckets_num, sizeof(struct fd_entry*));
+
+    if (!cache.buckets) {
+        fprintf(stderr, "malloc for open file cache failed\n");
+        return -1;
+    }
+
+    cache.buckets_num = buckets_num;
+    cache.capacity = capacity;
+    cache.enabled = true;
+    return 0;
+}
+
+bool fd_cache_lookup(const char* file_name, int* fd, struct stat* f_stat) {
+    size_t len = strlen(file_name);
+    bool hit = false;
+
+    pthread_mutex_lock(&cache.lock);
+
+    if (!cache.enabled) {
+        pthread_mutex_unlock(&cache.lock);
+        return false;
+    }
+
+    struct fd_entry* entry = *entry_find(file_name, len);
+
+    // the duplicate is made under the lock, before the entry may be evicted
+    if (entry && (!fd || (*fd = fcntl(entry->fd, F_DUPFD_CLOEXEC, 0)) >= 0)) {
+        *f_stat = entry->f_stat;
+        lru_unlink(entry);
+        lru_push(entry);
+        hit = true;
+    }
+
+    if (hit)
+        ++cache.stats.hits;
+    else
+        ++cache.stats.misses;
+
+    pthread_mutex_unlock(&cache.lock);
+    return hit;
+}
+
+uint64_t fd_cache_generation(void) {
+    pthread_mutex_lock(&cache.lock);
+    uint64_t generation = cache.generation;
+    pthread_mutex_unlock(&cache.lock);
+
+    return generation;
+}
+
+void fd_cache_insert(const char* file_name, int fd, const struct stat* f_stat,
+                     uint64_t generation) {
+    size_t len = strlen(file_name);
+    struct fd_entry* entry = malloc(sizeof(struct fd_entry) + len + 1);
+
+    if (!entry)
+        return;
+
+    pthread_mutex_lock(&cache.lock);
+
+    // another connection could have cached the file in the meantime
+    if (!cache.enabled || cache.generation != generation || *entry_find(file_name, len)) {
+        pthread_mutex_unlock(&cache.lock);
+        free(entry);
+        return;
+    }
+
+    entry->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+    if (entry->fd < 0) {
+        syserr_noexit("fcntl");
+        pthread_mutex_unlock(&cache.lock);
+        free(entry);
+        return;
+    }
+
+    if (cache.stats.entries == cache.capacity) {
+        struct fd_entry* oldest = cache.oldest;
+
+        entry_remove(entry_find(oldest->name, oldest->len));
+        ++cache.stats.evictions;
+    }
+
+    entry->f_stat = *f_stat;
+    entry->len = len;
+    memcpy(entry->name, file_name, len + 1);
+
+    struct fd_entry** bucket = &cache.buckets[hash_name(file_name, len) & (cache.buckets_num - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    lru_push(entry);
+    ++cache.stats.entries;
+
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void fd_cache_invalidate(const char* file_name) {
+    pthread_mutex_lock(&cache.lock);
+
+    if (cache.enabled) {
+        struct fd_entry** entry = entry_find(file_name, strlen(file_name));
+
+        // files being opened at the moment may be the changed one as well
+        ++cache.generation;
+
+        if (*entry) {
+            entry_remove(entry);
+            ++cache.stats.invalidations;
+        }
+    }
+
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void fd_cache_clear(bool disable) {
+    pthread_mutex_lock(&cache.lock);
+
+    if (cache.enabled) {
+        ++cache.generation;
+
+        while (cache.oldest)
+            entry_remove(entry_find(cache.oldest->name, cache.oldest->len));
+
+        if (disable)
+            cache.enabled = false;
+    }
+
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void fd_cache_get_stats(struct fd_cache_stats* stats) {
+    pthread_mutex_lock(&cache.lock);
+    *stats = cache.stats;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void fd_cache_print_stats(void) {
+    struct fd_cache_stats current;
+    fd_cache_get_stats(&current);
+
+    printf("open file cache: %lu files, %lu hits, %lu misses, %lu evicted, "
+           "%lu invalidated\n",
+           current.entries, current.hits, current.misses, current.evictions,
+           current.invalidations);
+}
@@ -0,0 +1,54 @@
+#ifndef FD_CACHE_H
+#define FD_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* Open descriptors of regular files of the served directory with their stat
+ * results, shared by all connections and evicted in LRU order. Entries are dropped on
+ * inotify events of the directory, so the cache is only enabled while the
+ * directory is watched; changes made through hard links from outside of it
+ * are not seen. */
+
+struct fd_cache_stats {
+    uint64_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;    // entries dropped because their file changed
+};
+
+/* Enables the cache for up to capacity files. Should be called before the
+ * workers start. Returns -1 if memory cannot be allocated. */
+int fd_cache_init(size_t capacity);
+
+/* Looks up file_name. On a hit sets *f_stat to the stat result taken when the
+ * file was cached and, unless fd is NULL, *fd to a duplicate of the cached
+ * descriptor, which the caller has to close. The duplicate stays valid if the
+ * entry is evicted while the caller still uses it. */
+bool fd_cache_lookup(const char* file_name, int* fd, struct stat* f_stat);
+
+/* Returns the number of changes seen so far. It should be taken before the
+ * file is opened and passed to fd_cache_insert, so that a file which changed
+ * in the meantime is not cached. */
+uint64_t fd_cache_generation(void);
+
+/* Caches a duplicate of fd, the descriptor of regular file file_name with stat
+ * result f_stat, opened after generation was taken. */
+void fd_cache_insert(const char* file_name, int fd, const struct stat* f_stat,
+                     uint64_t generation);
+
+/* Drops file_name after it changed. */
+void fd_cache_invalidate(const char* file_name);
+
+/* Drops all entries, as changes may have been missed; with disable set the
+ * cache stays off from now on. */
+void fd_cache_clear(bool disable);
+
+void fd_cache_get_stats(struct fd_cache_stats* stats);
+
+void fd_cache_print_stats(void);
+
+#endif //FD_CACHE_H
@@ -0,0 +1,677 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "err.h"
+#include "file_list.h"
+#include "fd_cache.h"
+#include "log.h"
+
+// changes of contents only matter to the open file cache
+#define CONTENT_EVENTS (IN_MODIFY | IN_ATTRIB)
+#define WATCHED_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                        | IN_DELETE_SELF | IN_MOVE_SELF | CONTENT_EVENTS)
+
+#define EVENTS_BUF_SIZE (64*1024)
+#define DIR_BUF_SIZE (256*1024)
+
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct name_entry {
+    struct name_entry* next;
+    size_t len;
+    char name[];
+};
+
+// names of regular files in the served directory, kept in a hash set; the
+// serialized list is built from it on the first request after a change
+static struct {
+    pthread_mutex_t lock;
+    bool enabled;
+    char* dir_path;
+    int dir_fd;
+    int inotify_fd;
+    struct name_entry** buckets;
+    size_t buckets_num;
+    size_t names_num;
+    size_t names_len;          // total length of names with separators
+    struct file_list* list;    // NULL if it has to be rebuilt
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// when set, file type is always taken from fstatat, as on file systems
+// which do not fill d_type; used for comparison in file_list_benchmark
+static bool scan_force_stat = false;
+
+// calls add for name of every regular file in directory path_name; entries are
+// read in large batches and their type is taken from d_type when available
+static int scan_regular_files(char* const path_name,
+                              int (*add)(const char* name, void* arg), void* arg) {
+    int dir_fd = open(path_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        syserr_noexit("open");
+        return -1;
+    }
+
+    char* entries = malloc(DIR_BUF_SIZE);
+    if (!entries) {
+        fprintf(stderr, "malloc for directory entries failed\n");
+        close(dir_fd);
+        return -1;
+    }
+
+    int ret = 0;
+    long len;
+
+    while ((len = syscall(SYS_getdents64, dir_fd, entries, DIR_BUF_SIZE)) > 0) {
+        for (long pos = 0; pos < len; ) {
+            struct linux_dirent64* file = (struct linux_dirent64*) (entries + pos);
+            pos += file->d_reclen;
+
+            unsigned char type = scan_force_stat ? DT_UNKNOWN : file->d_type;
+
+            if (type == DT_UNKNOWN) {
+                struct stat file_info;
+
+                if (fstatat(dir_fd, file->d_name, &file_info, AT_SYMLINK_NOFOLLOW) < 0) {
+                    // the file may have been removed in the meantime
+                    if (errno != ENOENT) {
+                        syserr_noexit("fstatat");
+                        ret = -1;
+                        break;
+                    }
+
+                    continue;
+                }
+
+                if (S_ISREG(file_info.st_mode))
+                    type = DT_REG;
+            }
+
+            if (type == DT_REG && add(file->d_name, arg) < 0) {
+                ret = -1;
+                break;
+            }
+        }
+
+        if (ret < 0)
+            break;
+    }
+
+    if (len < 0) {
+        syserr_noexit("getdents64");
+        ret = -1;
+    }
+
+    free(entries);
+
+    if (close(dir_fd) < 0) {
+        syserr_noexit("close");
+        return -1;
+    }
+
+    return ret;
+}
+
+struct list_builder {
+    dyn_str* file_list;
+    uint64_t* fl_len;
+};
+
+static int add_to_list(const char* name, void* arg) {
+    struct list_builder* builder = arg;
+    size_t len = strlen(name);
+
+    if (!dyn_str_append(*builder->file_list, name, len)
+        || !dyn_str_add(*builder->file_list, '|')) {
+        fprintf(stderr, "malloc for dynamic string failed\n");
+        return -1;
+    }
+
+    *builder->fl_len += len + 1;
+    return 0;
+}
+
+int prepare_file_list(dyn_str* file_list, uint64_t* fl_len, char* const path_name) {
+    struct list_builder builder = { file_list, fl_len };
+    *fl_len = 0;
+
+    if (scan_regular_files(path_name, add_to_list, &builder) < 0)
+        return -1;
+
+    if (*fl_len != 0)
+        --(*fl_len); //truncate last separator
+
+    return 0;
+}
+
+// allocates list response for names of total length fl_len
+static struct file_list* file_list_new(uint64_t fl_len) {
+    struct file_list* list = malloc(sizeof(struct file_list)
+                                    + sizeof(struct fl_info) + fl_len);
+
+    if (!list) {
+        fprintf(stderr, "malloc for file list failed\n");
+        return NULL;
+    }
+
+    struct fl_info info;
+    info.msg_start = htons(1);
+    // cut for lists too long for the classic version, which are only sent
+    // with the wide header
+    info.fl_len = htonl(fl_len);
+    memcpy(list->data, &info, sizeof(struct fl_info));
+
+    list->refs = 1;
+    list->size = sizeof(struct fl_info) + fl_len;
+    return list;
+}
+
+static void file_list_put(struct file_list* list) {
+    if (list && __atomic_sub_fetch(&list->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(list);
+}
+
+static uint64_t hash_name(const char* name, size_t len) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static struct name_entry** names_find(const char* name, size_t len) {
+    struct name_entry** entry = &cache.buckets[hash_name(name, len) & (cache.buckets_num - 1)];
+
+    while (*entry && ((*entry)->len != len || memcmp((*entry)->name, name, len) != 0))
+        entry = &(*entry)->next;
+
+    return entry;
+}
+
+static int names_grow(void) {
+    size_t new_num = cache.buckets_num * 2;
+    struct name_entry** new_buckets = calloc(new_num, sizeof(struct name_entry*));
+
+    if (!new_buckets) {
+        fprintf(stderr, "malloc for file name set failed\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < cache.buckets_num; i++) {
+        struct name_entry* entry = cache.buckets[i];
+
+        while (entry) {
+            struct name_entry* next = entry->next;
+            size_t bucket = hash_name(entry->name, entry->len) & (new_num - 1);
+            entry->next = new_buckets[bucket];
+            new_buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+
+    free(cache.buckets);
+    cache.buckets = new_buckets;
+    cache.buckets_num = new_num;
+    return 0;
+}
+
+static int names_insert(const char* name, void* arg) {
+    (void) arg;
+    size_t len = strlen(name);
+
+    if (*names_find(name, len))
+        return 0;
+
+    if (cache.names_num >= cache.buckets_num && names_grow() < 0)
+        return -1;
+
+    struct name_entry* entry = malloc(sizeof(struct name_entry) + len + 1);
+
+    if (!entry) {
+        fprintf(stderr, "malloc for file name set failed\n");
+        return -1;
+    }
+
+    entry->len = len;
+    memcpy(entry->name, name, len + 1);
+
+    struct name_entry** bucket = &cache.buckets[hash_name(name, len) & (cache.buckets_num - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+
+    ++cache.names_num;
+    cache.names_len += len + 1;
+    return 0;
+}
+
+static void names_remove(const char* name) {
+    size_t len = strlen(name);
+    struct name_entry** entry = names_find(name, len);
+
+    if (*entry) {
+        struct name_entry* removed = *entry;
+        *entry = removed->next;
+        free(removed);
+
+        --cache.names_num;
+        cache.names_len -= len + 1;
+    }
+}
+
+static void names_clear(void) {
+    for (size_t i = 0; i < cache.buckets_num; i++) {
+        struct name_entry* entry = cache.buckets[i];
+
+        while (entry) {
+            struct name_entry* next = entry->next;
+            free(entry);
+            entry = next;
+        }
+
+        cache.buckets[i] = NULL;
+    }
+
+    cache.names_num = 0;
+    cache.names_len = 0;
+}
+
+static void invalidate_list(void) {
+    file_list_put(cache.list);
+    cache.list = NULL;
+}
+
+// cache.lock must be held
+static int rescan(void) {
+    names_clear();
+    invalidate_list();
+    return scan_regular_files(cache.dir_path, names_insert, NULL);
+}
+
+// cache.lock must be held
+static struct file_list* serialize_names(void) {
+    uint64_t fl_len = cache.names_num > 0 ? cache.names_len - 1 : 0;
+    struct file_list* list = file_list_new(fl_len);
+
+    if (!list)
+        return NULL;
+
+    char* pos = list->data + sizeof(struct fl_info);
+
+    for (size_t i = 0; i < cache.buckets_num; i++) {
+        for (struct name_entry* entry = cache.buckets[i]; entry; entry = entry->next) {
+            if (pos != list->data + sizeof(struct fl_info))
+                *pos++ = '|';
+
+            memcpy(pos, entry->name, entry->len);
+            pos += entry->len;
+        }
+    }
+
+    return list;
+}
+
+// applies one inotify event to the name set; cache.lock must be held
+static void apply_event(struct inotify_event* event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        log_warn("file list events lost, scanning directory again\n");
+        fd_cache_clear(false);
+
+        if (rescan() < 0)
+            cache.enabled = false;
+        return;
+    }
+
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        log_warn("served directory was removed or moved, file list cache disabled\n");
+        cache.enabled = false;
+        return;
+    }
+
+    if (event->len == 0)
+        return;
+
+    fd_cache_invalidate(event->name);
+
+    if (!(event->mask & ~(CONTENT_EVENTS | IN_ISDIR)))
+        return;
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        names_remove(event->name);
+    } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        // a new name may also replace an existing one, possibly by a link
+        struct stat file_info;
+
+        if (fstatat(cache.dir_fd, event->name, &file_info, AT_SYMLINK_NOFOLLOW) == 0
+            && S_ISREG(file_info.st_mode)) {
+            if (names_insert(event->name, NULL) < 0)
+                cache.enabled = false;
+        } else {
+            names_remove(event->name);
+        }
+    }
+
+    invalidate_list();
+}
+
+static void* watch_directory(void* arg) {
+    (void) arg;
+    char* events = malloc(EVENTS_BUF_SIZE);
+
+    if (!events) {
+        fprintf(stderr, "malloc for inotify events failed\n");
+        pthread_mutex_lock(&cache.lock);
+        cache.enabled = false;
+        pthread_mutex_unlock(&cache.lock);
+        return NULL;
+    }
+
+    while (true) {
+        ssize_t len = read(cache.inotify_fd, events, EVENTS_BUF_SIZE);
+
+        if (len < 0 && errno == EINTR)
+            continue;
+
+        if (len <= 0) {
+            syserr_noexit("reading inotify events");
+            break;
+        }
+
+        pthread_mutex_lock(&cache.lock);
+
+        for (char* pos = events; pos < events + len; ) {
+            struct inotify_event* event = (struct inotify_event*) pos;
+            apply_event(event);
+            pos += sizeof(struct inotify_event) + event->len;
+        }
+
+        bool enabled = cache.enabled;
+        pthread_mutex_unlock(&cache.lock);
+
+        if (!enabled)
+            break;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    cache.enabled = false;
+    names_clear();
+    invalidate_list();
+    pthread_mutex_unlock(&cache.lock);
+
+    // changes are not seen anymore, so open files cannot be cached either
+    fd_cache_clear(true);
+
+    close(cache.inotify_fd);
+    close(cache.dir_fd);
+    free(events);
+    return NULL;
+}
+
+int file_list_cache_start(char* const dir_path) {
+    cache.dir_path = dir_path;
+    cache.buckets_num = 1024;
+    cache.buckets = calloc(cache.buckets_num, sizeof(struct name_entry*));
+
+    if (!cache.buckets) {
+        fprintf(stderr, "malloc for file name set failed\n");
+        return -1;
+    }
+
+    cache.dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cache.dir_fd < 0) {
+        syserr_noexit("open");
+        return -1;
+    }
+
+    cache.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (cache.inotify_fd < 0) {
+        syserr_noexit("inotify_init1");
+        close(cache.dir_fd);
+        return -1;
+    }
+
+    // watch first, so that no change made during the scan is missed
+    if (inotify_add_watch(cache.inotify_fd, dir_path, WATCHED_EVENTS | IN_ONLYDIR) < 0) {
+        syserr_noexit("inotify_add_watch");
+        close(cache.inotify_fd);
+        close(cache.dir_fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    int ret = rescan();
+    cache.enabled = ret == 0;
+    pthread_mutex_unlock(&cache.lock);
+
+    if (ret < 0) {
+        close(cache.inotify_fd);
+        close(cache.dir_fd);
+        return -1;
+    }
+
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, watch_directory, NULL);
+
+    if (err != 0) {
+        errno = err;
+        syserr_noexit("pthread_create");
+        pthread_mutex_lock(&cache.lock);
+        cache.enabled = false;
+        names_clear();
+        pthread_mutex_unlock(&cache.lock);
+        close(cache.inotify_fd);
+        close(cache.dir_fd);
+        return -1;
+    }
+
+    pthread_detach(thread);
+    return 0;
+}
+
+// builds list response in buffer by scanning the directory
+static int scan_file_list(char* const dir_path, dyn_str* buffer,
+                          struct list_response* response) {
+    uint64_t fl_len;
+    struct fl_info info;
+
+    if (!*buffer) {
+        *buffer = dyn_str_init();
+
+        if (!*buffer) {
+            fprintf(stderr, "malloc for dynamic string failed\n");
+            return -1;
+        }
+    }
+
+    // the header is filled in when the length is known
+    dyn_str_clear(*buffer);
+
+    if (!dyn_str_append(*buffer, (char*) &info, sizeof(struct fl_info))) {
+        fprintf(stderr, "malloc for dynamic string failed\n");
+        return -1;
+    }
+
+    if (prepare_file_list(buffer, &fl_len, dir_path) < 0)
+        return -1;
+
+    info.msg_start = htons(1);
+    info.fl_len = htonl(fl_len);
+    memcpy((*buffer)->str, &info, sizeof(struct fl_info));
+
+    response->data = (*buffer)->str;
+    response->size = sizeof(struct fl_info) + fl_len;
+    response->shared = NULL;
+    return 0;
+}
+
+// refuses response if its names do not fit in the classic header's 32-bit
+// length
+static int check_list_size(struct list_response* response, bool wide) {
+    if (wide || response->size - sizeof(struct fl_info) <= UINT32_MAX)
+        return 0;
+
+    fprintf(stderr, "file list of %lu bytes is too long for the classic version\n",
+            response->size - sizeof(struct fl_info));
+    file_list_release(response);
+    return -1;
+}
+
+int file_list_get(char* const dir_path, dyn_str* buffer, bool wide,
+                  struct list_response* response) {
+    pthread_mutex_lock(&cache.lock);
+
+    if (!cache.enabled) {
+        pthread_mutex_unlock(&cache.lock);
+
+        if (scan_file_list(dir_path, buffer, response) < 0)
+            return -1;
+
+        return check_list_size(response, wide);
+    }
+
+    if (!cache.list)
+        cache.list = serialize_names();
+
+    struct file_list* list = cache.list;
+
+    if (list)
+        __atomic_add_fetch(&list->refs, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&cache.lock);
+
+    if (!list)
+        return -1;
+
+    response->data = list->data;
+    response->size = list->size;
+    response->shared = list;
+    return check_list_size(response, wide);
+}
+
+void file_list_wide_header(struct list_response* response, struct fl_info64* header) {
+    header->msg_start = htons(1);
+    header->fl_len = htobe64(response->size - sizeof(struct fl_info));
+    response->data += sizeof(struct fl_info);
+    response->size -= sizeof(struct fl_info);
+}
+
+void file_list_release(struct list_response* response) {
+    file_list_put(response->shared);
+    response->shared = NULL;
+    response->data = NULL;
+    response->size = 0;
+}
+
+static int count_file(const char* name, void* arg) {
+    (void) name;
+    ++*(long*) arg;
+    return 0;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// times scans of dir_path, with d_type or forced fstatat
+static int time_scans(char* const dir_path, bool force_stat, int rounds) {
+    double best = -1;
+    long found = 0;
+
+    scan_force_stat = force_stat;
+
+    for (int i = 0; i < rounds; i++) {
+        found = 0;
+        double start = now_ms();
+
+        if (scan_regular_files(dir_path, count_file, &found) < 0) {
+            scan_force_stat = false;
+            return -1;
+        }
+
+        double elapsed = now_ms() - start;
+        if (best < 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    scan_force_stat = false;
+    printf("%-16s %ld files, best of %d: %.2f ms (%.0f files/s)\n",
+           force_stat ? "fstatat each:" : "d_type:", found, rounds, best,
+           best > 0 ? found / best * 1000 : 0);
+    return 0;
+}
+
+int file_list_benchmark(char* const dir_path, long files_num) {
+    if (mkdir(dir_path, 0700) < 0) {
+        syserr_noexit("mkdir");
+        return -1;
+    }
+
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        syserr_noexit("open");
+        return -1;
+    }
+
+    char name[32];
+    int ret = 0;
+
+    printf("creating %ld files in %s\n", files_num, dir_path);
+
+    for (long i = 0; i < files_num && ret == 0; i++) {
+        sprintf(name, "file_%08ld", i);
+        int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+        if (fd < 0) {
+            syserr_noexit("openat");
+            ret = -1;
+        } else {
+            close(fd);
+        }
+    }
+
+    if (ret == 0)
+        ret = time_scans(dir_path, false, 5);
+
+    if (ret == 0)
+        ret = time_scans(dir_path, true, 5);
+
+    printf("removing generated files\n");
+
+    for (long i = 0; i < files_num; i++) {
+        sprintf(name, "file_%08ld", i);
+        unlinkat(dir_fd, name, 0);
+    }
+
+    close(dir_fd);
+
+    if (rmdir(dir_path) < 0)
+        syserr_noexit("rmdir");
+
+    return ret;
+}
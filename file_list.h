@@ -0,0 +1,55 @@
+#ifndef FILE_LIST_H
+#define FILE_LIST_H
+
+#include <stddef.h>
+
+#include "utilities.h"
+#include "dynamic_string.h"
+
+/* Complete response to a file list request: fl_info followed by names of
+ * regular files separated by '|'. Shared between connections, read only. */
+struct file_list {
+    int refs;
+    size_t size;
+    char data[];
+};
+
+/* Appends names of all regular files in directory path_name to file_list,
+ * separated by '|'. Returns -1 on error. */
+int prepare_file_list(dyn_str* file_list, uint64_t* fl_len, char* const path_name);
+
+/* Starts keeping the list of directory dir_path in memory, updated from
+ * inotify events. Returns -1 if that is not possible; file_list_get then
+ * scans the directory on every call. */
+int file_list_cache_start(char* const dir_path);
+
+/* List response being sent: data points either into a shared struct file_list
+ * or into a buffer of the connection. */
+struct list_response {
+    char* data;
+    size_t size;
+    struct file_list* shared;   // NULL if data is in connection's buffer
+};
+
+/* Fills response with the current list response for directory dir_path. If
+ * the list is not kept in memory, the directory is scanned into *buffer, which
+ * is allocated on first use and should be kept for the following requests of
+ * the connection. Returns -1 on error, which includes a list of 4 GiB or more
+ * asked for in the classic version (wide not set), whose header cannot hold
+ * its length. */
+int file_list_get(char* const dir_path, dyn_str* buffer, bool wide,
+                  struct list_response* response);
+
+/* Prepares response to be sent in the wide protocol version: fills header,
+ * which has to be sent first, and leaves the classic header out of response's
+ * data. */
+void file_list_wide_header(struct list_response* response, struct fl_info64* header);
+
+/* Releases response got from file_list_get; does nothing if it is empty. */
+void file_list_release(struct list_response* response);
+
+/* Creates directory dir_path with files_num empty files, prints how long it
+ * takes to scan it and removes it. Returns -1 on error. */
+int file_list_benchmark(char* const dir_path, long files_num);
+
+#endif //FILE_LIST_H
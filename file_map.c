@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "err.h"
+#include "file_map.h"
+
+// how far ahead of the data being sent the kernel is asked to read
+#define READAHEAD_SIZE (2*1024*1024)
+
+struct file_map {
+    struct file_map* next;     // in the bucket
+    struct file_map* newer;    // in the LRU list
+    struct file_map* older;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;     // of the file when it was mapped
+    uint64_t size;
+    int refs;                  // connections sending from the mapping, and the cache
+    char* data;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    bool enabled;
+    size_t capacity;
+    size_t page_size;
+    struct file_map** buckets;
+    size_t buckets_num;
+    struct file_map* newest;
+    struct file_map* oldest;
+    struct file_map_stats stats;
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static struct file_map** map_find(dev_t dev, ino_t ino) {
+    uint64_t hash = (dev * 0x9E3779B97F4A7C15ULL) ^ (ino * 0xC2B2AE3D27D4EB4FULL);
+    struct file_map** map = &cache.buckets[(hash ^ (hash >> 29)) & (cache.buckets_num - 1)];
+
+    while (*map && ((*map)->ino != ino || (*map)->dev != dev))
+        map = &(*map)->next;
+
+    return map;
+}
+
+static void lru_unlink(struct file_map* map) {
+    if (map->newer)
+        map->newer->older = map->older;
+    else
+        cache.newest = map->older;
+
+    if (map->older)
+        map->older->newer = map->newer;
+    else
+        cache.oldest = map->newer;
+}
+
+static void lru_push(struct file_map* map) {
+    map->newer = NULL;
+    map->older = cache.newest;
+
+    if (cache.newest)
+        cache.newest->newer = map;
+    else
+        cache.oldest = map;
+
+    cache.newest = map;
+}
+
+void file_map_put(struct file_map* map) {
+    if (!map || __atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    if (munmap(map->data, map->size) < 0)
+        syserr_noexit("munmap");
+
+    free(map);
+}
+
+// drops the mapping pointed to by link from the cache; connections still
+// sending from it keep it alive. cache.lock must be held
+static void map_remove(struct file_map** link) {
+    struct file_map* map = *link;
+
+    *link = map->next;
+    lru_unlink(map);
+    --cache.stats.maps;
+    cache.stats.bytes -= map->size;
+    file_map_put(map);
+}
+
+// maps file fd described by f_stat and caches the mapping; cache.lock must be
+// held. Returns NULL on error
+static struct file_map* map_insert(int fd, const struct stat* f_stat) {
+    struct file_map* map = malloc(sizeof(struct file_map));
+
+    if (!map) {
+        fprintf(stderr, "malloc for file mapping failed\n");
+        return NULL;
+    }
+
+    map->data = mmap(NULL, f_stat->st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (map->data == MAP_FAILED) {
+        syserr_noexit("mmap");
+        free(map);
+        return NULL;
+    }
+
+    // fragments are mostly sent from their beginning to the end
+    if (madvise(map->data, f_stat->st_size, MADV_SEQUENTIAL) < 0)
+        syserr_noexit("madvise");
+
+    if (cache.stats.maps == cache.capacity) {
+        struct file_map* oldest = cache.oldest;
+
+        map_remove(map_find(oldest->dev, oldest->ino));
+        ++cache.stats.evictions;
+    }
+
+    struct file_map** link = map_find(f_stat->st_dev, f_stat->st_ino);
+
+    map->dev = f_stat->st_dev;
+    map->ino = f_stat->st_ino;
+    map->mtime = f_stat->st_mtim;
+    map->size = f_stat->st_size;
+    map->refs = 1;
+    map->next = *link;
+    *link = map;
+    lru_push(map);
+    ++cache.stats.maps;
+    cache.stats.bytes += map->size;
+
+    return map;
+}
+
+int file_map_init(size_t capacity) {
+    size_t buckets_num = 1;
+
+    while (buckets_num < capacity)
+        buckets_num *= 2;
+
+    cache.buckets = calloc(buckets_num, sizeof(struct file_map*));
+
+    if (!cache.buckets) {
+        fprintf(stderr, "malloc for file mappings failed\n");
+        return -1;
+    }
+
+    cache.buckets_num = buckets_num;
+    cache.capacity = capacity;
+    cache.page_size = sysconf(_SC_PAGESIZE);
+    cache.enabled = true;
+    return 0;
+}
+
+struct file_map* file_map_get(int fd, const struct stat* f_stat, uint64_t end) {
+    if (!cache.enabled)
+        return NULL;
+
+    // a file cut after f_stat was taken is caught by sends failing with EFAULT
+    if (f_stat->st_size == 0 || (uint64_t) f_stat->st_size < end)
+        return NULL;
+
+    pthread_mutex_lock(&cache.lock);
+
+    struct file_map** link = map_find(f_stat->st_dev, f_stat->st_ino);
+    struct file_map* map = *link;
+
+    if (map && (map->mtime.tv_sec != f_stat->st_mtim.tv_sec
+                || map->mtime.tv_nsec != f_stat->st_mtim.tv_nsec
+                || map->size != (uint64_t) f_stat->st_size)) {
+        map_remove(link);
+        ++cache.stats.invalidations;
+        map = NULL;
+    }
+
+    if (map) {
+        lru_unlink(map);
+        lru_push(map);
+        ++cache.stats.hits;
+    } else {
+        map = map_insert(fd, f_stat);
+        ++cache.stats.misses;
+    }
+
+    if (map)
+        __atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&cache.lock);
+    return map;
+}
+
+char* file_map_data(struct file_map* map) {
+    return map->data;
+}
+
+void file_map_advise(struct file_map* map, uint64_t offset, uint64_t len) {
+    uint64_t start = offset & ~(uint64_t) (cache.page_size - 1);
+    uint64_t end = offset + (len < READAHEAD_SIZE ? len : READAHEAD_SIZE);
+
+    if (end > map->size)
+        end = map->size;
+
+    // only a hint: a failure just leaves reading to page faults
+    if (start < end)
+        madvise(map->data + start, end - start, MADV_WILLNEED);
+}
+
+void file_map_get_stats(struct file_map_stats* stats) {
+    pthread_mutex_lock(&cache.lock);
+    *stats = cache.stats;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void file_map_print_stats(void) {
+    struct file_map_stats current;
+    file_map_get_stats(&current);
+
+    printf("file mappings: %lu files, %lu MiB mapped, %lu hits, %lu misses, "
+           "%lu evicted, %lu invalidated\n",
+           current.maps, current.bytes / (1024 * 1024), current.hits, current.misses,
+           current.evictions, current.invalidations);
+}
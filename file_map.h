@@ -0,0 +1,51 @@
+#ifndef FILE_MAP_H
+#define FILE_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* Files mapped into memory whole, shared by all connections sending them, so
+ * fragments are written to sockets straight from the page cache without being
+ * copied to a transfer buffer first. Mappings are keyed by file (device and
+ * inode); those made before the last change of the file's mtime or size are
+ * dropped. Evicted in LRU order when there are too many.
+ * Mapped memory is only ever read by the kernel, in write or send: if the file
+ * is truncated in the middle of a transfer, the missing pages make the call
+ * fail with EFAULT instead of raising SIGBUS in the server. */
+
+struct file_map;
+
+struct file_map_stats {
+    uint64_t maps;             // mappings kept
+    uint64_t bytes;            // mapped by them
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;    // mappings dropped as their file changed
+};
+
+/* Enables mapping, keeping up to capacity files mapped. Should be called
+ * before the workers start. Returns -1 if memory cannot be allocated. */
+int file_map_init(size_t capacity);
+
+/* Returns a pinned mapping of file fd, whose stat result from when it was
+ * opened is f_stat and which has to hold at least end bytes, or NULL if it
+ * cannot be mapped (mapping disabled, file shorter or empty, or error); the
+ * file should then be sent as usual. */
+struct file_map* file_map_get(int fd, const struct stat* f_stat, uint64_t end);
+
+char* file_map_data(struct file_map* map);
+
+/* Asks the kernel to read the beginning of len bytes of map starting at offset
+ * ahead; should be called as sending of them goes on. */
+void file_map_advise(struct file_map* map, uint64_t offset, uint64_t len);
+
+/* Unpins map; does nothing for NULL. */
+void file_map_put(struct file_map* map);
+
+void file_map_get_stats(struct file_map_stats* stats);
+
+void file_map_print_stats(void);
+
+#endif //FILE_MAP_H
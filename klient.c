@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -7,14 +9,1577 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+
+#include "err.h"
+#include "utilities.h"
+#include "buffer_pool.h"
+#include "log.h"
+#include "trace.h"
+
+#define MAX_CONNECTIONS  64
+#define WHOLE_FILE       UINT64_MAX
+#define WRITE_BUFFERS    4
+#define MAX_WRITE_BUFFERS 64
+#define DIRECT_ALIGN     4096
+#define SYNC_BYTES       (64*1024*1024)
+#define SPLICE_UNSUPPORTED (-2)
+#define DOWNLOAD_REFUSED 1
+
+#define USAGE "Usage: %s [--connections <n>] [--batch <list-file> [--framed]] " \
+              "[--get <name-or-pattern>[:<begin>-<end>] | --get -]... [--stats] " \
+              "[--write-buffers <n>] [--direct | --splice] [--trace <file>] " \
+              "<server-name-or-ip4-address> [<port-number>]"
+
+// how received data is written to output files
+static struct {
+    int buffers;                // per transfer; with 1 it is received and written in turn
+    bool direct;                // aligned chunks written with O_DIRECT, synced in batches
+    bool splice;                // moved from socket to file through a pipe
+} output = {
+    .buffers = WRITE_BUFFERS
+};
+
+// part of the chosen range downloaded over one connection
+struct segment {
+    struct addrinfo* addr;
+    int sock;                   // -1 if the segment should open its own connection
+    char* name;
+    uint64_t begin;
+    uint64_t len;
+    bool wide;                  // version negotiated on the first connection
+    bool first;                 // only the first part may not be refused
+    bool verbose;
+    uint64_t received;
+    bool refused;               // the connection can still be used
+    int result;
+};
+
+int connect_to_server(struct addrinfo* addr) {
+    int sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+
+    if (sock < 0) {
+        syserr_noexit("socket");
+        return -1;
+    }
+
+    uint64_t start = trace_begin();
+
+    if (connect(sock, addr->ai_addr, addr->ai_addrlen) < 0) {
+        syserr_noexit("connect");
+        close(sock);
+        return -1;
+    }
+
+    trace_end("connect", start);
+    return sock;
+}
+
+// opens tmp/<name> for writing, creating it if needed
+int open_output_file(char* const name) {
+    char path[MAX_PATH_LEN+5] = "tmp/";
+    strcat(path, name);
+
+    if (mkdir("./tmp", 0700) < 0 && errno != EEXIST) {
+        syserr_noexit("mkdir");
+        return -1;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT, 0666);
+
+    if (fd < 0)
+        syserr_noexit("open");
+
+    return fd;
+}
+
+// opens tmp/<name>, already created, for writing around the page cache;
+// returns -1 if the file system does not support that
+int open_direct_output(char* const name) {
+    char path[MAX_PATH_LEN+5] = "tmp/";
+    strcat(path, name);
+
+    int fd = open(path, O_WRONLY | O_DIRECT);
+
+    if (fd < 0)
+        syserr_noexit("cannot write tmp/%s directly, using page cache", name);
+
+    return fd;
+}
+
+// CPU time used by all threads of the client so far, in seconds
+double cpu_seconds(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+           + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// sends a file list request and reads the list into *file_list, allocated,
+// or NULL if it is empty; returns -1 on error
+int fetch_file_list(int sock, bool wide, char** file_list, uint64_t* len) {
+    uint16_t request_type = htons(1);
+    uint16_t msg_start;
+
+    *file_list = NULL;
+
+    if (safe_write(sock, &request_type, sizeof(uint16_t), "server") < 0)
+        return -1;
+
+    if (wide) {
+        struct fl_info64 info;
+
+        if (safe_read(sock, &info, sizeof(struct fl_info64), "server") < 0)
+            return -1;
+
+        msg_start = ntohs(info.msg_start);
+        *len = be64toh(info.fl_len);
+    } else {
+        struct fl_info info;
+
+        if (safe_read(sock, &info, sizeof(struct fl_info), "server") < 0)
+            return -1;
+
+        msg_start = ntohs(info.msg_start);
+        *len = ntohl(info.fl_len);
+    }
+
+    if (msg_start != 1) {
+        printf("invalid response from server\n");
+        return -1;
+    }
+
+    if (*len == 0)
+        return 0;
+
+    *file_list = malloc(*len);
+
+    if (!*file_list) {
+        fprintf(stderr, "malloc for file list failed\n");
+        return -1;
+    }
+
+    if (safe_read(sock, *file_list, *len, "server") < 0) {
+        free(*file_list);
+        *file_list = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+// whether a fragment can be asked for in the classic 32-bit messages
+bool fits_classic(uint64_t begin, uint64_t len) {
+    return begin <= UINT32_MAX && (len <= UINT32_MAX || len == WHOLE_FILE);
+}
+
+// writes params of a file request in the wide or the classic version to out;
+// returns their size
+size_t encode_file_params(bool wide, uint64_t begin, uint64_t len, uint16_t name_len,
+                          char* out) {
+    if (wide) {
+        struct f_req_params64 f_info = {
+            .begin_addr = htobe64(begin),
+            .part_len = htobe64(len),
+            .name_len = htons(name_len)
+        };
+
+        memcpy(out, &f_info, sizeof(struct f_req_params64));
+        return sizeof(struct f_req_params64);
+    }
+
+    struct f_req_params f_info = {
+        .begin_addr = htonl(begin),
+        .part_len = htonl(len < UINT32_MAX ? len : UINT32_MAX),
+        .name_len = htons(name_len)
+    };
+
+    memcpy(out, &f_info, sizeof(struct f_req_params));
+    return sizeof(struct f_req_params);
+}
+
+size_t response_size(bool wide) {
+    return wide ? sizeof(struct response_info64) : sizeof(struct response_info);
+}
+
+// decodes a file response in the wide or the classic version into r_info in
+// host byte order
+void decode_response(const char* in, bool wide, struct response_info64* r_info) {
+    if (wide) {
+        memcpy(r_info, in, sizeof(struct response_info64));
+        r_info->msg_start = ntohs(r_info->msg_start);
+        r_info->second_param = be64toh(r_info->second_param);
+    } else {
+        struct response_info classic;
+
+        memcpy(&classic, in, sizeof(struct response_info));
+        r_info->msg_start = ntohs(classic.msg_start);
+        r_info->second_param = ntohl(classic.second_param);
+    }
+}
+
+// sends file request for len bytes of file name starting at begin and reads
+// the response
+int request_part(int sock, bool wide, char* const name, uint64_t begin, uint64_t len,
+                 struct response_info64* r_info) {
+    uint16_t name_len = strlen(name);
+    uint16_t request_type = htons(2);
+    char request[sizeof(uint16_t) + sizeof(struct f_req_params64) + MAX_PATH_LEN];
+    char response[sizeof(struct response_info64)];
+    size_t size = sizeof(uint16_t);
+
+    memcpy(request, &request_type, sizeof(uint16_t));
+    size += encode_file_params(wide, begin, len, name_len, request + size);
+    memcpy(request + size, name, name_len);
+    size += name_len;
+
+    uint64_t start = trace_begin();
+
+    if (safe_write(sock, request, size, "server") < 0)
+        return -1;
+
+    if (safe_read(sock, response, response_size(wide), "server") < 0)
+        return -1;
+
+    trace_end("request", start);
+    decode_response(response, wide, r_info);
+
+    return 0;
+}
+
+// asks the server to speak protocol version wanted; *version is set to the
+// version it chose
+int negotiate_version(int sock, uint16_t wanted, uint16_t* version) {
+    uint16_t request[2] = {htons(4), htons(wanted)};
+    struct response_info r_info;
+
+    if (safe_write(sock, request, sizeof(request), "server") < 0
+        || safe_read(sock, &r_info, sizeof(struct response_info), "server") < 0)
+        return -1;
+
+    if (ntohs(r_info.msg_start) != 4) {
+        printf("invalid response from server\n");
+        return -1;
+    }
+
+    *version = ntohl(r_info.second_param);
+    printf("server speaks protocol version %u\n", *version);
+    return 0;
+}
+
+void print_refusal(uint64_t reason) {
+    switch (reason) {
+        case 1:
+            printf("refuse: wrong filename\n");
+            break;
+
+        case 2:
+            printf("refuse: invalid begin address\n");
+            break;
+
+        case 3:
+            printf("refuse: part length is 0\n");
+            break;
+
+        default:
+            printf("invalid response from server\n");
+    }
+}
+
+int write_at(int fd, char* buffer, size_t count, uint64_t offset) {
+    for (size_t written = 0; written < count; ) {
+        ssize_t len = pwrite(fd, buffer + written, count - written, offset + written);
+
+        if (len < 0) {
+            syserr_noexit("pwrite");
+            return -1;
+        }
+
+        written += len;
+    }
+
+    return 0;
+}
+
+// filled buffers passed from the thread receiving a part to the one writing
+// it, so that neither the socket nor the disk waits for the other
+struct write_ring {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // a buffer was filled or written, or the transfer ended
+    char* buffers[MAX_WRITE_BUFFERS];
+    size_t lens[MAX_WRITE_BUFFERS];
+    uint64_t offsets[MAX_WRITE_BUFFERS];
+    int size;
+    int first;                  // the oldest filled buffer
+    int filled;
+    bool received;              // nothing more will be filled
+    bool failed;                // either side stops the other this way
+    int fd;
+    int direct_fd;              // -1 if all writes go through the page cache
+    uint64_t unsynced;          // bytes written directly since the last fdatasync
+};
+
+// writes count bytes of buffer to the output at offset; with a direct
+// descriptor the aligned part goes around the page cache, and it is synced
+// once SYNC_BYTES were written so
+int write_output(struct write_ring* ring, char* buffer, size_t count, uint64_t offset) {
+    uint64_t start = trace_begin();
+    int ret = 0;
+
+    if (ring->direct_fd >= 0 && offset % DIRECT_ALIGN == 0) {
+        size_t direct_len = count - count % DIRECT_ALIGN;
+
+        if (direct_len > 0 && write_at(ring->direct_fd, buffer, direct_len, offset) < 0)
+            return -1;
+
+        ring->unsynced += direct_len;
+
+        if (ring->unsynced >= SYNC_BYTES) {
+            if (fdatasync(ring->direct_fd) < 0) {
+                syserr_noexit("fdatasync");
+                return -1;
+            }
+
+            ring->unsynced = 0;
+        }
+
+        buffer += direct_len;
+        count -= direct_len;
+        offset += direct_len;
+    }
+
+    if (count > 0)
+        ret = write_at(ring->fd, buffer, count, offset);
+
+    trace_end("write", start);
+    return ret;
+}
+
+// length of the next chunk of a transfer at offset with bytes_left bytes left;
+// chunks end at aligned offsets, as writes around the page cache need
+size_t next_chunk_size(uint64_t offset, uint64_t bytes_left) {
+    size_t chunk_size = MAX_CHUNK_SIZE - offset % DIRECT_ALIGN;
+
+    return chunk_size < bytes_left ? chunk_size : bytes_left;
+}
+
+// writes buffers of the ring as they get filled
+void* write_received(void* arg) {
+    struct write_ring* ring = arg;
+
+    pthread_mutex_lock(&ring->lock);
+
+    while (true) {
+        while (ring->filled == 0 && !ring->received && !ring->failed)
+            pthread_cond_wait(&ring->changed, &ring->lock);
+
+        if (ring->failed || ring->filled == 0)
+            break;
+
+        int i = ring->first;
+
+        pthread_mutex_unlock(&ring->lock);
+        int ret = write_output(ring, ring->buffers[i], ring->lens[i], ring->offsets[i]);
+        pthread_mutex_lock(&ring->lock);
+
+        if (ret < 0) {
+            ring->failed = true;
+        } else {
+            ring->first = (i + 1) % ring->size;
+            --ring->filled;
+        }
+
+        pthread_cond_broadcast(&ring->changed);
+    }
+
+    pthread_mutex_unlock(&ring->lock);
+
+    return NULL;
+}
+
+// receives bytes_left bytes from sock to the buffers of ring, which are
+// written to the output at offset by another thread; returns -1 on failure
+// of either
+int receive_to_ring(int sock, struct write_ring* ring, uint64_t offset, uint64_t bytes_left,
+                    bool verbose) {
+    pthread_t writer;
+    bool failed = false;
+
+    errno = pthread_create(&writer, NULL, write_received, ring);
+    if (errno != 0) {
+        syserr_noexit("pthread_create");
+        return -1;
+    }
+
+    while (bytes_left > 0 && !failed) {
+        size_t chunk_size = next_chunk_size(offset, bytes_left);
+
+        pthread_mutex_lock(&ring->lock);
+
+        while (ring->filled == ring->size && !ring->failed)
+            pthread_cond_wait(&ring->changed, &ring->lock);
+
+        int i = (ring->first + ring->filled) % ring->size;
+        failed = ring->failed;
+
+        pthread_mutex_unlock(&ring->lock);
+
+        if (failed)
+            break;
+
+        uint64_t start = trace_begin();
+
+        failed = safe_read(sock, ring->buffers[i], chunk_size, "server") < 0;
+        trace_end("read", start);
+
+        pthread_mutex_lock(&ring->lock);
+
+        if (failed) {
+            ring->failed = true;
+        } else {
+            ring->lens[i] = chunk_size;
+            ring->offsets[i] = offset;
+            ++ring->filled;
+        }
+
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+
+        offset += chunk_size;
+        bytes_left -= chunk_size;
+
+        if (verbose)
+            log_debug("downloading... bytes left: %lu\n", bytes_left);
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    ring->received = true;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+
+    pthread_join(writer, NULL);
+
+    return ring->failed ? -1 : 0;
+}
+
+// moves bytes_left bytes from sock to fd at offset through a pipe, so that
+// they are never copied to user space; returns SPLICE_UNSUPPORTED, with
+// nothing received, if the socket cannot be spliced from
+int splice_part(int sock, int fd, uint64_t offset, uint64_t bytes_left, bool verbose) {
+    int pipe_fds[2];
+    bool started = false;
+    int ret = 0;
+
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        syserr_noexit("pipe2");
+        return -1;
+    }
+
+    // let a whole chunk fit in the pipe; a smaller pipe only means more,
+    // shorter splices
+    fcntl(pipe_fds[0], F_SETPIPE_SZ, MAX_CHUNK_SIZE);
+
+    while (bytes_left > 0) {
+        size_t chunk_size = bytes_left < MAX_CHUNK_SIZE ? bytes_left : MAX_CHUNK_SIZE;
+        uint64_t start = trace_begin();
+        ssize_t len = splice(sock, NULL, pipe_fds[1], NULL, chunk_size,
+                             SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        if (len < 0 && errno == EINTR)
+            continue;
+
+        if (len < 0 && errno == EINVAL && !started) {
+            ret = SPLICE_UNSUPPORTED;
+            break;
+        }
+
+        if (len <= 0) {
+            if (len == 0)
+                printf("server has disconnected\n");
+            else
+                syserr_noexit("splicing from server socket");
+            ret = -1;
+            break;
+        }
+
+        started = true;
+
+        // the pipe is emptied before the next splice from the socket
+        for (ssize_t moved = 0; moved < len && ret == 0; ) {
+            loff_t off = offset;
+            ssize_t out = splice(pipe_fds[0], NULL, fd, &off, len - moved, SPLICE_F_MOVE);
+
+            if (out < 0 && errno == EINTR)
+                continue;
+
+            if (out <= 0) {
+                syserr_noexit("splicing to output file");
+                ret = -1;
+            } else {
+                moved += out;
+                offset += out;
+            }
+        }
+
+        if (ret < 0)
+            break;
+
+        trace_end("splice", start);
+        bytes_left -= len;
+
+        if (verbose)
+            log_debug("downloading... bytes left: %lu\n", bytes_left);
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+    return ret;
+}
+
+// reads bytes_left bytes from sock and writes them to fd, the output file
+// tmp/<name>, at offset; parts longer than a chunk are spliced if asked for,
+// or received and written at the same time if output buffers allow; shorter
+// ones are received and written in turn through the first buffer of the ring
+int receive_part(int sock, char* const name, int fd, uint64_t offset, uint64_t bytes_left,
+                 bool verbose) {
+    struct write_ring ring = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .changed = PTHREAD_COND_INITIALIZER,
+        .fd = fd,
+        .direct_fd = -1
+    };
+    uint64_t start = trace_begin();
+    int ret = 0;
+
+    if (verbose)
+        log_debug("downloading... bytes left: %lu\n", bytes_left);
+
+    if (output.splice && bytes_left > MAX_CHUNK_SIZE) {
+        ret = splice_part(sock, fd, offset, bytes_left, verbose);
+
+        if (ret != SPLICE_UNSUPPORTED) {
+            trace_end("receive", start);
+            return ret;
+        }
+
+        printf("splice not supported for this socket, copying instead\n");
+        ret = 0;
+    }
+
+    // with no more free buffers in the pool, the ring is just shorter
+    while (ring.size < (bytes_left > MAX_CHUNK_SIZE ? output.buffers : 1)
+           && (ring.buffers[ring.size] = buffer_get()))
+        ++ring.size;
+
+    if (ring.size == 0) {
+        fprintf(stderr, "no transfer buffer available\n");
+        return -1;
+    }
+
+    if (output.direct && bytes_left >= DIRECT_ALIGN)
+        ring.direct_fd = open_direct_output(name);
+
+    if (ring.size > 1) {
+        ret = receive_to_ring(sock, &ring, offset, bytes_left, verbose);
+        bytes_left = 0;
+    }
+
+    while (bytes_left > 0) {
+        size_t chunk_size = next_chunk_size(offset, bytes_left);
+        uint64_t read_start = trace_begin();
+
+        if (safe_read(sock, ring.buffers[0], chunk_size, "server") < 0) {
+            ret = -1;
+            break;
+        }
+
+        trace_end("read", read_start);
+
+        if (write_output(&ring, ring.buffers[0], chunk_size, offset) < 0) {
+            ret = -1;
+            break;
+        }
+
+        offset += chunk_size;
+        bytes_left -= chunk_size;
+
+        if (verbose)
+            log_debug("downloading... bytes left: %lu\n", bytes_left);
+    }
+
+    if (ring.direct_fd >= 0) {
+        if (ret == 0 && ring.unsynced > 0 && fdatasync(ring.direct_fd) < 0) {
+            syserr_noexit("fdatasync");
+            ret = -1;
+        }
+
+        if (close(ring.direct_fd) < 0) {
+            syserr_noexit("close");
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; i < ring.size; i++)
+        buffer_put(ring.buffers[i]);
+
+    trace_end("receive", start);
+    return ret;
+}
+
+// downloads one segment, sets its result to -1 on failure; a connection
+// opened here is closed when done, one given by the caller is left open
+void* download_segment(void* arg) {
+    struct segment* seg = arg;
+    struct response_info64 r_info;
+    int sock = seg->sock;
+
+    seg->result = -1;
+
+    if (seg->sock < 0) {
+        uint16_t version;
+
+        if ((sock = connect_to_server(seg->addr)) < 0)
+            return NULL;
+
+        // the other connections have to speak the version of the first one
+        if (seg->wide && (negotiate_version(sock, PROTOCOL_WIDE, &version) < 0
+                          || version != PROTOCOL_WIDE)) {
+            safe_close(sock);
+            return NULL;
+        }
+    }
+
+    if (request_part(sock, seg->wide, seg->name, seg->begin, seg->len, &r_info) < 0) {
+        if (seg->sock < 0)
+            safe_close(sock);
+        return NULL;
+    }
+
+    if (seg->verbose)
+        printf("successfully read response\n");
+
+    if (r_info.msg_start == 2) {
+        // a part behind the end of the file, the earlier parts were cut short
+        if (!seg->first && r_info.second_param == 2) {
+            seg->result = 0;
+        } else {
+            if (!seg->verbose)
+                printf("%s: ", seg->name);
+
+            print_refusal(r_info.second_param);
+            seg->refused = true;
+        }
+    } else if (r_info.msg_start == 3) {
+        if (seg->verbose)
+            printf("request accepted, trying to download file\n");
+
+        int fd = open_output_file(seg->name);
+
+        if (fd >= 0) {
+            if (receive_part(sock, seg->name, fd, seg->begin, r_info.second_param,
+                             seg->verbose) == 0) {
+                seg->received = r_info.second_param;
+                seg->result = 0;
+            }
+
+            if (close(fd) < 0) {
+                syserr_noexit("close");
+                seg->result = -1;
+            }
+        }
+    } else {
+        printf("invalid response from server\n");
+    }
+
+    if (seg->sock < 0)
+        safe_close(sock);
+
+    return NULL;
+}
+
+// downloads bytes [begin, end) of file name over connections_num connections;
+// sock is used, and left open, if there is only one, otherwise each part opens
+// its own; wide tells whether 64-bit messages are to be used. Without verbose
+// only a line with the timing is printed. Bytes received are added to
+// *received_total unless it is NULL. Returns DOWNLOAD_REFUSED if the server
+// refused the request, after which sock can still be used
+int download_range(struct addrinfo* addr, int sock, bool wide, char* name,
+                   uint64_t begin, uint64_t end, long connections_num, bool verbose,
+                   uint64_t* received_total) {
+    struct segment segments[MAX_CONNECTIONS];
+    pthread_t threads[MAX_CONNECTIONS];
+    uint64_t len = end - begin;
+    struct timespec start, stop;
+    double cpu_start;
+    int result = 0;
+
+    // every connection gets at least one byte, except a single empty request
+    if (connections_num > 1 && (uint64_t) connections_num > len)
+        connections_num = len > 1 ? len : 1;
+
+    for (long i = 0; i < connections_num; ++i) {
+        // 128-bit products, as len times i may not fit in 64 bits
+        uint64_t seg_begin = begin + (unsigned __int128) len * i / connections_num;
+        uint64_t seg_end = begin + (unsigned __int128) len * (i + 1) / connections_num;
+
+        segments[i] = (struct segment) {
+            .addr = addr,
+            .sock = connections_num == 1 ? sock : -1,
+            .name = name,
+            .begin = seg_begin,
+            .len = seg_end - seg_begin,
+            .wide = wide,
+            .first = i == 0,
+            .verbose = verbose && connections_num == 1
+        };
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cpu_start = cpu_seconds();
+
+    if (sock >= 0 && connections_num == 1) {
+        download_segment(&segments[0]);
+    } else {
+        long started;
+
+        for (started = 0; started < connections_num; ++started) {
+            errno = pthread_create(&threads[started], NULL, download_segment, &segments[started]);
+
+            if (errno != 0) {
+                syserr_noexit("pthread_create");
+                result = -1;
+                break;
+            }
+        }
+
+        for (long i = 0; i < started; ++i)
+            pthread_join(threads[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double cpu = cpu_seconds() - cpu_start;
+
+    uint64_t received = 0;
+    bool refused = false;
+
+    for (long i = 0; i < connections_num; ++i) {
+        if (segments[i].refused)
+            refused = true;
+        else if (segments[i].result < 0)
+            result = -1;
+
+        received += segments[i].received;
+    }
+
+    if (result < 0) {
+        printf("%s%sdownload failed\n", verbose ? "" : name, verbose ? "" : ": ");
+        return -1;
+    }
+
+    if (refused)
+        return DOWNLOAD_REFUSED;
+
+    if (received_total)
+        *received_total += received;
+
+    double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (!verbose) {
+        printf("%s: %lu bytes over %ld connection(s) in %.3f s, %.2f MB/s\n",
+               name, received, connections_num, seconds,
+               seconds > 0 ? received / seconds / 1e6 : 0.0);
+        return 0;
+    }
+
+    printf("file successfully downloaded\n");
+    printf("%lu bytes over %ld connection(s) in %.3f s, %.2f MB/s, CPU %.3f s (%.2f s/GB)\n",
+           received, connections_num, seconds,
+           seconds > 0 ? received / seconds / 1e6 : 0.0,
+           cpu, received > 0 ? cpu / (received / 1e9) : 0.0);
+
+    return 0;
+}
+
+// fragment of a file to fetch in batch mode
+struct batch_item {
+    char name[MAX_PATH_LEN + 1];
+    uint64_t begin;
+    uint64_t len;               // WHOLE_FILE if no range was given
+};
+
+// appends a fragment to *items, of which there are *count in an array of
+// *size; returns -1 if memory cannot be allocated
+int append_item(struct batch_item** items, size_t* count, size_t* size, char* const name,
+                uint64_t begin, uint64_t len) {
+    if (*count == *size) {
+        size_t new_size = *size ? 2 * *size : 64;
+        struct batch_item* new_items = realloc(*items, new_size * sizeof(struct batch_item));
+
+        if (!new_items) {
+            fprintf(stderr, "malloc for file list failed\n");
+            return -1;
+        }
+
+        *items = new_items;
+        *size = new_size;
+    }
+
+    strcpy((*items)[*count].name, name);
+    (*items)[*count].begin = begin;
+    (*items)[*count].len = len;
+    ++*count;
+    return 0;
+}
+
+// reads lines "<name> [<begin> <end>]" of file path, or of standard input if
+// it is "-"; without a range the whole file is fetched
+int read_batch_list(char* const path, struct batch_item** items, size_t* count) {
+    bool from_stdin = strcmp(path, "-") == 0;
+    FILE* list = from_stdin ? stdin : fopen(path, "r");
+    size_t size = 0;
+    char* line = NULL;
+    size_t line_size = 0;
+    int result = 0;
+
+    if (!list) {
+        syserr_noexit("fopen");
+        return -1;
+    }
+
+    *items = NULL;
+    *count = 0;
+
+    while (getline(&line, &line_size, list) > 0) {
+        char name[MAX_PATH_LEN + 1];
+        uint64_t begin = 0;
+        uint64_t end = WHOLE_FILE;
+        int fields = sscanf(line, "%256s %" SCNu64 " %" SCNu64, name, &begin, &end);
+
+        if (fields <= 0)
+            continue;
+
+        if (fields == 2 || end < begin) {
+            fprintf(stderr, "invalid line in %s: %s", path, line);
+            result = -1;
+            break;
+        }
+
+        if (append_item(items, count, &size, name, begin, end - begin) < 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    free(line);
+
+    if (!from_stdin)
+        fclose(list);
+
+    if (result < 0) {
+        free(*items);
+        *items = NULL;
+    }
+
+    return result;
+}
+
+// sends one batch request for count items and receives all of its responses;
+// returns -1 if the connection cannot be used anymore
+int fetch_batch(int sock, bool wide, struct batch_item* items, uint16_t count,
+                uint64_t* files, uint64_t* received) {
+    size_t request_size = 2 * sizeof(uint16_t);
+
+    for (uint16_t i = 0; i < count; i++)
+        request_size += sizeof(struct f_req_params64) + strlen(items[i].name);
+
+    char* request = malloc(request_size);
+    char* headers = malloc(count * response_size(wide));
+
+    if (!request || !headers) {
+        fprintf(stderr, "malloc for batch request failed\n");
+        free(request);
+        free(headers);
+        return -1;
+    }
+
+    // the whole request goes in one write, so it costs one round trip
+    uint16_t field = htons(3);
+    size_t pos = 0;
+
+    memcpy(request + pos, &field, sizeof(uint16_t));
+    pos += sizeof(uint16_t);
+    field = htons(count);
+    memcpy(request + pos, &field, sizeof(uint16_t));
+    pos += sizeof(uint16_t);
+
+    for (uint16_t i = 0; i < count; i++) {
+        uint16_t name_len = strlen(items[i].name);
+
+        pos += encode_file_params(wide, items[i].begin, items[i].len, name_len,
+                                  request + pos);
+        memcpy(request + pos, items[i].name, name_len);
+        pos += name_len;
+    }
+
+    uint64_t start = trace_begin();
+    int result = safe_write(sock, request, pos, "server");
+    free(request);
+
+    if (result == 0)
+        result = safe_read(sock, headers, count * response_size(wide), "server");
+
+    if (result == 0)
+        trace_end("batch request", start);
+
+    for (uint16_t i = 0; result == 0 && i < count; i++) {
+        struct response_info64 r_info;
+
+        decode_response(headers + i * response_size(wide), wide, &r_info);
+
+        uint64_t second_param = r_info.second_param;
+
+        if (r_info.msg_start == 2) {
+            printf("%s: ", items[i].name);
+            print_refusal(second_param);
+            continue;
+        }
+
+        if (r_info.msg_start != 3) {
+            printf("invalid response from server\n");
+            result = -1;
+            break;
+        }
+
+        int fd = open_output_file(items[i].name);
+
+        if (fd < 0 || receive_part(sock, items[i].name, fd, items[i].begin, second_param,
+                                   false) < 0)
+            result = -1;
+
+        if (fd >= 0 && close(fd) < 0) {
+            syserr_noexit("close");
+            result = -1;
+        }
+
+        ++*files;
+        *received += second_param;
+    }
+
+    free(headers);
 
-#include "err.h"
-#include "utilities.h"
+    return result;
+}
+
+struct framed_sender {
+    int sock;
+    struct batch_item* items;
+    size_t count;
+    int result;
+};
+
+// sends a framed file request for every item, its index being the request id;
+// runs next to the receiving of responses, as the server reads further
+// requests only when earlier ones are done
+void* send_framed_requests(void* arg) {
+    struct framed_sender* sender = arg;
+    size_t request_size = sizeof(uint32_t) + sizeof(uint16_t) + sizeof(struct f_req_params)
+                          + MAX_PATH_LEN;
+    char buffer[64 * 1024];
+    size_t pos = 0;
+
+    sender->result = 0;
+
+    for (size_t i = 0; i <= sender->count; i++) {
+        if (pos > 0 && (i == sender->count || pos + request_size > sizeof(buffer))) {
+            if (safe_write(sender->sock, buffer, pos, "server") < 0) {
+                sender->result = -1;
+                return NULL;
+            }
+
+            pos = 0;
+        }
+
+        if (i == sender->count)
+            break;
+
+        struct batch_item* item = &sender->items[i];
+        uint16_t name_len = strlen(item->name);
+        uint32_t id = htonl(i);
+        uint16_t request_type = htons(2);
+
+        memcpy(buffer + pos, &id, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        memcpy(buffer + pos, &request_type, sizeof(uint16_t));
+        pos += sizeof(uint16_t);
+        // framed connections keep the classic messages
+        pos += encode_file_params(false, item->begin, item->len, name_len, buffer + pos);
+        memcpy(buffer + pos, item->name, name_len);
+        pos += name_len;
+    }
+
+    return NULL;
+}
+
+// file fragment being received over a framed connection
+struct framed_download {
+    int fd;
+    uint64_t pos;
+    uint64_t left;
+};
+
+// handles frame of kind for request id, whose payload of len bytes is in buffer
+int handle_frame(struct framed_download* downloads, struct batch_item* items, uint32_t id,
+                 uint16_t kind, char* buffer, uint32_t len, uint64_t* files, uint64_t* received,
+                 size_t* finished) {
+    struct framed_download* download = &downloads[id];
+
+    if (kind == FRAME_RESPONSE && len == sizeof(struct response_info) && download->fd < 0) {
+        struct response_info r_info;
+
+        memcpy(&r_info, buffer, sizeof(struct response_info));
+        r_info.msg_start = ntohs(r_info.msg_start);
+        r_info.second_param = ntohl(r_info.second_param);
+
+        if (r_info.msg_start == 2) {
+            printf("%s: ", items[id].name);
+            print_refusal(r_info.second_param);
+            ++*finished;
+            return 0;
+        }
+
+        if (r_info.msg_start != 3 || r_info.second_param == 0) {
+            printf("invalid response from server\n");
+            return -1;
+        }
+
+        download->fd = open_output_file(items[id].name);
+        download->pos = items[id].begin;
+        download->left = r_info.second_param;
+
+        return download->fd < 0 ? -1 : 0;
+    }
+
+    if (kind != FRAME_DATA || download->fd < 0 || len > download->left) {
+        printf("invalid response from server\n");
+        return -1;
+    }
+
+    if (write_at(download->fd, buffer, len, download->pos) < 0)
+        return -1;
+
+    download->pos += len;
+    download->left -= len;
+    *received += len;
+
+    if (download->left == 0) {
+        if (close(download->fd) < 0) {
+            syserr_noexit("close");
+            return -1;
+        }
+
+        download->fd = -1;
+        ++*files;
+        ++*finished;
+    }
+
+    return 0;
+}
+
+// fetches count items over a framed connection, with all requests in flight
+// at once and their bodies interleaved by the server
+int fetch_framed(int sock, struct batch_item* items, size_t count,
+                 uint64_t* files, uint64_t* received) {
+    struct framed_download* downloads = malloc(count * sizeof(struct framed_download));
+    char* buffer = buffer_get();
+    struct framed_sender sender = {
+        .sock = sock,
+        .items = items,
+        .count = count
+    };
+    pthread_t sender_thread;
+    size_t finished = 0;
+    int result = 0;
+
+    if (!downloads || !buffer) {
+        fprintf(stderr, "malloc for framed download failed\n");
+        free(downloads);
+        buffer_put(buffer);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        downloads[i].fd = -1;
+
+    errno = pthread_create(&sender_thread, NULL, send_framed_requests, &sender);
+    if (errno != 0) {
+        syserr_noexit("pthread_create");
+        free(downloads);
+        buffer_put(buffer);
+        return -1;
+    }
+
+    while (finished < count) {
+        struct frame_header frame;
+
+        if (safe_read(sock, &frame, sizeof(struct frame_header), "server") < 0) {
+            result = -1;
+            break;
+        }
+
+        uint32_t id = ntohl(frame.request_id);
+        uint16_t kind = ntohs(frame.kind);
+        uint32_t len = ntohl(frame.len);
+
+        if (id >= count || len > MAX_CHUNK_SIZE) {
+            printf("invalid response from server\n");
+            result = -1;
+            break;
+        }
+
+        if (safe_read(sock, buffer, len, "server") < 0
+            || handle_frame(downloads, items, id, kind, buffer, len,
+                            files, received, &finished) < 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    // wakes up the sender if it is still blocked on a broken connection
+    if (result < 0)
+        shutdown(sock, SHUT_RDWR);
+
+    pthread_join(sender_thread, NULL);
+
+    if (sender.result < 0)
+        result = -1;
+
+    for (size_t i = 0; i < count; i++) {
+        if (downloads[i].fd >= 0)
+            close(downloads[i].fd);
+    }
+
+    free(downloads);
+    buffer_put(buffer);
+
+    return result;
+}
+
+// fetches all fragments listed in file list_path, over a framed connection
+// if framed is set and the server agrees, otherwise with batch requests of up
+// to MAX_BATCH_ENTRIES entries each
+int download_batch(struct addrinfo* addr, char* const list_path, bool framed) {
+    struct batch_item* items;
+    size_t count;
+    uint64_t files = 0;
+    uint64_t received = 0;
+    struct timespec start, stop;
+    double cpu_start;
+    int result = 0;
+
+    if (read_batch_list(list_path, &items, &count) < 0)
+        return -1;
+
+    int sock = connect_to_server(addr);
+
+    if (sock < 0) {
+        free(items);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cpu_start = cpu_seconds();
+
+    uint16_t version;
+
+    if (negotiate_version(sock, framed ? PROTOCOL_FRAMED : PROTOCOL_WIDE, &version) < 0)
+        result = -1;
+
+    bool wide = version == PROTOCOL_WIDE;
+
+    for (size_t i = 0; result == 0 && !wide && i < count; i++) {
+        if (!fits_classic(items[i].begin, items[i].len)) {
+            printf("%s: server does not support addresses beyond 4 GiB\n", items[i].name);
+            result = -1;
+        }
+    }
+
+    if (result == 0 && version == PROTOCOL_FRAMED)
+        result = fetch_framed(sock, items, count, &files, &received);
+
+    for (size_t done = 0; result == 0 && version != PROTOCOL_FRAMED && done < count; ) {
+        uint16_t batch_size = count - done < MAX_BATCH_ENTRIES ? count - done
+                                                               : MAX_BATCH_ENTRIES;
+
+        result = fetch_batch(sock, wide, items + done, batch_size, &files, &received);
+        done += batch_size;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double cpu = cpu_seconds() - cpu_start;
+
+    safe_close(sock);
+    free(items);
+
+    if (result < 0) {
+        printf("download failed\n");
+        return -1;
+    }
+
+    double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%lu of %zu files, %lu bytes in %.3f s, %.2f MB/s, CPU %.3f s (%.2f s/GB)\n",
+           files, count, received, seconds,
+           seconds > 0 ? received / seconds / 1e6 : 0.0,
+           cpu, received > 0 ? cpu / (received / 1e9) : 0.0);
+
+    return 0;
+}
+
+// adds the fragment given as "<name>[:<begin>-<end>]" to *items; a suffix not
+// parsed as a range is a part of the name. Returns -1 on error
+int parse_get_arg(char* const arg, struct batch_item** items, size_t* count, size_t* size) {
+    char name[MAX_PATH_LEN + 1];
+    char* colon = strrchr(arg, ':');
+    uint64_t begin = 0;
+    uint64_t end = WHOLE_FILE;
+    size_t name_len = strlen(arg);
+    int consumed = 0;
+
+    if (colon && sscanf(colon + 1, "%" SCNu64 "-%" SCNu64 "%n", &begin, &end, &consumed) == 2
+        && colon[1 + consumed] == '\0') {
+        if (end < begin) {
+            fprintf(stderr, "end of range must not be before its begin: %s\n", arg);
+            return -1;
+        }
+
+        name_len = colon - arg;
+    } else {
+        begin = 0;
+        end = WHOLE_FILE;
+    }
+
+    if (name_len == 0 || name_len > MAX_PATH_LEN) {
+        fprintf(stderr, "invalid file name: %s\n", arg);
+        return -1;
+    }
+
+    memcpy(name, arg, name_len);
+    name[name_len] = '\0';
+
+    return append_item(items, count, size, name, begin, end - begin);
+}
+
+bool is_pattern(char* const name) {
+    return strpbrk(name, "*?[") != NULL;
+}
+
+// replaces items whose names are wildcard patterns with the files of list
+// matching them, each with the pattern's range; returns -1 on error
+int expand_patterns(char* file_list, uint64_t list_len, struct batch_item** items,
+                    size_t* count) {
+    struct batch_item* expanded = NULL;
+    size_t expanded_num = 0;
+    size_t size = 0;
+
+    for (size_t i = 0; i < *count; i++) {
+        struct batch_item* item = &(*items)[i];
+        bool matched = false;
+
+        if (!is_pattern(item->name)) {
+            if (append_item(&expanded, &expanded_num, &size, item->name, item->begin,
+                            item->len) < 0)
+                goto error;
+            continue;
+        }
+
+        for (uint64_t start = 0; start < list_len; ) {
+            char name[MAX_PATH_LEN + 1];
+            uint64_t end = start;
+
+            while (end < list_len && file_list[end] != '|')
+                ++end;
+
+            if (end - start <= MAX_PATH_LEN) {
+                memcpy(name, file_list + start, end - start);
+                name[end - start] = '\0';
+
+                if (fnmatch(item->name, name, 0) == 0) {
+                    matched = true;
+
+                    if (append_item(&expanded, &expanded_num, &size, name, item->begin,
+                                    item->len) < 0)
+                        goto error;
+                }
+            }
+
+            start = end + 1;
+        }
+
+        if (!matched)
+            printf("%s: no matching files\n", item->name);
+    }
+
+    free(*items);
+    *items = expanded;
+    *count = expanded_num;
+    return 0;
+
+error:
+    free(expanded);
+    return -1;
+}
+
+// connects to the server, negotiating the wide version if it speaks it;
+// returns -1 on error
+int open_session(struct addrinfo* addr, bool* wide) {
+    int sock = connect_to_server(addr);
+    uint16_t version;
+
+    if (sock < 0)
+        return -1;
+
+    if (negotiate_version(sock, PROTOCOL_WIDE, &version) < 0) {
+        safe_close(sock);
+        return -1;
+    }
+
+    *wide = version == PROTOCOL_WIDE;
+    return sock;
+}
+
+// downloads count items one after another with file requests over one
+// connection, without prompts; a file with its range given is split between
+// connections_num connections. Names with wildcards are matched against the
+// file list, which is fetched only if there are any. A failed file does not
+// stop the others; returns -1 if any failed
+int download_script(struct addrinfo* addr, struct batch_item* items, size_t count,
+                    long connections_num) {
+    uint64_t files = 0;
+    uint64_t received = 0;
+    struct timespec start, stop;
+    double cpu_start;
+    int result = 0;
+    bool wide;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cpu_start = cpu_seconds();
+
+    int sock = open_session(addr, &wide);
+
+    if (sock < 0) {
+        free(items);
+        return -1;
+    }
+
+    bool patterns = false;
+
+    for (size_t i = 0; i < count; i++)
+        patterns = patterns || is_pattern(items[i].name);
+
+    if (patterns) {
+        char* file_list;
+        uint64_t list_len;
+
+        if (fetch_file_list(sock, wide, &file_list, &list_len) < 0
+            || expand_patterns(file_list, list_len, &items, &count) < 0) {
+            free(file_list);
+            free(items);
+            safe_close(sock);
+            return -1;
+        }
+
+        free(file_list);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        struct batch_item* item = &items[i];
+        // the length of a whole file is not known, so it is not split
+        bool whole = item->len == WHOLE_FILE;
+        uint64_t end = whole ? WHOLE_FILE : item->begin + item->len;
+        long parts = whole || item->len <= 1 ? 1 : connections_num;
+
+        if (!wide && !fits_classic(item->begin, item->len)) {
+            printf("%s: server does not support addresses beyond 4 GiB\n", item->name);
+            result = -1;
+            continue;
+        }
+
+        // parts open their own connections, which a server with a single
+        // blocking worker would not accept while this one is open
+        if (parts > 1 && sock >= 0) {
+            safe_close(sock);
+            sock = -1;
+        }
+
+        if (parts == 1 && sock < 0 && (sock = open_session(addr, &wide)) < 0) {
+            result = -1;
+            break;
+        }
+
+        int ret = download_range(addr, sock, wide, item->name, item->begin, end, parts, false,
+                                 &received);
+
+        if (ret == 0) {
+            ++files;
+            continue;
+        }
+
+        result = -1;
+
+        // the response may have been cut off, so the connection is replaced
+        if (ret < 0 && parts == 1) {
+            safe_close(sock);
+            sock = -1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double cpu = cpu_seconds() - cpu_start;
+
+    if (sock >= 0)
+        safe_close(sock);
+
+    free(items);
+
+    double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%lu of %zu files, %lu bytes in %.3f s, %.2f MB/s, CPU %.3f s (%.2f s/GB)\n",
+           files, count, received, seconds,
+           seconds > 0 ? received / seconds / 1e6 : 0.0,
+           cpu, received > 0 ? cpu / (received / 1e9) : 0.0);
+
+    return result;
+}
+
+// asks the server for its counters and latencies (req_type 5) and prints
+// them; returns -1 on error
+int print_server_stats(struct addrinfo* addr) {
+    uint16_t request_type = htons(5);
+    struct response_info r_info;
+    int sock = connect_to_server(addr);
+    int result = -1;
+
+    if (sock < 0)
+        return -1;
+
+    if (safe_write(sock, &request_type, sizeof(uint16_t), "server") < 0
+        || safe_read(sock, &r_info, sizeof(struct response_info), "server") < 0) {
+        close(sock);
+        return -1;
+    }
+
+    uint32_t len = ntohl(r_info.second_param);
+    char* text = ntohs(r_info.msg_start) == 5 ? malloc(len) : NULL;
+
+    if (ntohs(r_info.msg_start) != 5)
+        printf("invalid response from server\n");
+    else if (!text)
+        fprintf(stderr, "malloc for stats failed\n");
+    else if (safe_read(sock, text, len, "server") == 0 && fwrite(text, 1, len, stdout) == len)
+        result = 0;
+
+    free(text);
+    // nothing but the stats is printed, so they can be parsed
+    close(sock);
+    return result;
+}
 
 int main(int argc, char *argv[]) {
-    if (argc < 2 || argc > 3)
-        fatal("Usage: %s <server-name-or-ip4-address> [<port-number>]", argv[0]);
+    static struct option long_options[] = {
+        {"connections", required_argument, NULL, 'n'},
+        {"batch", required_argument, NULL, 'b'},
+        {"framed", no_argument, NULL, 'f'},
+        {"write-buffers", required_argument, NULL, 'w'},
+        {"direct", no_argument, NULL, 'd'},
+        {"splice", no_argument, NULL, 's'},
+        {"get", required_argument, NULL, 'g'},
+        {"stats", no_argument, NULL, 't'},
+        {"trace", required_argument, NULL, 'x'},
+        {NULL, 0, NULL, 0}
+    };
+
+    long connections_num = 1;
+    char* batch_list = NULL;
+    bool framed = false;
+    struct batch_item* get_items = NULL;
+    size_t get_count = 0;
+    size_t get_size = 0;
+    bool get_stdin = false;
+    bool stats = false;
+    char* trace_path = NULL;
+    char* endptr;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        if (opt == 'n') {
+            connections_num = strtol(optarg, &endptr, 10);
+
+            if (*endptr != '\0' || connections_num < 1 || connections_num > MAX_CONNECTIONS)
+                fatal("number of connections must be between 1 and %d", MAX_CONNECTIONS);
+        } else if (opt == 'b') {
+            batch_list = optarg;
+        } else if (opt == 'f') {
+            framed = true;
+        } else if (opt == 'w') {
+            long buffers_num = strtol(optarg, &endptr, 10);
+
+            if (*endptr != '\0' || buffers_num < 1 || buffers_num > MAX_WRITE_BUFFERS)
+                fatal("number of write buffers must be between 1 and %d", MAX_WRITE_BUFFERS);
+
+            output.buffers = buffers_num;
+        } else if (opt == 'd') {
+            output.direct = true;
+        } else if (opt == 's') {
+            output.splice = true;
+        } else if (opt == 'g') {
+            if (strcmp(optarg, "-") == 0)
+                get_stdin = true;
+            else if (parse_get_arg(optarg, &get_items, &get_count, &get_size) < 0)
+                fatal(USAGE, argv[0]);
+        } else if (opt == 't') {
+            stats = true;
+        } else if (opt == 'x') {
+            trace_path = optarg;
+        } else {
+            fatal(USAGE, argv[0]);
+        }
+    }
+
+    bool scripted = get_count > 0 || get_stdin;
+
+    if (argc - optind < 1 || argc - optind > 2 || (framed && !batch_list)
+        || (output.direct && output.splice) || (scripted && batch_list)
+        || (stats && (scripted || batch_list)))
+        fatal(USAGE, argv[0]);
+
+    // before any thread is started, so that they leave signals to the tracer
+    if (trace_path && trace_start(trace_path) < 0)
+        fprintf(stderr, "cannot start tracing, spans will not be recorded\n");
+
+    if (get_stdin) {
+        struct batch_item* read_items;
+        size_t read_count;
+
+        if (read_batch_list("-", &read_items, &read_count) < 0)
+            return 1;
+
+        for (size_t i = 0; i < read_count; i++)
+            if (append_item(&get_items, &get_count, &get_size, read_items[i].name,
+                            read_items[i].begin, read_items[i].len) < 0)
+                return 1;
+
+        free(read_items);
+    }
 
     int sock;
     struct addrinfo addr_hints;
@@ -27,10 +1592,10 @@ int main(int argc, char *argv[]) {
     addr_hints.ai_family = AF_INET; // IPv4
     addr_hints.ai_socktype = SOCK_STREAM;
     addr_hints.ai_protocol = IPPROTO_TCP;
-    if (argc == 2)
-        err = getaddrinfo(argv[1], "6543", &addr_hints, &addr_result);
+    if (argc - optind == 1)
+        err = getaddrinfo(argv[optind], "6543", &addr_hints, &addr_result);
     else
-        err = getaddrinfo(argv[1], argv[2], &addr_hints, &addr_result);
+        err = getaddrinfo(argv[optind], argv[optind + 1], &addr_hints, &addr_result);
     if (err == EAI_SYSTEM) { // system error
         syserr("getaddrinfo: %s", gai_strerror(err));
     }
@@ -38,61 +1603,67 @@ int main(int argc, char *argv[]) {
         fatal("getaddrinfo: %s", gai_strerror(err));
     }
 
+    if (stats) {
+        int result = print_server_stats(addr_result);
+
+        freeaddrinfo(addr_result);
+        return result < 0 ? 1 : 0;
+    }
+
+    if (batch_list) {
+        int result = download_batch(addr_result, batch_list, framed);
+
+        freeaddrinfo(addr_result);
+        return result < 0 ? 1 : 0;
+    }
+
+    if (scripted) {
+        int result = download_script(addr_result, get_items, get_count, connections_num);
+
+        freeaddrinfo(addr_result);
+        return result < 0 ? 1 : 0;
+    }
+
     // initialize socket according to getaddrinfo results
     sock = socket(addr_result->ai_family, addr_result->ai_socktype, addr_result->ai_protocol);
     if (sock < 0)
         syserr("socket");
 
+    uint64_t start = trace_begin();
+
     // connect socket to the server
     if (connect(sock, addr_result->ai_addr, addr_result->ai_addrlen) < 0)
         syserr("connect");
 
-    freeaddrinfo(addr_result);
-
-    uint16_t request_type = ntohs(1);
+    trace_end("connect", start);
 
-    if (safe_write(sock, &request_type, sizeof(uint16_t), "server") < 0) {
-        safe_close(sock);
-        return 1;
-    }
-
-    struct fl_info info;
+    uint16_t version;
 
-    if (safe_read(sock, &info, sizeof(struct fl_info), "server") < 0) {
+    if (negotiate_version(sock, PROTOCOL_WIDE, &version) < 0) {
         safe_close(sock);
         return 1;
     }
 
-    info.fl_len = ntohl(info.fl_len);
-    info.msg_start = ntohs(info.msg_start);
+    bool wide = version == PROTOCOL_WIDE;
+    char* file_list;
+    uint64_t list_len;
 
-    if (info.msg_start != 1) {
-        printf("invalid response from server\n");
+    if (fetch_file_list(sock, wide, &file_list, &list_len) < 0) {
         safe_close(sock);
         return 1;
     }
 
-    printf("successfully read file list request info\n");
-
-    if (info.fl_len == 0) {
+    if (list_len == 0) {
         printf("file list is empty\n");
         safe_close(sock);
         return 1;
     }
 
-    char* file_list = calloc(sizeof(char), info.fl_len);
-
-    if (safe_read(sock, file_list, info.fl_len, "server") < 0) {
-        safe_close(sock);
-        free(file_list);
-        return 1;
-    }
-
     printf("successfully read file list\n\n");
 
     uint64_t word_number = 1;
     printf("%lu. ", word_number);
-    for (int i = 0; i < info.fl_len; i++) {
+    for (uint64_t i = 0; i < list_len; i++) {
         if (file_list[i] != '|')
             printf("%c", file_list[i]);
         else {
@@ -121,9 +1692,9 @@ int main(int argc, char *argv[]) {
     } while (chosen_word == 0 || chosen_word > word_number);
 
     word_number = 1;
-    int i = 0;
+    uint64_t i = 0;
 
-    for (i = 0; i < info.fl_len; ++i) {
+    for (i = 0; i < list_len; ++i) {
         if (word_number == chosen_word)
             break;
 
@@ -131,14 +1702,10 @@ int main(int argc, char *argv[]) {
             word_number++;
     }
 
-    struct f_req_params f_info;
-    uint16_t name_len = 0;
-
     char name[MAX_PATH_LEN + 1];
     int j = 0;
 
-    while (file_list[i] != '|' && i < info.fl_len) {
-        name_len++;
+    while (file_list[i] != '|' && i < list_len) {
         name[j] = file_list[i];
         j++;
         i++;
@@ -148,11 +1715,11 @@ int main(int argc, char *argv[]) {
 
     free(file_list);
 
-    uint32_t begin;
-    uint32_t end;
+    uint64_t begin;
+    uint64_t end;
 
     printf("enter begin address: ");
-    scanf("%d", &begin);
+    scanf("%" SCNu64, &begin);
 
     int c;
     while ((c = getchar()) != '\n' && c != EOF) { } //flush stdin
@@ -160,7 +1727,7 @@ int main(int argc, char *argv[]) {
 
     do {
         printf("enter end address: ");
-        scanf("%d", &end);
+        scanf("%" SCNu64, &end);
 
         int c;
         while ((c = getchar()) != '\n' && c != EOF) { } //flush stdin
@@ -169,135 +1736,29 @@ int main(int argc, char *argv[]) {
             printf("end must be bigger than begin, try again\n");
     } while (end < begin);
 
-    request_type = htons(2);
-
-    if (safe_write(sock, &request_type, sizeof(uint16_t), "server") < 0) {
-        safe_close(sock);
-        return 1;
-    }
-
-    f_info.name_len = htons(name_len);
-    f_info.begin_addr = htonl(begin);
-    f_info.part_len = htonl(end - begin);
-
-    if (safe_write(sock, &f_info, sizeof(struct f_req_params), "server") < 0) {
-        safe_close(sock);
-        return 1;
-    }
-
-    printf("successfully sent file request info\n");
-
-    if (safe_write(sock, name, name_len, "server") < 0) {
+    if (!wide && end > UINT32_MAX) {
+        printf("server does not support addresses beyond 4 GiB\n");
         safe_close(sock);
+        freeaddrinfo(addr_result);
         return 1;
     }
 
-    printf("successfully sent file name\n");
+    int result;
 
-    struct response_info r_info;
-
-    if (safe_read(sock, &r_info, sizeof(struct response_info), "server")) {
+    if (connections_num == 1) {
+        result = download_range(addr_result, sock, wide, name, begin, end, 1, true, NULL);
         safe_close(sock);
-        return 1;
-    }
-
-    printf("successfully read response\n");
-
-    r_info.msg_start = ntohs(r_info.msg_start);
-    r_info.second_param = ntohl(r_info.second_param);
-
-    if (r_info.msg_start == 2) {
-        switch (r_info.second_param) {
-            case 1:
-                printf("refuse: wrong filename\n");
-                break;
-
-            case 2:
-                printf("refuse: invalid begin address\n");
-                break;
-
-            case 3:
-                printf("refuse: part length is 0\n");
-                break;
-
-            default:
-                printf("invalid response from server\n");
-        }
-    } else if (r_info.msg_start == 3) {
-        printf("request accepted, trying to download file\n");
-        char path[MAX_PATH_LEN+5] = "tmp/";
-        strcat(path, name);
-
-        errno = 0;
-        if (mkdir("./tmp", 0700) < 0) {
-            if (errno != EEXIST) {
-                syserr_noexit("mkdir");
-                safe_close(sock);
-                return 1;
-            }
-
-            errno = 0;
-        }
-
-        FILE* file = fopen(path, "r+");
-
-        if (!file) {
-            if (errno == ENOENT) {
-                file = fopen(path, "w+");
-
-                if (!file) {
-                    syserr_noexit("fopen");
-                    safe_close(sock);
-                    return 1;
-                }
-
-                errno = 0;
-            } else {
-                syserr_noexit("fopen");
-                safe_close(sock);
-                return 1;
-            }
-        }
-
-        printf("successfully opened file to write to\n");
-
-        fseek(file, begin, SEEK_SET);
-
-        char buffer[MAX_CHUNK_SIZE];
-        uint64_t bytes_left = r_info.second_param;
-        uint32_t chunk_size;
-
-        printf("downloading... bytes left: %lu\n", bytes_left);
-
-        do {
-            chunk_size = bytes_left < MAX_CHUNK_SIZE ? bytes_left
-                                                     : MAX_CHUNK_SIZE;
-
-            if (safe_read(sock, &buffer, chunk_size, "server") < 0) {
-                safe_close(sock);
-                return 1;
-            }
-
-            if (fwrite(&buffer, 1, chunk_size, file) != chunk_size) {
-                syserr_noexit("fwrite");
-                safe_close(sock);
-                return 1;
-            }
-
-            bytes_left -= chunk_size;
-            printf("downloading... bytes left: %lu\n", bytes_left);
-        } while (bytes_left > 0);
-
-        printf("file successfully downloaded\n");
     } else {
-        printf("invalid response from server\n");
+        // every part is downloaded over its own connection
         safe_close(sock);
-        return 1;
+        result = download_range(addr_result, -1, wide, name, begin, end, connections_num, true,
+                                NULL);
     }
 
-    safe_close(sock);
+    freeaddrinfo(addr_result);
 
-    return 0;
+    return result != 0 ? 1 : 0;
 }
 
 
+
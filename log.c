@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "err.h"
+#include "log.h"
+
+#define RING_SIZE (256*1024)
+#define MAX_MESSAGE 512
+
+// how often the rings are written out
+#define FLUSH_INTERVAL_NS (10*1000*1000)
+
+// messages of one thread; only the thread moves tail and only the writer
+// moves head, both counting bytes ever put in and taken out
+struct log_ring {
+    struct log_ring* next;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;          // messages which did not fit
+    char data[RING_SIZE];
+};
+
+enum log_level log_min_level = LOG_LEVEL_INFO;
+
+static struct {
+    pthread_mutex_t lock;      // taken by threads adding their rings
+    pthread_mutex_t flush_lock;    // one writer at a time
+    bool started;
+    struct log_ring* rings;
+    uint64_t dropped;          // reported so far
+} logger = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .flush_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static __thread struct log_ring* ring;
+
+// returns the ring of the calling thread, making it on first use; NULL if
+// memory cannot be allocated
+static struct log_ring* thread_ring(void) {
+    if (ring)
+        return ring;
+
+    ring = calloc(1, sizeof(struct log_ring));
+
+    if (!ring)
+        return NULL;
+
+    // rings are never removed, so the writer walks the list without the lock
+    pthread_mutex_lock(&logger.lock);
+    ring->next = logger.rings;
+    __atomic_store_n(&logger.rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&logger.lock);
+
+    return ring;
+}
+
+void log_write(const char* format, ...) {
+    va_list args;
+
+    va_start(args, format);
+
+    struct log_ring* own = __atomic_load_n(&logger.started, __ATOMIC_ACQUIRE)
+                           ? thread_ring() : NULL;
+
+    if (!own) {
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+
+    char message[MAX_MESSAGE];
+    int len = vsnprintf(message, sizeof(message), format, args);
+
+    va_end(args);
+
+    if (len < 0)
+        return;
+
+    if ((size_t) len >= sizeof(message))
+        len = sizeof(message) - 1;
+
+    uint64_t head = __atomic_load_n(&own->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = own->tail;
+
+    if (RING_SIZE - (tail - head) < (uint64_t) len) {
+        __atomic_store_n(&own->dropped, own->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t start = tail % RING_SIZE;
+    size_t first = RING_SIZE - start < (size_t) len ? RING_SIZE - start : (size_t) len;
+
+    memcpy(own->data + start, message, first);
+    memcpy(own->data, message + first, len - first);
+    __atomic_store_n(&own->tail, tail + len, __ATOMIC_RELEASE);
+}
+
+int log_set_level(const char* name) {
+    static const char* names[] = {"debug", "info", "warn"};
+
+    for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_WARN; level++) {
+        if (strcmp(name, names[level]) == 0) {
+            log_min_level = level;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void log_flush(void) {
+    uint64_t dropped = 0;
+
+    pthread_mutex_lock(&logger.flush_lock);
+
+    for (struct log_ring* own = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE); own;
+         own = own->next) {
+        uint64_t head = own->head;
+        uint64_t tail = __atomic_load_n(&own->tail, __ATOMIC_ACQUIRE);
+        size_t start = head % RING_SIZE;
+        size_t len = tail - head;
+        size_t first = RING_SIZE - start < len ? RING_SIZE - start : len;
+
+        fwrite(own->data + start, 1, first, stdout);
+        fwrite(own->data, 1, len - first, stdout);
+        __atomic_store_n(&own->head, tail, __ATOMIC_RELEASE);
+        dropped += __atomic_load_n(&own->dropped, __ATOMIC_RELAXED);
+    }
+
+    if (dropped > logger.dropped) {
+        printf("%lu log messages dropped\n", dropped - logger.dropped);
+        logger.dropped = dropped;
+    }
+
+    fflush(stdout);
+    pthread_mutex_unlock(&logger.flush_lock);
+}
+
+static void* write_logs(void* arg) {
+    (void) arg;
+    struct timespec interval = {0, FLUSH_INTERVAL_NS};
+
+    while (true) {
+        nanosleep(&interval, NULL);
+        log_flush();
+    }
+
+    return NULL;
+}
+
+int log_start(void) {
+    pthread_t thread;
+
+    // messages printed so far go before those from the rings
+    fflush(stdout);
+
+    int err = pthread_create(&thread, NULL, write_logs, NULL);
+    if (err != 0) {
+        errno = err;
+        syserr_noexit("pthread_create");
+        return -1;
+    }
+
+    pthread_detach(thread);
+
+    // e.g. fatal errors exit with messages still in the rings
+    if (atexit(log_flush) != 0)
+        fprintf(stderr, "cannot flush log at exit\n");
+
+    __atomic_store_n(&logger.started, true, __ATOMIC_RELEASE);
+    return 0;
+}
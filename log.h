@@ -0,0 +1,49 @@
+#ifndef LOG_H
+#define LOG_H
+
+/* Leveled messages on standard output. Once log_start is called, a message is
+ * formatted into a ring buffer of the calling thread, and a background thread
+ * writes the rings out, so threads logging take no locks and make no system
+ * calls; a message not fitting in its full ring is dropped and counted.
+ * Before that, and in programs never calling it, messages are printed right
+ * away. Errors are still printed to standard error with err.h. */
+
+enum log_level {
+    LOG_LEVEL_DEBUG,           // steps of every request and chunk
+    LOG_LEVEL_INFO,            // connections, setup
+    LOG_LEVEL_WARN             // misbehaving clients, fallbacks
+};
+
+/* Messages below this level are not compiled in, nor are their arguments
+ * evaluated; build with -DLOG_COMPILED_LEVEL=LOG_LEVEL_DEBUG to get all. */
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LOG_LEVEL_INFO
+#endif
+
+/* Messages below this level are skipped at run time. */
+extern enum log_level log_min_level;
+
+#define LOG_AT(level, ...)                                                \
+    do {                                                                  \
+        if ((level) >= LOG_COMPILED_LEVEL && (level) >= log_min_level)    \
+            log_write(__VA_ARGS__);                                       \
+    } while (0)
+
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+
+void log_write(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+/* Sets log_min_level to the level called name (debug, info or warn). Returns
+ * -1 if there is no such level. */
+int log_set_level(const char* name);
+
+/* Starts the background thread writing messages out. Returns -1 if it cannot
+ * be started; messages are still printed right away then. */
+int log_start(void);
+
+/* Writes out all messages logged so far, e.g. before the program exits. */
+void log_flush(void);
+
+#endif //LOG_H
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "err.h"
+#include "utilities.h"
+#include "metrics.h"
+#include "trace.h"
+
+// as many as the server runs at most
+#define MAX_WORKERS 1024
+
+// latencies are kept in buckets 1/16 of a power of two wide, so percentiles
+// are exact to about 6%
+#define SUB_BUCKET_BITS  4
+#define SUB_BUCKETS      (1 << SUB_BUCKET_BITS)
+#define BUCKETS          ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+// request types counted by name; the rest are invalid
+#define REQ_TYPES 5
+
+#define REFUSAL_REASONS 3
+
+struct histogram {
+    uint64_t counts[BUCKETS];
+    uint64_t num;
+    uint64_t sum;              // of latencies in ns
+    uint64_t max;
+};
+
+// counters of one worker, written only by it; aligned, so that no two workers
+// write to the same cache line
+struct worker_metrics {
+    uint64_t connections_opened;
+    uint64_t connections_closed;
+    uint64_t requests[REQ_TYPES + 1];          // invalid ones at 0
+    uint64_t refusals[REFUSAL_REASONS + 1];    // by reason, 0 unused
+    uint64_t bytes_sent;
+    struct histogram phases[METRICS_PHASES];
+} __attribute__((aligned(64)));
+
+static const char* request_names[REQ_TYPES + 1] = {
+    "invalid", "list", "file", "batch", "version", "stats"
+};
+
+static const char* refusal_names[REFUSAL_REASONS + 1] = {
+    NULL, "wrong_filename", "invalid_begin", "zero_length"
+};
+
+static const char* phase_names[METRICS_PHASES] = {"parse", "open", "send"};
+
+static struct {
+    pthread_mutex_t lock;      // taken by workers registering
+    struct worker_metrics* workers[MAX_WORKERS];
+    int workers_num;
+    uint64_t start;            // when the first worker registered
+} metrics = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static __thread struct worker_metrics* local;
+
+// the owner is the only writer of a counter, so a load and a store do; being
+// atomic, they keep readers from seeing torn values
+static void counter_add(uint64_t* counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t counter_read(uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int bucket_of(uint64_t value) {
+    if (value < SUB_BUCKETS)
+        return value;
+
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// middle of the values falling into bucket
+static double bucket_value(int bucket) {
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    uint64_t width = 1ULL << (exponent - SUB_BUCKET_BITS);
+
+    return (SUB_BUCKETS + bucket % SUB_BUCKETS) * (double) width + width / 2.0;
+}
+
+static void histogram_add(struct histogram* histogram, uint64_t value) {
+    counter_add(&histogram->counts[bucket_of(value)], 1);
+    counter_add(&histogram->num, 1);
+    counter_add(&histogram->sum, value);
+
+    if (value > counter_read(&histogram->max))
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+}
+
+static void histogram_merge(struct histogram* into, struct histogram* from) {
+    for (int i = 0; i < BUCKETS; i++)
+        into->counts[i] += counter_read(&from->counts[i]);
+
+    into->num += counter_read(&from->num);
+    into->sum += counter_read(&from->sum);
+
+    uint64_t max = counter_read(&from->max);
+
+    if (max > into->max)
+        into->max = max;
+}
+
+// latency in ns below which permille thousandths of requests finished;
+// counts are read one by one while workers go on, so they may not add up to
+// num exactly
+static double histogram_quantile(struct histogram* histogram, uint64_t permille) {
+    uint64_t rank = (histogram->num * permille + 999) / 1000;
+    uint64_t seen = 0;
+
+    if (rank == 0)
+        rank = 1;
+
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += histogram->counts[i];
+
+        if (seen >= rank)
+            return bucket_value(i) < histogram->max ? bucket_value(i) : histogram->max;
+    }
+
+    return histogram->max;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int metrics_register_worker(void) {
+    struct worker_metrics* worker = aligned_alloc(_Alignof(struct worker_metrics),
+                                                  sizeof(struct worker_metrics));
+
+    if (!worker) {
+        fprintf(stderr, "malloc for worker metrics failed\n");
+        return -1;
+    }
+
+    memset(worker, 0, sizeof(struct worker_metrics));
+    pthread_mutex_lock(&metrics.lock);
+
+    if (metrics.workers_num == MAX_WORKERS) {
+        pthread_mutex_unlock(&metrics.lock);
+        fprintf(stderr, "too many workers for metrics\n");
+        free(worker);
+        return -1;
+    }
+
+    if (metrics.workers_num == 0)
+        metrics.start = metrics_now();
+
+    metrics.workers[metrics.workers_num] = worker;
+    // readers take only as many workers as are published here
+    __atomic_store_n(&metrics.workers_num, metrics.workers_num + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&metrics.lock);
+
+    local = worker;
+    return 0;
+}
+
+void metrics_connection_opened(void) {
+    if (local)
+        counter_add(&local->connections_opened, 1);
+}
+
+void metrics_connection_closed(void) {
+    if (local)
+        counter_add(&local->connections_closed, 1);
+}
+
+void metrics_count_request(uint16_t req_type) {
+    if (local)
+        counter_add(&local->requests[req_type <= REQ_TYPES ? req_type : 0], 1);
+}
+
+void metrics_count_refusal(uint64_t reason) {
+    if (local && reason >= 1 && reason <= REFUSAL_REASONS)
+        counter_add(&local->refusals[reason], 1);
+}
+
+void metrics_add_sent(uint64_t bytes) {
+    if (local)
+        counter_add(&local->bytes_sent, bytes);
+}
+
+void metrics_phase_done(enum metrics_phase phase, uint64_t start) {
+    if (!local && !trace_enabled)
+        return;
+
+    uint64_t now = metrics_now();
+
+    if (local)
+        histogram_add(&local->phases[phase], now - start);
+
+    if (trace_enabled)
+        trace_span(phase_names[phase], start, now);
+}
+
+// adds up the counters of all workers into total
+static int collect(struct worker_metrics* total) {
+    int workers_num = __atomic_load_n(&metrics.workers_num, __ATOMIC_ACQUIRE);
+
+    memset(total, 0, sizeof(struct worker_metrics));
+
+    for (int i = 0; i < workers_num; i++) {
+        struct worker_metrics* worker = metrics.workers[i];
+
+        total->connections_opened += counter_read(&worker->connections_opened);
+        total->connections_closed += counter_read(&worker->connections_closed);
+
+        for (int type = 0; type <= REQ_TYPES; type++)
+            total->requests[type] += counter_read(&worker->requests[type]);
+
+        for (int reason = 1; reason <= REFUSAL_REASONS; reason++)
+            total->refusals[reason] += counter_read(&worker->refusals[reason]);
+
+        total->bytes_sent += counter_read(&worker->bytes_sent);
+
+        for (int phase = 0; phase < METRICS_PHASES; phase++)
+            histogram_merge(&total->phases[phase], &worker->phases[phase]);
+    }
+
+    return workers_num;
+}
+
+static bool append_line(dyn_str out, const char* format, ...) {
+    char line[128];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    return len >= 0 && (size_t) len < sizeof(line) && dyn_str_append(out, line, len);
+}
+
+static bool append_text(dyn_str out) {
+    // too big for the stack of a worker
+    struct worker_metrics* total = malloc(sizeof(struct worker_metrics));
+
+    if (!total)
+        return false;
+
+    int workers_num = collect(total);
+    bool ok = append_line(out, "uptime_seconds %.3f\n",
+                          workers_num > 0 ? (metrics_now() - metrics.start) / 1e9 : 0.0)
+              && append_line(out, "workers %d\n", workers_num)
+              && append_line(out, "connections_active %lu\n",
+                             total->connections_opened - total->connections_closed)
+              && append_line(out, "connections_total %lu\n", total->connections_opened);
+
+    for (int type = 1; ok && type <= REQ_TYPES; type++)
+        ok = append_line(out, "requests_%s %lu\n", request_names[type], total->requests[type]);
+
+    ok = ok && append_line(out, "requests_%s %lu\n", request_names[0], total->requests[0]);
+
+    for (int reason = 1; ok && reason <= REFUSAL_REASONS; reason++)
+        ok = append_line(out, "refusals_%s %lu\n", refusal_names[reason],
+                         total->refusals[reason]);
+
+    ok = ok && append_line(out, "bytes_sent %lu\n", total->bytes_sent);
+
+    for (int phase = 0; ok && phase < METRICS_PHASES; phase++) {
+        struct histogram* histogram = &total->phases[phase];
+        const char* name = phase_names[phase];
+
+        ok = append_line(out, "%s_count %lu\n", name, histogram->num)
+             && append_line(out, "%s_mean_us %.1f\n", name,
+                            histogram->num > 0 ? histogram->sum / 1e3 / histogram->num : 0.0)
+             && append_line(out, "%s_p50_us %.1f\n", name, histogram_quantile(histogram, 500) / 1e3)
+             && append_line(out, "%s_p90_us %.1f\n", name, histogram_quantile(histogram, 900) / 1e3)
+             && append_line(out, "%s_p99_us %.1f\n", name, histogram_quantile(histogram, 990) / 1e3)
+             && append_line(out, "%s_p999_us %.1f\n", name,
+                            histogram_quantile(histogram, 999) / 1e3)
+             && append_line(out, "%s_max_us %.1f\n", name, histogram->max / 1e3);
+    }
+
+    free(total);
+    return ok;
+}
+
+int metrics_response(dyn_str* buffer) {
+    struct response_info header = {0};
+
+    if (!*buffer && !(*buffer = dyn_str_init())) {
+        fprintf(stderr, "malloc for stats failed\n");
+        return -1;
+    }
+
+    dyn_str_clear(*buffer);
+
+    if (!dyn_str_append(*buffer, (char*) &header, sizeof(struct response_info))
+        || !append_text(*buffer)) {
+        fprintf(stderr, "malloc for stats failed\n");
+        return -1;
+    }
+
+    header.msg_start = htons(5);
+    header.second_param = htonl((*buffer)->used - 1 - sizeof(struct response_info));
+    memcpy((*buffer)->str, &header, sizeof(struct response_info));
+    return 0;
+}
+
+struct dump {
+    char* path;
+    long interval;
+};
+
+static void* dump_metrics(void* arg) {
+    struct dump* dump = arg;
+    char tmp_path[strlen(dump->path) + sizeof(".tmp")];
+    dyn_str response = NULL;
+
+    sprintf(tmp_path, "%s.tmp", dump->path);
+
+    while (true) {
+        sleep(dump->interval);
+
+        if (metrics_response(&response) < 0)
+            continue;
+
+        FILE* file = fopen(tmp_path, "w");
+
+        if (!file) {
+            syserr_noexit("fopen");
+            continue;
+        }
+
+        size_t len = response->used - 1 - sizeof(struct response_info);
+        bool written = fwrite(response->str + sizeof(struct response_info), 1, len, file) == len;
+
+        if (fclose(file) != 0 || !written) {
+            syserr_noexit("writing %s", tmp_path);
+            continue;
+        }
+
+        if (rename(tmp_path, dump->path) < 0)
+            syserr_noexit("rename");
+    }
+
+    return NULL;
+}
+
+int metrics_dump_start(char* const path, long interval) {
+    static struct dump dump;
+    pthread_t thread;
+
+    dump.path = path;
+    dump.interval = interval;
+
+    int err = pthread_create(&thread, NULL, dump_metrics, &dump);
+    if (err != 0) {
+        errno = err;
+        syserr_noexit("pthread_create");
+        return -1;
+    }
+
+    pthread_detach(thread);
+    return 0;
+}
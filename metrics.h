@@ -0,0 +1,58 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "dynamic_string.h"
+
+/* Counters and latency histograms of the server. Every worker thread keeps its
+ * own copy, updated without locks or atomic read-modify-writes, as it is the
+ * only writer; readers add up the copies of all workers. Events of threads
+ * which are not registered as workers are not counted.
+ * Phases are timed for file and batch requests: parse from the request type
+ * to the whole request being received, open from then to the files being
+ * opened or checked, and send from then to the last byte of the response
+ * being handed to the socket. */
+
+enum metrics_phase {
+    METRICS_PARSE,
+    METRICS_OPEN,
+    METRICS_SEND,
+    METRICS_PHASES
+};
+
+/* Gives the calling thread counters of its own; should be called by every
+ * worker before it serves clients. Returns -1 if memory cannot be allocated,
+ * the thread's events are not counted then. */
+int metrics_register_worker(void);
+
+void metrics_connection_opened(void);
+
+void metrics_connection_closed(void);
+
+/* Counts a request of req_type, an unknown one counted as invalid. */
+void metrics_count_request(uint16_t req_type);
+
+/* Counts a file request refused with reason (second_param of the response). */
+void metrics_count_refusal(uint64_t reason);
+
+void metrics_add_sent(uint64_t bytes);
+
+/* Returns the current time in ns, for timing phases. */
+uint64_t metrics_now(void);
+
+/* Records that phase, which began at start taken with metrics_now, is done;
+ * it is also traced as a span if tracing is on. */
+void metrics_phase_done(enum metrics_phase phase, uint64_t start);
+
+/* Writes the response to a stats request to *buffer, which is allocated on
+ * first use: response_info {5, length of the text} followed by the text, lines
+ * "<name> <value>". Returns -1 if memory cannot be allocated. */
+int metrics_response(dyn_str* buffer);
+
+/* Starts a thread writing the text of the stats response to file path every
+ * interval seconds. The file is replaced as a whole, so readers never see it
+ * half written. Returns -1 if the thread cannot be started. */
+int metrics_dump_start(char* const path, long interval);
+
+#endif //METRICS_H
@@ -0,0 +1,314 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "err.h"
+#include "requests.h"
+#include "fd_cache.h"
+#include "metrics.h"
+#include "log.h"
+
+size_t file_params_size(bool wide) {
+    return wide ? sizeof(struct f_req_params64) : sizeof(struct f_req_params);
+}
+
+void decode_file_params(const void* params, bool wide, struct file_request* request) {
+    if (wide) {
+        struct f_req_params64 f_info;
+
+        memcpy(&f_info, params, sizeof(struct f_req_params64));
+        request->begin_addr = be64toh(f_info.begin_addr);
+        request->part_len = be64toh(f_info.part_len);
+        request->name_len = ntohs(f_info.name_len);
+    } else {
+        struct f_req_params f_info;
+
+        memcpy(&f_info, params, sizeof(struct f_req_params));
+        request->begin_addr = ntohl(f_info.begin_addr);
+        request->part_len = ntohl(f_info.part_len);
+        request->name_len = ntohs(f_info.name_len);
+    }
+}
+
+size_t encode_response(const struct file_response* response, bool wide, void* out) {
+    if (wide) {
+        struct response_info64 r_info = {
+            .msg_start = htons(response->msg_start),
+            .second_param = htobe64(response->second_param)
+        };
+
+        memcpy(out, &r_info, sizeof(struct response_info64));
+        return sizeof(struct response_info64);
+    }
+
+    // in the classic version accepted lengths are below 4 GiB, as is part_len
+    struct response_info r_info = {
+        .msg_start = htons(response->msg_start),
+        .second_param = htonl(response->second_param)
+    };
+
+    memcpy(out, &r_info, sizeof(struct response_info));
+    return sizeof(struct response_info);
+}
+
+uint16_t choose_version(uint16_t client_version, bool framing) {
+    // wide excludes framing, see requests.h
+    if (client_version >= PROTOCOL_WIDE)
+        return PROTOCOL_WIDE;
+
+    if (client_version == PROTOCOL_FRAMED && framing)
+        return PROTOCOL_FRAMED;
+
+    return PROTOCOL_CLASSIC;
+}
+
+bool valid_file_name(char* file_name, uint16_t name_len) {
+    for (uint16_t pos = 0; pos < name_len; pos++) {
+        if (file_name[pos] == '/' || file_name[pos] == 0)
+            return false;
+    }
+
+    return true;
+}
+
+void build_file_path(char* file_path, char* const dir_path, char* file_name) {
+    // path_to_dir + '/' + file_name + '/0'
+    size_t dir_path_len = strlen(dir_path);
+
+    strcpy(file_path, dir_path);
+    file_path[dir_path_len] = '/';
+    strcpy(file_path + dir_path_len + 1, file_name);
+}
+
+void decide_file_request(struct file_request* f_info, bool found, bool regular,
+                         uint64_t size, struct file_response* r_info) {
+    r_info->msg_start = 3;
+
+    if (!found || !regular) {
+        log_debug("invalid filename\n");
+        r_info->msg_start = 2;
+        r_info->second_param = 1;
+    } else if (f_info->begin_addr >= size) {
+        log_debug("invalid begin address\n");
+        r_info->msg_start = 2;
+        r_info->second_param = 2;
+    }
+
+    if (f_info->part_len == 0) {
+        log_debug("invalid part length\n");
+        r_info->msg_start = 2;
+        r_info->second_param = 3;
+    }
+
+    if (r_info->msg_start == 2) {
+        metrics_count_refusal(r_info->second_param);
+        return;
+    }
+
+    if (f_info->part_len > size - f_info->begin_addr)
+        r_info->second_param = size - f_info->begin_addr;
+    else
+        r_info->second_param = f_info->part_len;
+}
+
+int check_file_request(char* const dir_path, struct file_request* f_info,
+                       char* file_name, struct file_response* r_info, int* fd,
+                       struct stat* f_stat) {
+    log_debug("checking params validity\n");
+
+    bool found = false;
+    bool regular = false;
+    uint64_t size = 0;
+    *fd = -1;
+
+    if (valid_file_name(file_name, f_info->name_len)
+        && fd_cache_lookup(file_name, fd, f_stat)) {
+        found = true;
+        regular = true;
+        size = f_stat->st_size;
+    } else if (valid_file_name(file_name, f_info->name_len)) {
+        uint64_t generation = fd_cache_generation();
+        char file_path[strlen(dir_path) + f_info->name_len + 2];
+        build_file_path(file_path, dir_path, file_name);
+
+        // O_NOFOLLOW keeps symbolic links refused, as lstat did before;
+        // O_NONBLOCK keeps a FIFO from blocking the open until a writer
+        // comes, and changes nothing for the regular files which are served
+        *fd = open(file_path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+        if (*fd < 0) {
+            if (errno != ENOENT && errno != ELOOP) {
+                syserr_noexit("open");
+                return -1;
+            }
+
+            errno = 0;
+        } else {
+            if (fstat(*fd, f_stat) < 0) {
+                syserr_noexit("fstat");
+                close(*fd);
+                *fd = -1;
+                return -1;
+            }
+
+            found = true;
+            regular = S_ISREG(f_stat->st_mode);
+            size = f_stat->st_size;
+
+            if (regular)
+                fd_cache_insert(file_name, *fd, f_stat, generation);
+        }
+    }
+
+    decide_file_request(f_info, found, regular, size, r_info);
+
+    if (r_info->msg_start == 2 && *fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+
+    return 0;
+}
+
+int batch_init(struct batch_request* batch, uint16_t count, bool wide) {
+    memset(batch, 0, sizeof(struct batch_request));
+
+    batch->wide = wide;
+    batch->header_size = wide ? sizeof(struct response_info64) : sizeof(struct response_info);
+    batch->entries = malloc(count * sizeof(struct batch_entry));
+    batch->headers = malloc(count * batch->header_size);
+    batch->names = dyn_str_init();
+
+    if (!batch->entries || !batch->headers || !batch->names) {
+        fprintf(stderr, "malloc for batch request failed\n");
+        batch_free(batch);
+        return -1;
+    }
+
+    batch->count = count;
+    return 0;
+}
+
+int batch_add(struct batch_request* batch, struct file_request* f_info, char* file_name) {
+    struct batch_entry* entry = &batch->entries[batch->added];
+
+    entry->f_info = *f_info;
+    entry->name_off = batch->names->used - 1;
+    entry->body_len = 0;
+
+    if (!dyn_str_append(batch->names, file_name, f_info->name_len)
+        || !dyn_str_add(batch->names, '\0')) {
+        fprintf(stderr, "malloc for batch request failed\n");
+        return -1;
+    }
+
+    ++batch->added;
+    return 0;
+}
+
+char* batch_name(struct batch_request* batch, uint16_t i) {
+    return batch->names->str + batch->entries[i].name_off;
+}
+
+void batch_decide(struct batch_request* batch, uint16_t i, bool found, bool regular,
+                  uint64_t size) {
+    struct file_response r_info;
+    char header[MAX_RESPONSE_SIZE];
+
+    decide_file_request(&batch->entries[i].f_info, found, regular, size, &r_info);
+
+    if (r_info.msg_start == 3)
+        batch->entries[i].body_len = r_info.second_param;
+
+    encode_response(&r_info, batch->wide, header);
+    memcpy(batch->headers + i * batch->header_size, header, batch->header_size);
+}
+
+bool batch_has_bodies(struct batch_request* batch) {
+    for (uint16_t i = 0; i < batch->count; i++)
+        if (batch->entries[i].body_len > 0)
+            return true;
+
+    return false;
+}
+
+int batch_check(char* const dir_path, struct batch_request* batch, uint16_t i) {
+    struct file_request* f_info = &batch->entries[i].f_info;
+    char* file_name = batch_name(batch, i);
+    struct stat f_stat;
+    bool found = false;
+
+    if (valid_file_name(file_name, f_info->name_len)) {
+        if (fd_cache_lookup(file_name, NULL, &f_stat)) {
+            batch_decide(batch, i, true, true, f_stat.st_size);
+            return 0;
+        }
+
+        char file_path[strlen(dir_path) + f_info->name_len + 2];
+        build_file_path(file_path, dir_path, file_name);
+
+        if (fstatat(AT_FDCWD, file_path, &f_stat, AT_SYMLINK_NOFOLLOW) < 0) {
+            if (errno != ENOENT) {
+                syserr_noexit("fstatat");
+                return -1;
+            }
+
+            errno = 0;
+        } else {
+            found = true;
+        }
+    }
+
+    batch_decide(batch, i, found, found && S_ISREG(f_stat.st_mode),
+                 found ? f_stat.st_size : 0);
+    return 0;
+}
+
+int batch_open(char* const dir_path, struct batch_request* batch, uint16_t i, int* fd,
+               struct stat* f_stat) {
+    struct batch_entry* entry = &batch->entries[i];
+    char* file_name = batch_name(batch, i);
+    char file_path[strlen(dir_path) + entry->f_info.name_len + 2];
+
+    if (!fd_cache_lookup(file_name, fd, f_stat)) {
+        uint64_t generation = fd_cache_generation();
+
+        build_file_path(file_path, dir_path, file_name);
+
+        // the entry may have been replaced by a FIFO since it was checked
+        *fd = open(file_path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+        if (*fd < 0) {
+            syserr_noexit("open");
+            return -1;
+        }
+
+        if (fstat(*fd, f_stat) < 0) {
+            syserr_noexit("fstat");
+            close(*fd);
+            return -1;
+        }
+
+        if (S_ISREG(f_stat->st_mode))
+            fd_cache_insert(file_name, *fd, f_stat, generation);
+    }
+
+    if (!S_ISREG(f_stat->st_mode)
+        || (uint64_t) f_stat->st_size < entry->f_info.begin_addr + entry->body_len) {
+        fprintf(stderr, "file %s changed after its batch entry was accepted\n", file_name);
+        close(*fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void batch_free(struct batch_request* batch) {
+    free(batch->entries);
+    free(batch->headers);
+    dyn_str_delete(batch->names);
+    memset(batch, 0, sizeof(struct batch_request));
+}
@@ -0,0 +1,124 @@
+#ifndef REQUESTS_H
+#define REQUESTS_H
+
+#include <sys/stat.h>
+#include <stdbool.h>
+
+#include "utilities.h"
+#include "file_list.h"
+
+/* Settings shared by all engines and workers. */
+struct server_config {
+    char* dir_path;
+    bool use_sendfile;   // send file fragments with sendfile instead of copying
+    int prefetch_depth;  // chunks read ahead of the one being sent, 0 for none
+};
+
+/* File request in host byte order, whichever protocol version it came in. */
+struct file_request {
+    uint64_t begin_addr;
+    uint64_t part_len;
+    uint16_t name_len;
+};
+
+/* Response to a file request in host byte order. */
+struct file_response {
+    uint16_t msg_start;
+    uint64_t second_param;
+};
+
+// sizes large enough for messages of every protocol version
+#define MAX_PARAMS_SIZE   sizeof(struct f_req_params64)
+#define MAX_RESPONSE_SIZE sizeof(struct response_info64)
+
+/* Returns the size of file request params in the wide or classic version. */
+size_t file_params_size(bool wide);
+
+/* Decodes file request params received in the wide or classic version. */
+void decode_file_params(const void* params, bool wide, struct file_request* request);
+
+/* Encodes response in the wide or classic version to out, which must have
+ * room for MAX_RESPONSE_SIZE bytes. Returns the size of the message. */
+size_t encode_response(const struct file_response* response, bool wide, void* out);
+
+/* Returns the version the server chooses when client speaks up to version
+ * client_version and the engine supports framing or not. Versions are not
+ * capability bits: wide is chosen for any client speaking it, and wide
+ * connections are never framed, so a client cannot have both 64-bit ranges
+ * and framed streams; one wanting framing has to ask for version 2. */
+uint16_t choose_version(uint16_t client_version, bool framing);
+
+/* Returns false if file_name cannot name a file in the served directory. */
+bool valid_file_name(char* file_name, uint16_t name_len);
+
+/* Writes dir_path + '/' + file_name to file_path, which must have room for
+ * strlen(dir_path) + strlen(file_name) + 2 characters. */
+void build_file_path(char* file_path, char* const dir_path, char* file_name);
+
+/* Decides about file request f_info, given whether the file was found,
+ * whether it is a regular file and its size. Fills r_info with refusal or
+ * acceptance. */
+void decide_file_request(struct file_request* f_info, bool found, bool regular,
+                         uint64_t size, struct file_response* r_info);
+
+/* Validates file request f_info for file_name in directory dir_path. Fills
+ * r_info with refusal or acceptance and, if the request is accepted, sets *fd
+ * to the opened file and *f_stat to its stat result.
+ * Returns -1 on system error, after which the connection should be closed. */
+int check_file_request(char* const dir_path, struct file_request* f_info,
+                       char* file_name, struct file_response* r_info, int* fd,
+                       struct stat* f_stat);
+
+/* Entry of a batch request. */
+struct batch_entry {
+    struct file_request f_info;
+    size_t name_off;           // offset of the name in batch's names
+    uint64_t body_len;         // 0 if the entry is refused
+};
+
+/* Batch request (req_type 3): a vector of file requests, answered with a
+ * vector of response_info headers followed by accepted bodies back to back. */
+struct batch_request {
+    uint16_t count;
+    uint16_t added;            // entries read so far
+    uint16_t next;             // next entry to check or to send the body of
+    bool wide;                 // entries and headers in the wide version
+    struct batch_entry* entries;
+    char* headers;             // encoded, ready to send
+    size_t header_size;        // size of one header
+    dyn_str names;             // names of entries, each ended with '\0'
+};
+
+/* Prepares batch for count entries of the wide or classic version. Returns -1
+ * if memory cannot be allocated. */
+int batch_init(struct batch_request* batch, uint16_t count, bool wide);
+
+/* Adds entry f_info for file_name of f_info->name_len characters. Returns -1
+ * if memory cannot be allocated. */
+int batch_add(struct batch_request* batch, struct file_request* f_info, char* file_name);
+
+char* batch_name(struct batch_request* batch, uint16_t i);
+
+/* Decides about entry i like decide_file_request and stores its header. */
+void batch_decide(struct batch_request* batch, uint16_t i, bool found, bool regular,
+                  uint64_t size);
+
+/* Whether any entry of the decided batch is accepted, so bodies follow the
+ * headers. */
+bool batch_has_bodies(struct batch_request* batch);
+
+/* Checks entry i in directory dir_path without opening the file, so a batch
+ * does not hold a descriptor per entry. Returns -1 on system error. */
+int batch_check(char* const dir_path, struct batch_request* batch, uint16_t i);
+
+/* Opens the file of accepted entry i for sending its body, setting *f_stat to
+ * its stat result. Returns -1 if it cannot be opened or no longer holds the
+ * promised fragment; the connection should then be closed, as the header has
+ * already been sent. */
+int batch_open(char* const dir_path, struct batch_request* batch, uint16_t i, int* fd,
+               struct stat* f_stat);
+
+/* Frees memory of batch and leaves it empty; does nothing for an empty one. */
+void batch_free(struct batch_request* batch);
+
+#endif //REQUESTS_H
@@ -1,93 +1,661 @@
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #include "err.h"
 #include "utilities.h"
-#include "dynamic_string.h"
+#include "requests.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+#include "buffer_pool.h"
+#include "fd_cache.h"
+#include "chunk_cache.h"
+#include "file_map.h"
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
 
 #define QUEUE_LENGTH     128
+#define MAX_WORKERS      1024
+#define FD_CACHE_SIZE    256
+#define CHUNK_CACHE_MIB  64
+#define MAPPED_FILES     128
+#define PREFETCH_CHUNKS  4
+#define MAX_PREFETCH     64
+#define METRICS_SECONDS  10
+
+#define USAGE "Usage: %s [--engine blocking|epoll|uring] [--workers <n>] [--pin-cpus] " \
+              "[--no-sendfile] [--mmap] [--prefetch <chunks>] [--no-list-cache] " \
+              "[--fd-cache <n>] [--chunk-cache <MiB>] [--bench-list <n>] " \
+              "[--bench-send <file-name>] [--buffer-memory <MiB>] [--pool-stats <seconds>] " \
+              "[--metrics-dump <file> [--metrics-interval <seconds>]] " \
+              "[--log-level debug|info|warn] [--trace <file>] " \
+              "<directory-name> [<port-number>]"
+
+enum engine {
+    ENGINE_BLOCKING,
+    ENGINE_EPOLL,
+    ENGINE_URING
+};
+
+// sends len bytes of mapped file starting at offset straight from the mapping,
+// asking for the data ahead to be read meanwhile; returns -1 on error
+int send_mapped_fragment(int msg_sock, struct file_map* map, uint64_t offset, uint64_t len) {
+    uint64_t bytes_left = len;
+
+    log_debug("sending from mapping... bytes left: %lu\n", bytes_left);
+
+    while (bytes_left > 0) {
+        uint32_t chunk_size = bytes_left < MAX_CHUNK_SIZE ? bytes_left : MAX_CHUNK_SIZE;
+
+        file_map_advise(map, offset, bytes_left);
+
+        uint64_t start = trace_begin();
+
+        if (safe_write(msg_sock, file_map_data(map) + offset, chunk_size, "client") < 0)
+            return -1;
+
+        trace_end("write", start);
+
+        metrics_add_sent(chunk_size);
+        offset += chunk_size;
+        bytes_left -= chunk_size;
+        log_debug("sending from mapping... bytes left: %lu\n", bytes_left);
+    }
+
+    return 0;
+}
+
+// sends len bytes of file starting at offset, from its mapping if files are
+// mapped, otherwise with sendfile if possible and by copying through a buffer
+// if not; returns -1 on error
+int send_file_fragment(int msg_sock, struct server_config* config, int file,
+                       const struct stat* f_stat, uint64_t offset, uint64_t len) {
+    struct file_map* map = file_map_get(file, f_stat, offset + len);
+
+    if (map) {
+        int ret = send_mapped_fragment(msg_sock, map, offset, len);
+
+        file_map_put(map);
+        return ret;
+    }
+
+    char* buffer = NULL; // borrowed from the pool only if copying
+    uint64_t bytes_left = len;
+    uint64_t prefetched = 0;
+    uint32_t chunk_size;
+    bool use_sendfile = config->use_sendfile;
+    bool sendfile_unsupported = false;
+    int ret = 0;
+
+    log_debug("sending... bytes left: %lu\n", bytes_left);
+
+    do {
+        chunk_size = bytes_left < MAX_CHUNK_SIZE ? bytes_left
+                                                 : MAX_CHUNK_SIZE;
+
+        // the next chunks are read while this one is sent
+        prefetch_file(file, offset, bytes_left, &prefetched, config->prefetch_depth);
+
+        // with no free buffer in the pool, copying goes on with sendfile
+        if (!use_sendfile && !buffer && !sendfile_unsupported
+            && !(buffer = buffer_get())) {
+            log_warn("no transfer buffer available, using sendfile instead\n");
+            use_sendfile = true;
+        }
+
+        if (use_sendfile) {
+            uint64_t start = trace_begin();
+
+            ret = safe_sendfile(msg_sock, file, &offset, chunk_size, "client");
+            trace_end("sendfile", start);
+
+            if (ret == SENDFILE_UNSUPPORTED) {
+                log_warn("sendfile not supported for this file, copying instead\n");
+                use_sendfile = false;
+                sendfile_unsupported = true;
+                ret = 0;
+            } else if (ret < 0) {
+                break;
+            }
+        }
+
+        if (!use_sendfile) {
+            if (!buffer && !(buffer = buffer_get())) {
+                fprintf(stderr, "no transfer buffer available\n");
+                ret = -1;
+                break;
+            }
+
+            uint64_t start = trace_begin();
+
+            if (pread(file, buffer, chunk_size, offset) != chunk_size) {
+                syserr_noexit("pread");
+                ret = -1;
+                break;
+            }
+
+            trace_end("pread", start);
+            start = trace_begin();
+
+            if ((ret = safe_write(msg_sock, buffer, chunk_size, "client")) < 0)
+                break;
 
-int prepare_file_list(dyn_str* file_list, uint32_t* fl_len, char* const path_name) {
-    *fl_len = 0;
-    struct dirent* file;
-    DIR* path;
+            trace_end("write", start);
 
-    path = opendir(path_name);
-    if (!path) {
-        syserr_noexit("opendir");
+            offset += chunk_size;
+        }
+
+        log_debug("sending... bytes left: %lu\n", bytes_left);
+        metrics_add_sent(chunk_size);
+        bytes_left -= chunk_size;
+    } while (bytes_left > 0);
+
+    buffer_put(buffer);
+
+    return ret;
+}
+
+// reads and drops everything sent to the socket until the other end is closed
+void* drain_socket(void* arg) {
+    int sock = (int) (long) arg;
+    char* buffer = malloc(MAX_CHUNK_SIZE);
+
+    if (!buffer) {
+        fprintf(stderr, "malloc for drained data failed\n");
+        return NULL;
+    }
+
+    while (read(sock, buffer, MAX_CHUNK_SIZE) > 0)
+        continue;
+
+    free(buffer);
+    return NULL;
+}
+
+// sends the whole of file, whose stat result is f_stat, to a socket pair after
+// dropping it from the page cache, and prints how long it took; returns -1 on
+// error
+int time_cold_send(struct server_config* config, int file, const struct stat* f_stat) {
+    uint64_t size = f_stat->st_size;
+    struct timespec start, end;
+    pthread_t drain_thread;
+    int socks[2];
+
+    // only clean pages are dropped, so a file written lately should be synced
+    int err = posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+    if (err != 0) {
+        errno = err;
+        syserr_noexit("posix_fadvise");
         return -1;
     }
 
-    errno = 0;
-    file = readdir(path);
-    if (!file && errno != 0) {
-        syserr_noexit("readdir");
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) < 0) {
+        syserr_noexit("socketpair");
         return -1;
     }
 
-    while (file) {
-        char file_path[MAX_PATH_LEN+1];
-        sprintf(file_path, "%s/%s", path_name, file->d_name);
-        struct stat file_info;
-        lstat(file_path, &file_info);
+    err = pthread_create(&drain_thread, NULL, drain_socket, (void*) (long) socks[1]);
+    if (err != 0) {
+        errno = err;
+        syserr_noexit("pthread_create");
+        close(socks[0]);
+        close(socks[1]);
+        return -1;
+    }
 
-        if (S_ISREG(file_info.st_mode)) {
-            char* pos = file->d_name;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = send_file_fragment(socks[0], config, file, f_stat, 0, size);
+    close(socks[0]);
+    pthread_join(drain_thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(socks[1]);
 
-            while (*pos) {
-                if (!dyn_str_add(*file_list, *pos)) {
-                    fprintf(stderr, "malloc for dynamic string failed\n");
-                    return -1;
-                }
+    if (ret < 0)
+        return -1;
 
-                ++(*fl_len);
-                ++pos;
-            }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("sent %lu MiB from cold page cache in %.3f s (%.0f MB/s), "
+           "%d chunks read ahead, %s\n",
+           size / (1024 * 1024), seconds, size / seconds / 1e6, config->prefetch_depth,
+           config->use_sendfile ? "sendfile" : "copying");
+    return 0;
+}
+
+// sends file file_name of the served directory a few times from cold page
+// cache, without and with reading ahead, and prints the times; returns -1 on
+// error
+int send_benchmark(struct server_config* config, char* file_name) {
+    char file_path[strlen(config->dir_path) + strlen(file_name) + 2];
+    struct stat f_stat;
+
+    build_file_path(file_path, config->dir_path, file_name);
+
+    int file = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (file < 0) {
+        syserr_noexit("open");
+        return -1;
+    }
+
+    if (fstat(file, &f_stat) < 0 || !S_ISREG(f_stat.st_mode) || f_stat.st_size == 0) {
+        fprintf(stderr, "%s is not a regular file with some contents\n", file_path);
+        close(file);
+        return -1;
+    }
+
+    int depth = config->prefetch_depth;
+    int ret = 0;
+
+    // runs alternate, so changing load of the disk affects both alike
+    for (int i = 0; i < 3 && ret == 0; i++) {
+        config->prefetch_depth = 0;
+        ret = time_cold_send(config, file, &f_stat);
+
+        if (ret == 0 && depth > 0) {
+            config->prefetch_depth = depth;
+            ret = time_cold_send(config, file, &f_stat);
+        }
+    }
+
+    config->prefetch_depth = depth;
+    close(file);
+    return ret;
+}
+
+// reads params of the wide or classic version and name of a file request;
+// returns -1 if the connection should be closed
+int read_file_params(int msg_sock, bool wide, struct file_request* f_info, char* file_name) {
+    char params[MAX_PARAMS_SIZE];
+
+    if (safe_read(msg_sock, params, file_params_size(wide), "client") < 0)
+        return -1;
+
+    log_debug("successfully read request params, waiting for filename\n");
+
+    decode_file_params(params, wide, f_info);
+
+    if (f_info->name_len > MAX_PATH_LEN) {
+        log_warn("the name requested by client is too long\n");
+        return -1;
+    }
+
+    if (safe_read(msg_sock, file_name, f_info->name_len, "client") < 0)
+        return -1;
+
+    log_debug("successfully read filename\n");
+
+    file_name[f_info->name_len] = '\0';
+    return 0;
+}
+
+// serves a batch request whose type was received at start: reads and checks
+// all entries, sends their headers and then bodies of the accepted ones;
+// returns -1 if the connection should be closed
+int serve_batch_request(int msg_sock, struct server_config* config, bool wide, uint64_t start) {
+    struct batch_request batch;
+    uint16_t count;
+
+    if (safe_read(msg_sock, &count, sizeof(uint16_t), "client") < 0)
+        return -1;
+
+    count = ntohs(count);
+    log_debug("received a batch request for %u files\n", count);
+
+    if (count == 0)
+        return 0;
+
+    if (count > MAX_BATCH_ENTRIES) {
+        log_warn("too many entries in batch request\n");
+        return -1;
+    }
+
+    if (batch_init(&batch, count, wide) < 0)
+        return -1;
+
+    for (uint16_t i = 0; i < count; ++i) {
+        struct file_request f_info;
+        char file_name[MAX_PATH_LEN + 1];
 
-            dyn_str_add(*file_list, '|');
-            ++(*fl_len);
+        if (read_file_params(msg_sock, wide, &f_info, file_name) < 0
+            || batch_add(&batch, &f_info, file_name) < 0) {
+            batch_free(&batch);
+            return -1;
         }
+    }
 
-        file = readdir(path);
-        if (!file && errno != 0) {
-            syserr_noexit("readdir");
+    metrics_phase_done(METRICS_PARSE, start);
+    start = metrics_now();
+
+    for (uint16_t i = 0; i < count; ++i) {
+        if (batch_check(config->dir_path, &batch, i) < 0) {
+            batch_free(&batch);
             return -1;
         }
     }
 
-    if (closedir(path) < 0) {
-        syserr_noexit("closedir");
+    metrics_phase_done(METRICS_OPEN, start);
+    start = metrics_now();
+
+    // the headers are held back to leave with the first body
+    int ret = batch_has_bodies(&batch)
+              ? safe_write_more(msg_sock, batch.headers, count * batch.header_size, "client")
+              : safe_write(msg_sock, batch.headers, count * batch.header_size, "client");
+
+    if (ret < 0) {
+        batch_free(&batch);
         return -1;
     }
 
-    if (*fl_len != 0)
-        --(*fl_len); //truncate last separator
+    metrics_add_sent(count * batch.header_size);
+    log_debug("successfully sent batch response headers\n");
+
+    for (uint16_t i = 0; i < count; ++i) {
+        struct batch_entry* entry = &batch.entries[i];
+        struct stat f_stat;
+        int file;
+
+        if (entry->body_len == 0)
+            continue;
+
+        if (batch_open(config->dir_path, &batch, i, &file, &f_stat) < 0) {
+            batch_free(&batch);
+            return -1;
+        }
+
+        ret = send_file_fragment(msg_sock, config, file, &f_stat, entry->f_info.begin_addr,
+                                 entry->body_len);
+        close(file);
+
+        if (ret < 0) {
+            batch_free(&batch);
+            return -1;
+        }
+    }
+
+    batch_free(&batch);
+    metrics_phase_done(METRICS_SEND, start);
+    log_debug("successfully sent batch response\n");
+    return 0;
+}
+
+// answers a version request and sets *wide if the wide version was chosen;
+// requests are served one at a time here, so framing is not offered
+int answer_version_request(int msg_sock, bool* wide) {
+    uint16_t client_version;
+    struct response_info r_info;
+
+    if (safe_read(msg_sock, &client_version, sizeof(uint16_t), "client") < 0)
+        return -1;
+
+    client_version = ntohs(client_version);
+    uint16_t version = choose_version(client_version, false);
+
+    log_debug("client speaks protocol version %u, using %u\n", client_version, version);
+
+    r_info.msg_start = htons(4);
+    r_info.second_param = htonl(version);
 
+    if (safe_write(msg_sock, &r_info, sizeof(struct response_info), "client") < 0)
+        return -1;
+
+    metrics_add_sent(sizeof(struct response_info));
+    *wide = version == PROTOCOL_WIDE;
     return 0;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2 || argc > 3)
-        fatal("Usage: %s <directory-name> [<port-number>]", argv[0]);
+// answers a stats request, building the response in *stats_buf; returns -1 if
+// the connection should be closed
+int answer_stats_request(int msg_sock, dyn_str* stats_buf) {
+    log_debug("received a request for stats\n");
 
-    int sock, msg_sock;
-    struct sockaddr_in server_address;
+    if (metrics_response(stats_buf) < 0
+        || safe_write(msg_sock, (*stats_buf)->str, (*stats_buf)->used - 1, "client") < 0)
+        return -1;
+
+    metrics_add_sent((*stats_buf)->used - 1);
+    log_debug("successfully sent stats\n");
+    return 0;
+}
+
+// serves requests of one client until it disconnects or an error occurs;
+// list_buf and stats_buf are reused for building list and stats responses of
+// the connection
+void serve_requests(int msg_sock, struct server_config* config, dyn_str* list_buf,
+                    dyn_str* stats_buf) {
+    bool wide = false;         // wide protocol version negotiated
+
+    while (true) {
+        errno = 0;
+
+        uint16_t req_type = 0;
+
+        if (safe_read(msg_sock, &req_type, sizeof(req_type), "client") < 0) {
+            safe_close(msg_sock);
+            return;
+        }
+
+        req_type = ntohs(req_type);
+        metrics_count_request(req_type);
+
+        uint64_t start = metrics_now();
+
+        if (req_type == 1) {
+            log_debug("received a request for file list\n");
+
+            struct list_response file_list;
+
+            if (file_list_get(config->dir_path, list_buf, wide, &file_list) < 0) {
+                safe_close(msg_sock);
+                return;
+            }
+
+            log_debug("successfully prepared file list\n");
+
+            // the wide list header goes in one write with the list
+            struct fl_info64 wide_info;
+
+            if (wide)
+                file_list_wide_header(&file_list, &wide_info);
+
+            struct iovec iov[2] = {
+                {&wide_info, wide ? sizeof(struct fl_info64) : 0},
+                {file_list.data, file_list.size}
+            };
+            size_t list_size = iov[0].iov_len + iov[1].iov_len;
+
+            if (safe_writev(msg_sock, iov, 2, "client") < 0) {
+                file_list_release(&file_list);
+                safe_close(msg_sock);
+                return;
+            }
+
+            metrics_add_sent(list_size);
+            file_list_release(&file_list);
+            log_debug("successfully sent whole list, waiting for request\n");
+        } else if (req_type == 2) {
+            log_debug("received a request for file, waiting for params\n");
+
+            struct file_request f_info;
+            char file_name[MAX_PATH_LEN + 1]; // with '/0' at the end(?)
+
+            if (read_file_params(msg_sock, wide, &f_info, file_name) < 0) {
+                safe_close(msg_sock);
+                return;
+            }
+
+            metrics_phase_done(METRICS_PARSE, start);
+            start = metrics_now();
+
+            struct file_response r_info;
+            struct stat f_stat;
+            int file;
+
+            if (check_file_request(config->dir_path, &f_info, file_name, &r_info, &file,
+                                   &f_stat) < 0) {
+                safe_close(msg_sock);
+                return;
+            }
+
+            metrics_phase_done(METRICS_OPEN, start);
+            start = metrics_now();
+
+            bool accepted = r_info.msg_start == 3;
+            char header[MAX_RESPONSE_SIZE];
+            size_t header_size = encode_response(&r_info, wide, header);
+            struct cached_fragment fragment;
+            int cached = accepted ? chunk_cache_get(&f_stat, f_info.begin_addr, r_info.second_param,
+                                                    header, header_size, &fragment)
+                                  : 0;
+
+            // this worker serves only this client, so missing chunks are read
+            // right away
+            if (cached == FRAGMENT_PENDING) {
+                cached = fragment_read(file, &fragment) < 0 ? -1 : 1;
+
+                if (cached < 0)
+                    chunk_cache_release(&fragment);
+            }
+
+            if (cached < 0) {
+                close(file);
+                safe_close(msg_sock);
+                return;
+            }
+
+            if (cached > 0) {
+                // the header and the whole fragment go in one writev
+                int ret = fragment_write(msg_sock, &fragment);
+
+                chunk_cache_release(&fragment);
+                close(file);
+
+                if (ret < 0) {
+                    safe_close(msg_sock);
+                    return;
+                }
+
+                metrics_phase_done(METRICS_SEND, start);
+                log_debug("successfully sent requested file fragment from cache\n");
+                continue;
+            }
+
+            // the header of an accepted request is held back to leave with the body
+            int ret = accepted ? safe_write_more(msg_sock, header, header_size, "client")
+                               : safe_write(msg_sock, header, header_size, "client");
+
+            if (ret < 0) {
+                if (accepted)
+                    close(file);
+
+                safe_close(msg_sock);
+                return;
+            }
+
+            metrics_add_sent(header_size);
+
+            if (!accepted) {
+                metrics_phase_done(METRICS_SEND, start);
+                log_debug("successfully sent response info (refuse)\n");
+                continue;
+            }
+
+            log_debug("successfully sent response info (accepted request)\n");
+
+            ret = send_file_fragment(msg_sock, config, file, &f_stat, f_info.begin_addr,
+                                     r_info.second_param);
+            close(file);
+
+            if (ret < 0) {
+                safe_close(msg_sock);
+                return;
+            }
+
+            metrics_phase_done(METRICS_SEND, start);
+            log_debug("successfully sent requested file fragment\n");
+        } else if (req_type == 3) {
+            if (serve_batch_request(msg_sock, config, wide, start) < 0) {
+                safe_close(msg_sock);
+                return;
+            }
+        } else if (req_type == 4) {
+            if (answer_version_request(msg_sock, &wide) < 0) {
+                safe_close(msg_sock);
+                return;
+            }
+        } else if (req_type == 5) {
+            if (answer_stats_request(msg_sock, stats_buf) < 0) {
+                safe_close(msg_sock);
+                return;
+            }
+        } else {
+            log_warn("invalid request format\n");
+        }
+    }
+}
+
+void serve_client(int msg_sock, struct server_config* config) {
+    dyn_str list_buf = NULL;
+    dyn_str stats_buf = NULL;
+
+    metrics_connection_opened();
+    serve_requests(msg_sock, config, &list_buf, &stats_buf);
+    metrics_connection_closed();
+    dyn_str_delete(list_buf);
+    dyn_str_delete(stats_buf);
+}
+
+// accepts clients one at a time and serves each until it disconnects
+void run_blocking_loop(int sock, struct server_config* config) {
+    int msg_sock;
     struct sockaddr_in client_address;
     socklen_t client_address_len;
 
-    uint16_t port_num = DEFAULT_PORT_NUM;
+    while (true) {
+        errno = 0;
+
+        // get client connection from the socket
+        client_address_len = sizeof(client_address);
+
+        uint64_t start = trace_begin();
+
+        msg_sock = accept(sock, (struct sockaddr *) &client_address, &client_address_len);
+
+        if (msg_sock < 0) {
+            syserr_noexit("accept");
+            continue;
+        }
 
-    if (argc == 3)
-        parse_port(argv[2], &port_num);
+        trace_end("accept", start);
+        log_info("connection accepted, waiting for request\n");
+
+        start = trace_begin();
+        set_nodelay(msg_sock);
+        serve_client(msg_sock, config);
+        trace_end("connection", start);
+    }
+}
+
+// with reuse_port set, several sockets may be bound to the same port and the
+// kernel spreads incoming connections between them
+int open_listening_socket(uint16_t port_num, bool reuse_port) {
+    int sock;
+    struct sockaddr_in server_address;
 
     sock = socket(PF_INET, SOCK_STREAM, 0); // creating IPv4 TCP socket
     if (sock < 0)
@@ -95,6 +663,10 @@ int main(int argc, char* argv[]) {
     // after socket() call; we should close(sock) on any execution path;
     // since all execution paths exit immediately, sock would be closed when program terminates
 
+    int one = 1;
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+        syserr("setsockopt");
+
     server_address.sin_family = AF_INET; // IPv4
     server_address.sin_addr.s_addr = htonl(INADDR_ANY); // listening on all interfaces
     server_address.sin_port = htons(port_num); // listening on port PORT_NUM
@@ -107,264 +679,266 @@ int main(int argc, char* argv[]) {
     if (listen(sock, QUEUE_LENGTH) < 0)
         syserr("listen");
 
-    printf("accepting client connections on port %hu\n", ntohs(server_address.sin_port));
-
-    client_address_len = sizeof(client_address);
-
-    while (true) {
-        errno = 0;
-
-        // get client connection from the socket
-        msg_sock = accept(sock, (struct sockaddr *) &client_address, &client_address_len);
-
-        if (msg_sock < 0) {
-            syserr_noexit("accept");
-            continue;
-        }
-
-        printf("connection accepted, waiting for request\n");
-
-        while (true) {
-            errno = 0;
-
-            uint16_t req_type = 0;
+    return sock;
+}
 
-            if (safe_read(msg_sock, &req_type, sizeof(req_type), "client") < 0) {
-                safe_close(msg_sock);
-                break;
-            }
+struct worker {
+    pthread_t thread;
+    int id;
+    int sock;
+    int cpu;                   // -1 if the worker is not pinned
+    enum engine engine;
+    struct server_config* config;
+};
+
+void* run_worker(void* arg) {
+    struct worker* worker = arg;
+
+    if (metrics_register_worker() < 0)
+        fprintf(stderr, "worker %d: requests will not be counted\n", worker->id);
+
+    if (worker->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err != 0)
+            fprintf(stderr, "worker %d: cannot pin to cpu %d: %s\n",
+                    worker->id, worker->cpu, strerror(err));
+    }
 
-            req_type = ntohs(req_type);
+    if (worker->engine == ENGINE_URING) {
+        if (run_uring_loop(worker->sock, worker->config) < 0)
+            fatal("io_uring loop failed");
+    } else if (worker->engine == ENGINE_EPOLL) {
+        if (run_event_loop(worker->sock, worker->config) < 0)
+            fatal("event loop failed");
+    } else {
+        run_blocking_loop(worker->sock, worker->config);
+    }
 
-            if (req_type == 1) {
-                printf("received a request for file list\n");
+    return NULL;
+}
 
-                struct fl_info info;
-                info.msg_start = htons(1);
-                uint32_t fl_len;
+// prints transfer buffer pool and cache counters every interval seconds
+void* print_pool_stats(void* interval) {
+    while (true) {
+        sleep((long) interval);
+        buffer_pool_print_stats();
+        fd_cache_print_stats();
+        chunk_cache_print_stats();
+        file_map_print_stats();
+    }
 
-                dyn_str file_list = dyn_str_init();
+    return NULL;
+}
 
-                if (!file_list) {
-                    fprintf(stderr, "malloc for dynamic string failed\n");
-                    safe_close(msg_sock);
-                    break;
-                }
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"engine", required_argument, NULL, 'e'},
+        {"workers", required_argument, NULL, 'w'},
+        {"pin-cpus", no_argument, NULL, 'p'},
+        {"no-sendfile", no_argument, NULL, 'c'},
+        {"mmap", no_argument, NULL, 'a'},
+        {"prefetch", required_argument, NULL, 'r'},
+        {"no-list-cache", no_argument, NULL, 'l'},
+        {"fd-cache", required_argument, NULL, 'o'},
+        {"chunk-cache", required_argument, NULL, 'k'},
+        {"bench-list", required_argument, NULL, 'b'},
+        {"bench-send", required_argument, NULL, 'n'},
+        {"buffer-memory", required_argument, NULL, 'm'},
+        {"pool-stats", required_argument, NULL, 's'},
+        {"metrics-dump", required_argument, NULL, 'd'},
+        {"metrics-interval", required_argument, NULL, 'i'},
+        {"log-level", required_argument, NULL, 'g'},
+        {"trace", required_argument, NULL, 'x'},
+        {NULL, 0, NULL, 0}
+    };
+
+    enum engine engine = ENGINE_BLOCKING;
+    long workers_num = 1;
+    bool pin_cpus = false;
+    bool cache_list = true;
+    bool map_files = false;
+    long fd_cache_size = FD_CACHE_SIZE;
+    long chunk_cache_mib = CHUNK_CACHE_MIB;
+    long bench_files = 0;
+    char* bench_file_name = NULL;
+    long prefetch_depth = PREFETCH_CHUNKS;
+    long buffer_memory;
+    long stats_interval = 0;
+    char* metrics_path = NULL;
+    char* trace_path = NULL;
+    long metrics_interval = METRICS_SECONDS;
+    struct server_config config = {
+        .use_sendfile = true
+    };
+    char* endptr;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        if (opt == 'e' && strcmp(optarg, "blocking") == 0) {
+            engine = ENGINE_BLOCKING;
+        } else if (opt == 'e' && strcmp(optarg, "epoll") == 0) {
+            engine = ENGINE_EPOLL;
+        } else if (opt == 'e' && strcmp(optarg, "uring") == 0) {
+            engine = ENGINE_URING;
+        } else if (opt == 'w') {
+            workers_num = strtol(optarg, &endptr, 10);
+
+            if (*endptr != '\0' || workers_num < 1 || workers_num > MAX_WORKERS)
+                fatal("number of workers must be between 1 and %d", MAX_WORKERS);
+        } else if (opt == 'p') {
+            pin_cpus = true;
+        } else if (opt == 'c') {
+            config.use_sendfile = false;
+        } else if (opt == 'a') {
+            map_files = true;
+        } else if (opt == 'r') {
+            prefetch_depth = strtol(optarg, &endptr, 10);
+
+            if (*endptr != '\0' || prefetch_depth < 0 || prefetch_depth > MAX_PREFETCH)
+                fatal("number of chunks read ahead must be between 0 and %d", MAX_PREFETCH);
+        } else if (opt == 'l') {
+            cache_list = false;
+        } else if (opt == 'o') {
+            fd_cache_size = strtol(optarg, &endptr, 10);
+
+            if (*endptr != '\0' || fd_cache_size < 0)
+                fatal("open file cache size must be a number of files, 0 to disable it");
+        } else if (opt == 'k') {
+            chunk_cache_mib = strtol(optarg, &endptr, 10);
+
+            if (*endptr != '\0' || chunk_cache_mib < 0)
+                fatal("chunk cache size must be a number of MiB, 0 to disable it");
+        } else if (opt == 'm') {
+            buffer_memory = strtol(optarg, &endptr, 10);
+
+            if (*endptr != '\0' || buffer_memory < 0)
+                fatal("buffer memory must be a number of MiB, 0 for no limit");
+
+            buffer_pool_set_limit(buffer_memory * 1024 * 1024);
+        } else if (opt == 's') {
+            stats_interval = strtol(optarg, &endptr, 10);
+
+            if (*endptr != '\0' || stats_interval < 1)
+                fatal("stats interval must be a positive number of seconds");
+        } else if (opt == 'd') {
+            metrics_path = optarg;
+        } else if (opt == 'i') {
+            metrics_interval = strtol(optarg, &endptr, 10);
+
+            if (*endptr != '\0' || metrics_interval < 1)
+                fatal("metrics interval must be a positive number of seconds");
+        } else if (opt == 'g') {
+            if (log_set_level(optarg) < 0)
+                fatal("log level must be debug, info or warn");
+        } else if (opt == 'x') {
+            trace_path = optarg;
+        } else if (opt == 'b') {
+            bench_files = strtol(optarg, &endptr, 10);
+
+            if (*endptr != '\0' || bench_files < 1)
+                fatal("number of files must be positive");
+        } else if (opt == 'n') {
+            bench_file_name = optarg;
+        } else {
+            fatal(USAGE, argv[0]);
+        }
+    }
 
-                if (prepare_file_list(&file_list, &fl_len, argv[1])) {
-                    safe_close(msg_sock);
-                    break;
-                }
+    if (argc - optind < 1 || argc - optind > 2)
+        fatal(USAGE, argv[0]);
 
-                printf("successfully prepared file list\n");
-                info.fl_len = htonl(fl_len);
+    config.dir_path = argv[optind];
+    config.prefetch_depth = prefetch_depth;
 
-                if (safe_write(msg_sock, &info, sizeof(struct fl_info), "client") < 0) {
-                    dyn_str_delete(file_list);
-                    safe_close(msg_sock);
-                    break;
-                }
+    // before any thread is started, so that they leave signals to the tracer
+    if (trace_path && trace_start(trace_path) < 0)
+        fprintf(stderr, "cannot start tracing, spans will not be recorded\n");
 
-                printf("successfully sent file list info\n");
+    // benchmark mode: directory-name is a new directory to fill with files
+    if (bench_files > 0)
+        return file_list_benchmark(config.dir_path, bench_files) < 0 ? 1 : 0;
 
-                if (fl_len > 0) {
-                    if (safe_write(msg_sock, file_list->str, fl_len, "client") <
-                        0) {
-                        dyn_str_delete(file_list);
-                        safe_close(msg_sock);
-                        break;
-                    }
+    // benchmark mode: file-name in directory-name is sent from cold page cache
+    if (bench_file_name)
+        return send_benchmark(&config, bench_file_name) < 0 ? 1 : 0;
 
-                    dyn_str_delete(file_list);
-                    printf("successfully sent whole list, waiting for request\n");
-                }
-            } else if (req_type == 2) {
-                printf("received a request for file, waiting for params\n");
+    uint16_t port_num = DEFAULT_PORT_NUM;
 
-                struct f_req_params f_info;
+    if (argc - optind == 2)
+        parse_port(argv[optind + 1], &port_num);
 
-                if (safe_read(msg_sock, &f_info, sizeof(struct f_req_params), "client") <
-                    0) {
-                    safe_close(msg_sock);
-                    break;
-                }
+    // a client disconnecting in the middle of a transfer must not kill the server
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        syserr("signal");
 
-                printf("successfully read request params, waiting for filename\n");
+    if (engine == ENGINE_URING && !uring_available()) {
+        log_warn("io_uring is not available, falling back to epoll\n");
+        engine = ENGINE_EPOLL;
+    }
 
-                f_info.begin_addr = ntohl(f_info.begin_addr);
-                f_info.part_len = ntohl(f_info.part_len);
-                f_info.name_len = ntohs(f_info.name_len);
+    bool watching = cache_list && file_list_cache_start(config.dir_path) == 0;
 
-                char file_name[MAX_PATH_LEN + 1]; // with '/0' at the end(?)
+    if (cache_list && !watching)
+        log_warn("cannot watch directory, file list will be prepared on every request\n");
 
-                if (f_info.name_len > MAX_PATH_LEN) {
-                    printf("the name requested by client is too long\n");
-                    safe_close(msg_sock);
-                    break;
-                }
+    // cached files are dropped on changes seen by the directory watch
+    if (fd_cache_size > 0 && !watching)
+        log_warn("directory is not watched, files will be opened on every request\n");
+    else if (fd_cache_size > 0 && fd_cache_init(fd_cache_size) < 0)
+        log_warn("cannot cache open files, files will be opened on every request\n");
 
-                if (safe_read(msg_sock, file_name, f_info.name_len, "client") < 0) {
-                    safe_close(msg_sock);
-                    break;
-                }
+    if (chunk_cache_mib > 0 && chunk_cache_init(chunk_cache_mib * 1024 * 1024) < 0)
+        log_warn("cannot cache file chunks, fragments will be read on every request\n");
 
-                printf("successfully read filename\n");
+    if (map_files && file_map_init(MAPPED_FILES) < 0)
+        log_warn("cannot map files, fragments will be sent without mapping\n");
 
-                file_name[f_info.name_len] = '\0';
+    pthread_t stats_thread;
 
-                printf("checking params validity\n");
+    if (stats_interval > 0) {
+        int err = pthread_create(&stats_thread, NULL, print_pool_stats, (void*) stats_interval);
+        if (err != 0) {
+            errno = err;
+            syserr("pthread_create");
+        }
+    }
 
-                uint16_t msg_start = 3;
-                uint32_t second_param;
-                bool valid_pathname = true;
+    if (metrics_path && metrics_dump_start(metrics_path, metrics_interval) < 0)
+        log_warn("cannot start writing metrics to %s\n", metrics_path);
 
-                for (uint16_t pos = 0; pos < f_info.name_len; pos++) {
-                    if (file_name[pos] == '/' || file_name[pos] == 0) {
-                        printf("invalid filename\n");
+    long cpus_num = sysconf(_SC_NPROCESSORS_ONLN);
+    struct worker workers[workers_num];
 
-                        msg_start = 2;
-                        second_param = 1;
-                        valid_pathname = false;
-                        break;
-                    }
-                }
+    // every worker gets its own listening socket, so they never contend on accept
+    for (int i = 0; i < workers_num; i++) {
+        workers[i].id = i;
+        workers[i].sock = open_listening_socket(port_num, workers_num > 1);
+        workers[i].cpu = pin_cpus && cpus_num > 0 ? i % cpus_num : -1;
+        workers[i].engine = engine;
+        workers[i].config = &config;
+    }
 
-                // path_to_dir + '/' + file_name + '/0'
-                size_t dir_path_len = strlen(argv[1]);
-                size_t file_path_len = dir_path_len + f_info.name_len + 2;
-                char file_path[file_path_len];
-
-                strcpy(file_path, argv[1]);
-                file_path[dir_path_len] = '/';
-                strcpy(file_path + dir_path_len + 1, file_name);
-
-                FILE * file;
-
-                if (valid_pathname) {
-                    file = fopen(file_path, "r");
-                    if (!file) {
-                        if (errno == ENOENT) {
-                            printf("invalid filename\n");
-
-                            msg_start = 2;
-                            second_param = 1;
-                            errno = 0;
-                        } else {
-                            syserr_noexit("fopen");
-                            safe_close(msg_sock);
-                            break;
-                        }
-                    } else {
-                        struct stat f_stat;
-
-                        if (lstat(file_path, &f_stat) < 0) {
-                            syserr_noexit("stat");
-                            safe_close(msg_sock);
-                            break;
-                        }
-
-                        if (!S_ISREG(f_stat.st_mode)) {
-                            printf("invalid filename\n");
-
-                            msg_start = 2;
-                            second_param = 1;
-                        } else if (f_info.begin_addr > f_stat.st_size - 1) {
-                            printf("invalid begin address\n");
-                            msg_start = 2;
-                            second_param = 2;
-                        }
-                    }
-                }
+    log_info("accepting client connections on port %hu (%ld workers)\n",
+             port_num, workers_num);
 
-                if (f_info.part_len == 0) {
-                    printf("invalid part length\n");
-                    msg_start = 2;
-                    second_param = 3;
-                }
+    // from now on workers log through the background thread
+    if (log_start() < 0)
+        fprintf(stderr, "cannot start logging thread, messages will be printed right away\n");
 
-                if (msg_start == 2) {
-                    struct response_info r_info;
-                    r_info.msg_start = htons(msg_start);
-                    r_info.second_param = htonl(second_param);
-
-                    if (safe_write(msg_sock, &r_info,
-                                   sizeof(struct response_info), "client") < 0) {
-                        safe_close(msg_sock);
-                        break;
-                    }
-
-                    printf("successfully sent response info (refuse)\n");
-                } else {
-                    struct response_info r_info;
-                    r_info.msg_start = htons(msg_start);
-
-                    struct stat f_stat;
-
-                    if (lstat(file_path, &f_stat) < 0) {
-                        syserr_noexit("stat");
-                        safe_close(msg_sock);
-                        break;
-                    }
-
-                    if (f_info.begin_addr + f_info.part_len > f_stat.st_size)
-                        second_param = f_stat.st_size - f_info.begin_addr;
-                    else
-                        second_param = f_info.part_len;
-
-                    r_info.second_param = htonl(second_param);
-
-                    if (safe_write(msg_sock, &r_info,
-                                   sizeof(struct response_info), "client") < 0) {
-                        safe_close(msg_sock);
-                        break;
-                    }
-
-                    printf("successfully sent response info (accepted request)\n");
-
-                    char buffer[MAX_CHUNK_SIZE];
-                    uint64_t bytes_left = second_param;
-                    uint32_t chunk_size;
-                    bool err = false;
-
-                    if (fseek(file, f_info.begin_addr, SEEK_SET)) {
-                        syserr_noexit("fseek");
-                        safe_close(msg_sock);
-                        break;
-                    }
-
-                    printf("sending... bytes left: %lu\n", bytes_left);
-
-                    do {
-                        chunk_size = bytes_left < MAX_CHUNK_SIZE ? bytes_left
-                                                                 : MAX_CHUNK_SIZE;
-
-                        if (fread(&buffer, 1, chunk_size, file) != chunk_size) {
-                            syserr_noexit("fread");
-                            safe_close(msg_sock);
-                            err = true;
-                            break;
-                        }
-
-                        if (safe_write(msg_sock, &buffer, chunk_size, "client") < 0) {
-                            safe_close(msg_sock);
-                            err = true;
-                            break;
-                        }
-
-                        printf("sending... bytes left: %lu\n", bytes_left);
-                        bytes_left -= chunk_size;
-                    } while (bytes_left > 0);
-
-                    if (err)
-                        break;
-
-                    printf("successfully sent requested file fragment\n");
-                }
-            } else {
-                printf("invalid request format\n");
-            }
+    for (int i = 1; i < workers_num; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+        if (err != 0) {
+            errno = err;
+            syserr("pthread_create");
         }
     }
 
+    // the main thread is worker 0
+    run_worker(&workers[0]);
+
     return 0;
-}
\ No newline at end of file
+}
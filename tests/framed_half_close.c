@@ -0,0 +1,201 @@
+/* A framed client sending its requests and then shutting down its side of the
+ * connection must still get every response in full from the epoll engine.
+ * Run by make check; exits with 0 if all bodies arrived. */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "err.h"
+#include "utilities.h"
+#include "requests.h"
+#include "event_loop.h"
+
+// more than are served at once, so that some are read only after others end
+#define REQUESTS   100
+#define FILE_SIZE  (1024*1024)
+#define PART_BEGIN(i) ((i) * 4096)
+#define PART_LEN   200000
+
+static char contents[FILE_SIZE];
+
+static struct server_config config = {
+    .use_sendfile = true
+};
+
+static void* serve(void* arg) {
+    run_event_loop(*(int*) arg, &config);
+    fatal("event loop ended");
+    return NULL;
+}
+
+// starts the epoll engine on a free port of localhost; returns the port
+static uint16_t start_server(void) {
+    static int sock;
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    socklen_t address_len = sizeof(address);
+    pthread_t thread;
+
+    if ((sock = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+        syserr("socket");
+
+    if (bind(sock, (struct sockaddr*) &address, sizeof(address)) < 0
+        || listen(sock, 16) < 0
+        || getsockname(sock, (struct sockaddr*) &address, &address_len) < 0)
+        syserr("listening socket");
+
+    if ((errno = pthread_create(&thread, NULL, serve, &sock)) != 0)
+        syserr("pthread_create");
+
+    return ntohs(address.sin_port);
+}
+
+static void read_all(int sock, void* buffer, size_t count) {
+    if (safe_read(sock, buffer, count, "server") < 0)
+        fatal("connection ended early");
+}
+
+// appends request id of a classic file request for file to buffer
+static size_t encode_request(char* buffer, uint32_t id, char* const file) {
+    uint32_t frame_id = htonl(id);
+    uint16_t req_type = htons(2);
+    struct f_req_params params = {
+        .begin_addr = htonl(PART_BEGIN(id)),
+        .part_len = htonl(PART_LEN),
+        .name_len = htons(strlen(file))
+    };
+    size_t len = 0;
+
+    memcpy(buffer + len, &frame_id, sizeof(frame_id));
+    len += sizeof(frame_id);
+    memcpy(buffer + len, &req_type, sizeof(req_type));
+    len += sizeof(req_type);
+    memcpy(buffer + len, &params, sizeof(params));
+    len += sizeof(params);
+    memcpy(buffer + len, file, strlen(file));
+    return len + strlen(file);
+}
+
+int main(void) {
+    char dir_path[] = "/tmp/framed_testXXXXXX";
+    char file_path[sizeof(dir_path) + sizeof("/data")];
+
+    if (!mkdtemp(dir_path))
+        syserr("mkdtemp");
+
+    sprintf(file_path, "%s/data", dir_path);
+
+    for (size_t i = 0; i < FILE_SIZE; i++)
+        contents[i] = i * 7 + i / 251;
+
+    FILE* file = fopen(file_path, "w");
+
+    if (!file || fwrite(contents, 1, FILE_SIZE, file) != FILE_SIZE || fclose(file) != 0)
+        syserr("writing %s", file_path);
+
+    signal(SIGPIPE, SIG_IGN);
+    config.dir_path = dir_path;
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(start_server()),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    int sock = socket(PF_INET, SOCK_STREAM, 0);
+
+    if (sock < 0 || connect(sock, (struct sockaddr*) &address, sizeof(address)) < 0)
+        syserr("connect");
+
+    // a lost response must fail the test rather than hang it
+    struct timeval timeout = {10, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint16_t version_request[2] = {htons(4), htons(PROTOCOL_FRAMED)};
+    struct response_info version;
+
+    if (safe_write(sock, version_request, sizeof(version_request), "server") < 0)
+        fatal("cannot ask for the framed version");
+
+    read_all(sock, &version, sizeof(version));
+
+    if (ntohl(version.second_param) != PROTOCOL_FRAMED)
+        fatal("server did not switch to the framed version");
+
+    static char requests[REQUESTS * (sizeof(uint32_t) + sizeof(uint16_t)
+                                     + sizeof(struct f_req_params) + sizeof("data"))];
+    size_t requests_len = 0;
+
+    for (uint32_t id = 0; id < REQUESTS; id++)
+        requests_len += encode_request(requests + requests_len, id, "data");
+
+    if (safe_write(sock, requests, requests_len, "server") < 0)
+        fatal("cannot send requests");
+
+    if (shutdown(sock, SHUT_WR) < 0)
+        syserr("shutdown");
+
+    uint64_t received[REQUESTS] = {0};
+    bool answered[REQUESTS] = {false};
+    static char payload[FRAME_DATA_SIZE];
+    struct frame_header frame;
+    ssize_t len;
+
+    // frames until the server closes the connection
+    while ((len = recv(sock, &frame, 1, MSG_PEEK)) > 0) {
+        read_all(sock, &frame, sizeof(frame));
+
+        uint32_t id = ntohl(frame.request_id);
+        uint32_t frame_len = ntohl(frame.len);
+
+        if (id >= REQUESTS || frame_len > FRAME_DATA_SIZE)
+            fatal("invalid frame");
+
+        read_all(sock, payload, frame_len);
+
+        if (ntohs(frame.kind) == FRAME_RESPONSE) {
+            struct response_info* response = (struct response_info*) payload;
+
+            if (ntohs(response->msg_start) != 3 || ntohl(response->second_param) != PART_LEN)
+                fatal("request %u refused", id);
+
+            answered[id] = true;
+        } else {
+            if (!answered[id] || received[id] + frame_len > PART_LEN
+                || memcmp(payload, contents + PART_BEGIN(id) + received[id], frame_len) != 0)
+                fatal("wrong data of request %u", id);
+
+            received[id] += frame_len;
+        }
+    }
+
+    if (len < 0)
+        syserr("reading from server socket");
+
+    int incomplete = 0;
+
+    for (int id = 0; id < REQUESTS; id++)
+        incomplete += received[id] != PART_LEN;
+
+    unlink(file_path);
+    rmdir(dir_path);
+
+    if (incomplete > 0)
+        fatal("%d of %d responses incomplete", incomplete, REQUESTS);
+
+    printf("all %d responses complete\n", REQUESTS);
+    return 0;
+}
@@ -0,0 +1,253 @@
+/* Fragments of a sparse file larger than 4 GiB, asked for in the wide version,
+ * must come back whole from both the epoll and the io_uring engine: offsets
+ * and lengths above 32 bits, a range crossing 4 GiB and the end of the file.
+ * Run by make check; exits with 0 if every engine served every range. */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "err.h"
+#include "utilities.h"
+#include "requests.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+
+#define FILE_NAME  "sparse"
+#define FILE_SIZE  (20ULL*1024*1024*1024)
+#define FOUR_GIB   (4ULL*1024*1024*1024)
+
+// written over the holes: one straddling 4 GiB, one ending the file
+#define MARKER     "0123456789abcdef"
+#define MARKER_LEN (sizeof(MARKER) - 1)
+#define LOW_MARKER  (FOUR_GIB - MARKER_LEN / 2)
+#define HIGH_MARKER (FILE_SIZE - MARKER_LEN)
+
+static struct server_config config = {
+    .use_sendfile = true
+};
+
+struct engine {
+    const char* name;
+    int (*run)(int sock, struct server_config* config);
+    int sock;
+};
+
+static void* serve(void* arg) {
+    struct engine* engine = arg;
+    engine->run(engine->sock, &config);
+    fatal("%s engine ended", engine->name);
+    return NULL;
+}
+
+// starts engine on a free port of localhost; returns the port
+static uint16_t start_server(struct engine* engine) {
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    socklen_t address_len = sizeof(address);
+    pthread_t thread;
+
+    if ((engine->sock = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+        syserr("socket");
+
+    if (bind(engine->sock, (struct sockaddr*) &address, sizeof(address)) < 0
+        || listen(engine->sock, 16) < 0
+        || getsockname(engine->sock, (struct sockaddr*) &address, &address_len) < 0)
+        syserr("listening socket");
+
+    if ((errno = pthread_create(&thread, NULL, serve, engine)) != 0)
+        syserr("pthread_create");
+
+    return ntohs(address.sin_port);
+}
+
+// reads like safe_read, but goes on after EINTR: the engines run in this
+// process, and task work the kernel queues for io_uring interrupts reads with
+// a timeout even though no signal is delivered
+static void read_all(int sock, void* buffer, size_t count) {
+    size_t offset = 0;
+
+    while (offset < count) {
+        ssize_t len = read(sock, (char*) buffer + offset, count - offset);
+
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0)
+            syserr("reading from server socket");
+        if (len == 0)
+            fatal("connection ended early");
+
+        offset += len;
+    }
+}
+
+// returns the byte of the file at offset
+static char expected_byte(uint64_t offset) {
+    if (offset >= LOW_MARKER && offset < LOW_MARKER + MARKER_LEN)
+        return MARKER[offset - LOW_MARKER];
+    if (offset >= HIGH_MARKER)
+        return MARKER[offset - HIGH_MARKER];
+    return 0;
+}
+
+// asks for part_len bytes from begin_addr; returns the response, with the
+// accepted body read and checked against the file
+static struct response_info64 fetch(int sock, uint64_t begin_addr, uint64_t part_len) {
+    static char body[MAX_CHUNK_SIZE];
+    static const char zeros[MAX_CHUNK_SIZE];
+    uint16_t req_type = htons(2);
+    struct f_req_params64 params = {
+        .begin_addr = htobe64(begin_addr),
+        .part_len = htobe64(part_len),
+        .name_len = htons(strlen(FILE_NAME))
+    };
+    char request[sizeof(req_type) + sizeof(params) + strlen(FILE_NAME)];
+    struct response_info64 response;
+
+    memcpy(request, &req_type, sizeof(req_type));
+    memcpy(request + sizeof(req_type), &params, sizeof(params));
+    memcpy(request + sizeof(req_type) + sizeof(params), FILE_NAME, strlen(FILE_NAME));
+
+    if (safe_write(sock, request, sizeof(request), "server") < 0)
+        fatal("cannot send request");
+
+    read_all(sock, &response, sizeof(response));
+
+    if (ntohs(response.msg_start) != 3)
+        return response;
+
+    uint64_t offset = begin_addr;
+    uint64_t end = begin_addr + be64toh(response.second_param);
+
+    while (offset < end) {
+        size_t len = end - offset < MAX_CHUNK_SIZE ? end - offset : MAX_CHUNK_SIZE;
+        read_all(sock, body, len);
+
+        // most of the file is a hole; only chunks with a marker are compared
+        // byte by byte
+        bool plain = offset + len <= LOW_MARKER
+                     || (offset >= LOW_MARKER + MARKER_LEN && offset + len <= HIGH_MARKER);
+
+        if (plain && memcmp(body, zeros, len) != 0)
+            fatal("wrong data in chunk at %lu", offset);
+
+        for (size_t i = 0; !plain && i < len; i++)
+            if (body[i] != expected_byte(offset + i))
+                fatal("wrong byte at %lu", offset + i);
+
+        offset += len;
+    }
+
+    return response;
+}
+
+static void expect(struct response_info64 response, uint16_t msg_start, uint64_t second_param,
+                   const char* what) {
+    if (ntohs(response.msg_start) != msg_start || be64toh(response.second_param) != second_param)
+        fatal("%s: got {%u, %lu}, expected {%u, %lu}", what, ntohs(response.msg_start),
+              be64toh(response.second_param), msg_start, second_param);
+}
+
+static void test_engine(struct engine* engine) {
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(start_server(engine)),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    int sock = socket(PF_INET, SOCK_STREAM, 0);
+
+    if (sock < 0 || connect(sock, (struct sockaddr*) &address, sizeof(address)) < 0)
+        syserr("connect");
+
+    // a lost response must fail the test rather than hang it
+    struct timeval timeout = {10, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint16_t version_request[2] = {htons(4), htons(PROTOCOL_WIDE)};
+    struct response_info version;
+
+    if (safe_write(sock, version_request, sizeof(version_request), "server") < 0)
+        fatal("cannot ask for the wide version");
+
+    read_all(sock, &version, sizeof(version));
+
+    if (ntohl(version.second_param) != PROTOCOL_WIDE)
+        fatal("%s engine did not switch to the wide version", engine->name);
+
+    uint16_t list_request = htons(1);
+    struct fl_info64 list;
+    char names[sizeof(FILE_NAME)];
+
+    if (safe_write(sock, &list_request, sizeof(list_request), "server") < 0)
+        fatal("cannot ask for the file list");
+
+    read_all(sock, &list, sizeof(list));
+
+    if (ntohs(list.msg_start) != 1 || be64toh(list.fl_len) != strlen(FILE_NAME))
+        fatal("%s engine sent a wrong list header", engine->name);
+
+    read_all(sock, names, strlen(FILE_NAME));
+
+    if (memcmp(names, FILE_NAME, strlen(FILE_NAME)) != 0)
+        fatal("%s engine sent a wrong list", engine->name);
+
+    expect(fetch(sock, 0, FILE_SIZE), 3, FILE_SIZE, "whole file");
+    expect(fetch(sock, FOUR_GIB - 4096, 8192), 3, 8192, "range crossing 4 GiB");
+    expect(fetch(sock, FILE_SIZE - 100, FOUR_GIB), 3, 100, "end of the file");
+    expect(fetch(sock, FILE_SIZE, 1), 2, 2, "begin past the end");
+
+    close(sock);
+    printf("%s engine served all ranges\n", engine->name);
+}
+
+int main(void) {
+    char dir_path[] = "/tmp/wide_testXXXXXX";
+    char file_path[sizeof(dir_path) + sizeof("/" FILE_NAME)];
+
+    if (!mkdtemp(dir_path))
+        syserr("mkdtemp");
+
+    sprintf(file_path, "%s/" FILE_NAME, dir_path);
+
+    int fd = open(file_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+    if (fd < 0 || ftruncate(fd, FILE_SIZE) < 0
+        || pwrite(fd, MARKER, MARKER_LEN, LOW_MARKER) != MARKER_LEN
+        || pwrite(fd, MARKER, MARKER_LEN, HIGH_MARKER) != MARKER_LEN || close(fd) < 0)
+        syserr("writing %s", file_path);
+
+    signal(SIGPIPE, SIG_IGN);
+    config.dir_path = dir_path;
+
+    static struct engine engines[] = {
+        {.name = "epoll", .run = run_event_loop},
+        {.name = "io_uring", .run = run_uring_loop}
+    };
+
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (engines[i].run == run_uring_loop && !uring_available()) {
+            printf("io_uring not available, skipped\n");
+            continue;
+        }
+
+        test_engine(&engines[i]);
+    }
+
+    unlink(file_path);
+    rmdir(dir_path);
+    return 0;
+}
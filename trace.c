@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "err.h"
+#include "trace.h"
+
+#define BLOCK_EVENTS 4096
+
+// about 100 MiB of spans in all
+#define MAX_BLOCKS 1024
+
+struct trace_event {
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+};
+
+// only the owner appends events and blocks, publishing used and next with
+// release stores, so that the writer sees whole events only
+struct trace_block {
+    struct trace_block* next;
+    uint32_t used;
+    struct trace_event events[BLOCK_EVENTS];
+};
+
+struct trace_thread {
+    struct trace_thread* next;
+    int tid;
+    uint64_t dropped;          // spans which did not fit
+    struct trace_block* first;
+    struct trace_block* last;
+};
+
+bool trace_enabled = false;
+
+static struct {
+    pthread_mutex_t lock;      // taken by threads adding themselves
+    pthread_mutex_t write_lock;    // one writer at a time
+    char* path;
+    uint64_t start;            // when tracing was turned on
+    struct trace_thread* threads;
+    int threads_num;
+    int blocks_num;
+} tracer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .write_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static __thread struct trace_thread* local;
+
+uint64_t trace_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// returns the spans of the calling thread, adding them on first use; NULL if
+// memory cannot be allocated
+static struct trace_thread* thread_spans(void) {
+    if (local)
+        return local;
+
+    local = calloc(1, sizeof(struct trace_thread));
+
+    if (!local)
+        return NULL;
+
+    // threads are never removed, so the writer walks the list without the lock
+    pthread_mutex_lock(&tracer.lock);
+    local->tid = ++tracer.threads_num;
+    local->next = tracer.threads;
+    __atomic_store_n(&tracer.threads, local, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&tracer.lock);
+
+    return local;
+}
+
+// returns a new block for own if the limit allows
+static struct trace_block* add_block(struct trace_thread* own) {
+    if (__atomic_add_fetch(&tracer.blocks_num, 1, __ATOMIC_RELAXED) > MAX_BLOCKS)
+        return NULL;
+
+    struct trace_block* block = calloc(1, sizeof(struct trace_block));
+
+    if (!block)
+        return NULL;
+
+    if (own->last)
+        __atomic_store_n(&own->last->next, block, __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(&own->first, block, __ATOMIC_RELEASE);
+
+    own->last = block;
+    return block;
+}
+
+void trace_span(const char* name, uint64_t start, uint64_t end) {
+    struct trace_thread* own = thread_spans();
+
+    if (!own)
+        return;
+
+    struct trace_block* block = own->last;
+
+    if ((!block || block->used == BLOCK_EVENTS) && !(block = add_block(own))) {
+        __atomic_store_n(&own->dropped, own->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    block->events[block->used] = (struct trace_event) {name, start, end};
+    __atomic_store_n(&block->used, block->used + 1, __ATOMIC_RELEASE);
+}
+
+// writes the events of own to file, starting with a comma unless *first
+static void write_thread(FILE* file, struct trace_thread* own, pid_t pid, bool* first) {
+    for (struct trace_block* block = __atomic_load_n(&own->first, __ATOMIC_ACQUIRE); block;
+         block = __atomic_load_n(&block->next, __ATOMIC_ACQUIRE)) {
+        uint32_t used = __atomic_load_n(&block->used, __ATOMIC_ACQUIRE);
+
+        for (uint32_t i = 0; i < used; i++) {
+            struct trace_event* event = &block->events[i];
+
+            // spans begun before tracing was on
+            if (event->start < tracer.start)
+                continue;
+
+            fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\","
+                          "\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    *first ? "" : ",", event->name, pid, own->tid,
+                    (event->start - tracer.start) / 1e3, (event->end - event->start) / 1e3);
+            *first = false;
+        }
+    }
+}
+
+int trace_write(void) {
+    char tmp_path[strlen(tracer.path) + sizeof(".tmp")];
+    pid_t pid = getpid();
+    uint64_t dropped = 0;
+    bool first = true;
+
+    sprintf(tmp_path, "%s.tmp", tracer.path);
+    pthread_mutex_lock(&tracer.write_lock);
+
+    FILE* file = fopen(tmp_path, "w");
+
+    if (!file) {
+        pthread_mutex_unlock(&tracer.write_lock);
+        syserr_noexit("fopen");
+        return -1;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for (struct trace_thread* own = __atomic_load_n(&tracer.threads, __ATOMIC_ACQUIRE); own;
+         own = own->next) {
+        write_thread(file, own, pid, &first);
+        dropped += __atomic_load_n(&own->dropped, __ATOMIC_RELAXED);
+    }
+
+    fprintf(file, "\n]}\n");
+
+    bool written = !ferror(file);
+
+    if (fclose(file) != 0 || !written) {
+        pthread_mutex_unlock(&tracer.write_lock);
+        syserr_noexit("writing %s", tmp_path);
+        return -1;
+    }
+
+    if (rename(tmp_path, tracer.path) < 0) {
+        pthread_mutex_unlock(&tracer.write_lock);
+        syserr_noexit("rename");
+        return -1;
+    }
+
+    pthread_mutex_unlock(&tracer.write_lock);
+
+    if (dropped > 0)
+        fprintf(stderr, "%lu spans did not fit in the trace\n", dropped);
+
+    return 0;
+}
+
+static void write_at_exit(void) {
+    trace_write();
+}
+
+// waits for the signals blocked in all threads by trace_start
+static void* handle_signals(void* arg) {
+    sigset_t* signals = arg;
+    int sig;
+
+    while (true) {
+        if (sigwait(signals, &sig) != 0)
+            continue;
+
+        trace_write();
+
+        if (sig == SIGUSR1)
+            continue;
+
+        // ended the way it would be without tracing, skipping exit handlers
+        // which might wait for busy threads
+        signal(sig, SIG_DFL);
+        pthread_sigmask(SIG_UNBLOCK, signals, NULL);
+        raise(sig);
+    }
+
+    return NULL;
+}
+
+int trace_start(char* const path) {
+    static sigset_t signals;
+    pthread_t thread;
+
+    tracer.path = path;
+    tracer.start = trace_now();
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    // threads started later inherit the mask
+    int err = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (err == 0)
+        err = pthread_create(&thread, NULL, handle_signals, &signals);
+
+    if (err != 0) {
+        pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+        errno = err;
+        syserr_noexit("pthread_create");
+        return -1;
+    }
+
+    pthread_detach(thread);
+
+    if (atexit(write_at_exit) != 0)
+        fprintf(stderr, "cannot write trace at exit\n");
+
+    trace_enabled = true;
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Timed spans of the phases of requests, written as Chrome trace-event JSON,
+ * which chrome://tracing and Perfetto open. Every thread records its spans in
+ * blocks of its own, so recording takes no locks; spans over the limit of all
+ * blocks are dropped and counted. With tracing off, a span costs a test of
+ * trace_enabled. Names of spans must be string literals. */
+
+extern bool trace_enabled;
+
+/* Returns the start time of a span, 0 with tracing off. */
+#define trace_begin() (trace_enabled ? trace_now() : 0)
+
+/* Records span name which began at start taken with trace_begin. */
+#define trace_end(name, start)                                            \
+    do {                                                                  \
+        if (trace_enabled)                                                \
+            trace_span((name), (start), trace_now());                     \
+    } while (0)
+
+/* Returns the current time in ns, of the same clock as metrics_now. */
+uint64_t trace_now(void);
+
+void trace_span(const char* name, uint64_t start, uint64_t end);
+
+/* Turns tracing on; spans are written to file path at exit, on SIGUSR1 (the
+ * program goes on then), and on SIGINT or SIGTERM, which end the program. Must
+ * be called before any other thread is started, as they all have to leave the
+ * signals to a thread made here. Returns -1 if that thread cannot be started,
+ * tracing stays off then. */
+int trace_start(char* const path);
+
+/* Writes all spans recorded so far to the trace file, replacing it as a
+ * whole. Returns -1 on failure. */
+int trace_write(void);
+
+#endif //TRACE_H
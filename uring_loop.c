@@ -0,0 +1,1372 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "err.h"
+#include "uring_loop.h"
+#include "buffer_pool.h"
+#include "fd_cache.h"
+#include "chunk_cache.h"
+#include "file_map.h"
+#include "metrics.h"
+#include "log.h"
+
+#define RING_ENTRIES 4096
+
+// batch entries checked with statx at once
+#define BATCH_STATX_WINDOW 64
+
+// largest request: type, params and name
+#define IN_BUF_SIZE (sizeof(uint16_t) + MAX_PARAMS_SIZE + MAX_PATH_LEN)
+
+// operation kinds, kept in the low bits of the completion's user_data next
+// to the connection pointer
+enum uring_op {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_OPEN,
+    OP_STATX,
+    OP_SEND_HEADER,
+    OP_BODY_IN,
+    OP_BODY_OUT,
+    OP_BATCH_STATX,
+    OP_SEND_FRAGMENT,
+    OP_CHUNK_READ,
+    OP_WAKE
+};
+
+#define OP_BITS 0xf
+
+enum uring_phase {
+    PHASE_PARSE,               // waiting for (the rest of) a request
+    PHASE_BATCH_READ,          // waiting for the rest of batch entries
+    PHASE_BATCH_CHECK,         // waiting for statx of a window of batch entries
+    PHASE_OPEN,                // waiting for openat of requested file
+    PHASE_STAT,                // waiting for statx of the opened file
+    PHASE_SEND                 // sending response header and body
+};
+
+struct uring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;         // tail including entries not yet submitted
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+// state of one client connection; new operations are issued only when none
+// are in flight, so each completion sees a consistent state
+struct connection {
+    int sock;
+    enum uring_phase phase;
+    int pending;               // operations in flight
+    bool failed;
+
+    char in_buf[IN_BUF_SIZE];
+    size_t in_len;
+
+    bool wide;                 // wide protocol version negotiated
+    uint16_t req_type;
+    uint64_t phase_start;      // when the current phase of the request began, 0
+                               // while no request is being parsed
+    struct file_request f_info;
+    char file_name[MAX_PATH_LEN + 1];
+    char* file_path;
+    size_t path_size;          // size of file_path and of each of batch_paths
+    int open_res;
+    int statx_res;
+    struct statx stx;
+    struct stat f_stat;        // of the file, from stx or the open file cache
+    uint64_t cache_generation; // taken before the file was opened
+
+    struct batch_request batch;
+    struct statx* batch_stx;   // results for the window of batch entries
+    char* batch_paths;
+    uint16_t window_len;
+
+    // response header or list
+    char header[MAX_RESPONSE_SIZE];
+    struct list_response file_list;
+    dyn_str list_buf;          // reused for list responses built on request
+    dyn_str stats_buf;         // reused for stats responses
+    char* out;
+    size_t out_left;
+    char* out_next;            // sent after out, e.g. list after its wide header
+    size_t out_next_len;
+    bool out_more;             // batch bodies follow out
+    struct cached_fragment fragment;   // header and body from the chunk cache
+    int wake_fd;               // eventfd written when chunks read for others are ready
+    uint64_t wake_count;
+
+    int file_fd;
+    struct file_map* map;      // sent from if the file is mapped
+    uint64_t prefetched;       // how far the kernel was asked to read ahead
+    int prefetch_depth;
+    bool use_splice;           // splice file to socket instead of copying
+    int pipe_fds[2];           // used for splicing file to socket
+    uint64_t file_pos;
+    uint64_t bytes_left;       // bytes of body not yet sent
+    size_t staged;             // bytes read to the pipe or buffer, not yet sent
+    size_t staged_off;         // where the staged bytes start in buffer
+    char* buffer;              // borrowed from the pool when copying file to socket
+};
+
+static int uring_setup(struct uring* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size)
+            sq_size = cq_size;
+        cq_size = sq_size;
+    }
+
+    void* sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    void* cq_ptr = sq_ptr;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_head = sq_ptr + params.sq_off.head;
+    ring->sq_tail = sq_ptr + params.sq_off.tail;
+    ring->sq_mask = sq_ptr + params.sq_off.ring_mask;
+    ring->sq_array = sq_ptr + params.sq_off.array;
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = cq_ptr + params.cq_off.head;
+    ring->cq_tail = cq_ptr + params.cq_off.tail;
+    ring->cq_mask = cq_ptr + params.cq_off.ring_mask;
+    ring->cqes = cq_ptr + params.cq_off.cqes;
+
+    return 0;
+}
+
+// publishes queued entries to the kernel and waits for at least wait_nr completions
+static int uring_submit(struct uring* ring, unsigned wait_nr) {
+    unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    while (true) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                          wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+        if (ret >= 0)
+            return 0;
+
+        if (errno == EINTR)
+            continue;
+
+        // completion queue is full; entries will be taken after it is drained
+        if (errno == EBUSY || errno == EAGAIN)
+            return 0;
+
+        syserr_noexit("io_uring_enter");
+        return -1;
+    }
+}
+
+static struct io_uring_sqe* uring_get_sqe(struct uring* ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sqe_tail - head == ring->sq_entries) {
+        // submission queue is full, hand it over to the kernel first
+        if (uring_submit(ring, 0) < 0)
+            return NULL;
+
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head == ring->sq_entries)
+            return NULL;
+    }
+
+    unsigned index = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ++ring->sqe_tail;
+    return sqe;
+}
+
+static struct io_uring_sqe* queue_op(struct uring* ring, struct connection* conn,
+                                     enum uring_op op, uint8_t opcode, int fd) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+
+    if (!sqe) {
+        fprintf(stderr, "io_uring submission queue is full\n");
+        if (conn)
+            conn->failed = true;
+        return NULL;
+    }
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t) conn | op;
+
+    if (conn)
+        ++conn->pending;
+
+    return sqe;
+}
+
+bool uring_available(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int ring_fd = syscall(__NR_io_uring_setup, 8, &params);
+    if (ring_fd < 0)
+        return false;
+
+    static const uint8_t needed_ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_OPENAT, IORING_OP_STATX,
+        IORING_OP_SPLICE, IORING_OP_READ, IORING_OP_SEND, IORING_OP_WRITEV
+    };
+
+    size_t probe_size = sizeof(struct io_uring_probe)
+                        + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probe_size);
+    bool available = probe != NULL;
+
+    if (available && syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+                             probe, IORING_OP_LAST) < 0)
+        available = false;
+
+    for (size_t i = 0; available && i < sizeof(needed_ops); i++) {
+        if (needed_ops[i] > probe->last_op
+            || !(probe->ops[needed_ops[i]].flags & IO_URING_OP_SUPPORTED))
+            available = false;
+    }
+
+    free(probe);
+    close(ring_fd);
+    return available;
+}
+
+static void queue_accept(struct uring* ring, int sock) {
+    queue_op(ring, NULL, OP_ACCEPT, IORING_OP_ACCEPT, sock);
+}
+
+static void queue_recv(struct uring* ring, struct connection* conn) {
+    struct io_uring_sqe* sqe = queue_op(ring, conn, OP_RECV, IORING_OP_RECV, conn->sock);
+
+    if (sqe) {
+        sqe->addr = (uint64_t) (conn->in_buf + conn->in_len);
+        sqe->len = IN_BUF_SIZE - conn->in_len;
+    }
+}
+
+// fills f_stat with the fields of stx asked for by queue_statx
+static void stat_from_statx(const struct statx* stx, struct stat* f_stat) {
+    memset(f_stat, 0, sizeof(struct stat));
+    f_stat->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    f_stat->st_ino = stx->stx_ino;
+    f_stat->st_mode = stx->stx_mode;
+    f_stat->st_size = stx->stx_size;
+    f_stat->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    f_stat->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+static void queue_open(struct uring* ring, struct connection* conn) {
+    struct io_uring_sqe* sqe = queue_op(ring, conn, OP_OPEN, IORING_OP_OPENAT, AT_FDCWD);
+
+    if (!sqe)
+        return;
+
+    sqe->addr = (uint64_t) conn->file_path;
+    // O_NOFOLLOW keeps symbolic links refused; O_NONBLOCK keeps opening a FIFO
+    // from waiting for a writer
+    sqe->open_flags = O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC;
+}
+
+// checks the opened file rather than its path, so that a file put in its place
+// in between is not described instead
+static void queue_statx(struct uring* ring, struct connection* conn) {
+    static char empty_path[] = "";
+    struct io_uring_sqe* sqe = queue_op(ring, conn, OP_STATX, IORING_OP_STATX, conn->file_fd);
+
+    if (!sqe)
+        return;
+
+    sqe->addr = (uint64_t) empty_path;
+    // inode and mtime are kept with the descriptor in the open file cache
+    sqe->len = STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME;
+    sqe->statx_flags = AT_EMPTY_PATH;
+    sqe->off = (uint64_t) &conn->stx;
+}
+
+// queues statx of the next window of batch entries; entries with invalid names
+// are left with an empty result, which refuses them
+static void queue_batch_statx(struct uring* ring, struct connection* conn,
+                              struct server_config* config) {
+    struct batch_request* batch = &conn->batch;
+    uint16_t left = batch->count - batch->next;
+
+    conn->window_len = left < BATCH_STATX_WINDOW ? left : BATCH_STATX_WINDOW;
+
+    for (uint16_t i = 0; i < conn->window_len; i++) {
+        uint16_t entry = batch->next + i;
+        char* file_name = batch_name(batch, entry);
+        char* path = conn->batch_paths + i * conn->path_size;
+
+        memset(&conn->batch_stx[i], 0, sizeof(struct statx));
+
+        if (!valid_file_name(file_name, batch->entries[entry].f_info.name_len))
+            continue;
+
+        struct stat f_stat;
+
+        if (fd_cache_lookup(file_name, NULL, &f_stat)) {
+            conn->batch_stx[i].stx_mask = STATX_TYPE | STATX_SIZE;
+            conn->batch_stx[i].stx_mode = f_stat.st_mode;
+            conn->batch_stx[i].stx_size = f_stat.st_size;
+            continue;
+        }
+
+        build_file_path(path, config->dir_path, file_name);
+
+        struct io_uring_sqe* sqe = queue_op(ring, conn, OP_BATCH_STATX, IORING_OP_STATX,
+                                            AT_FDCWD);
+        if (!sqe)
+            return;
+
+        sqe->addr = (uint64_t) path;
+        sqe->len = STATX_TYPE | STATX_SIZE;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->off = (uint64_t) &conn->batch_stx[i];
+    }
+}
+
+// decides about batch entries of the window whose statx completed
+static void handle_batch_statx(struct connection* conn) {
+    struct batch_request* batch = &conn->batch;
+
+    for (uint16_t i = 0; i < conn->window_len; i++) {
+        struct statx* stx = &conn->batch_stx[i];
+        bool found = stx->stx_mask != 0;
+
+        batch_decide(batch, batch->next + i, found, found && S_ISREG(stx->stx_mode),
+                     found ? stx->stx_size : 0);
+    }
+
+    batch->next += conn->window_len;
+    conn->window_len = 0;
+}
+
+// queues reading of the next body chunk and, linked to it, sending of that
+// chunk; a mapped file needs no reading, its chunk is sent from the mapping
+static void queue_body_chunk(struct uring* ring, struct connection* conn) {
+    size_t chunk_size = conn->bytes_left < MAX_CHUNK_SIZE ? conn->bytes_left
+                                                          : MAX_CHUNK_SIZE;
+    struct io_uring_sqe* sqe;
+
+    if (conn->map) {
+        file_map_advise(conn->map, conn->file_pos, conn->bytes_left);
+
+        sqe = queue_op(ring, conn, OP_BODY_OUT, IORING_OP_SEND, conn->sock);
+        if (!sqe)
+            return;
+
+        sqe->addr = (uint64_t) (file_map_data(conn->map) + conn->file_pos);
+        sqe->len = chunk_size;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        return;
+    }
+
+    // the next chunks are read while this one is sent
+    prefetch_file(conn->file_fd, conn->file_pos, conn->bytes_left, &conn->prefetched,
+                  conn->prefetch_depth);
+
+    if (conn->use_splice) {
+        sqe = queue_op(ring, conn, OP_BODY_IN, IORING_OP_SPLICE, conn->pipe_fds[1]);
+        if (!sqe)
+            return;
+
+        sqe->splice_fd_in = conn->file_fd;
+        sqe->splice_off_in = conn->file_pos;
+        sqe->off = (uint64_t) -1;
+        sqe->len = chunk_size;
+        sqe->flags |= IOSQE_IO_LINK;
+
+        sqe = queue_op(ring, conn, OP_BODY_OUT, IORING_OP_SPLICE, conn->sock);
+        if (!sqe)
+            return;
+
+        sqe->splice_fd_in = conn->pipe_fds[0];
+        sqe->splice_off_in = (uint64_t) -1;
+        sqe->off = (uint64_t) -1;
+        sqe->len = chunk_size;
+    } else {
+        sqe = queue_op(ring, conn, OP_BODY_IN, IORING_OP_READ, conn->file_fd);
+        if (!sqe)
+            return;
+
+        sqe->addr = (uint64_t) conn->buffer;
+        sqe->off = conn->file_pos;
+        sqe->len = chunk_size;
+        sqe->flags |= IOSQE_IO_LINK;
+
+        sqe = queue_op(ring, conn, OP_BODY_OUT, IORING_OP_SEND, conn->sock);
+        if (!sqe)
+            return;
+
+        sqe->addr = (uint64_t) conn->buffer;
+        sqe->len = chunk_size;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+}
+
+// queues sending of data already in the pipe or buffer, after a short write
+static void queue_staged(struct uring* ring, struct connection* conn) {
+    struct io_uring_sqe* sqe;
+
+    if (conn->use_splice) {
+        sqe = queue_op(ring, conn, OP_BODY_OUT, IORING_OP_SPLICE, conn->sock);
+        if (!sqe)
+            return;
+
+        sqe->splice_fd_in = conn->pipe_fds[0];
+        sqe->splice_off_in = (uint64_t) -1;
+        sqe->off = (uint64_t) -1;
+        sqe->len = conn->staged;
+    } else {
+        sqe = queue_op(ring, conn, OP_BODY_OUT, IORING_OP_SEND, conn->sock);
+        if (!sqe)
+            return;
+
+        sqe->addr = (uint64_t) (conn->buffer + conn->staged_off);
+        sqe->len = conn->staged;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+}
+
+// reads a chunk of the fragment missing from the chunk cache
+static void queue_chunk_read(struct uring* ring, struct connection* conn,
+                             struct iovec* buffer, uint64_t offset) {
+    struct io_uring_sqe* sqe = queue_op(ring, conn, OP_CHUNK_READ, IORING_OP_READ,
+                                        conn->file_fd);
+    if (!sqe)
+        return;
+
+    sqe->addr = (uint64_t) buffer->iov_base;
+    sqe->len = buffer->iov_len;
+    sqe->off = offset;
+}
+
+// waits for the connection's eventfd to be written when chunks of its fragment
+// read for other connections are ready
+static void queue_wake(struct uring* ring, struct connection* conn) {
+    struct io_uring_sqe* sqe = queue_op(ring, conn, OP_WAKE, IORING_OP_READ, conn->wake_fd);
+
+    if (!sqe)
+        return;
+
+    sqe->addr = (uint64_t) &conn->wake_count;
+    sqe->len = sizeof(conn->wake_count);
+}
+
+// sends what is left of a fragment from the chunk cache with one writev
+static void queue_fragment(struct uring* ring, struct connection* conn) {
+    struct io_uring_sqe* sqe = queue_op(ring, conn, OP_SEND_FRAGMENT, IORING_OP_WRITEV,
+                                        conn->sock);
+    if (!sqe)
+        return;
+
+    sqe->addr = (uint64_t) (conn->fragment.iov + conn->fragment.iov_first);
+    sqe->len = conn->fragment.iov_num - conn->fragment.iov_first;
+}
+
+// queues sending of the rest of response header or list; the first body
+// chunk is linked to it, so a whole small response costs one submission
+static void queue_header(struct uring* ring, struct connection* conn) {
+    struct io_uring_sqe* sqe = queue_op(ring, conn, OP_SEND_HEADER, IORING_OP_SEND,
+                                        conn->sock);
+    if (!sqe)
+        return;
+
+    sqe->addr = (uint64_t) conn->out;
+    sqe->len = conn->out_left;
+    sqe->msg_flags = MSG_NOSIGNAL;
+
+    // a header is held back to leave with the list or body following it
+    if (conn->out_next_len > 0 || conn->bytes_left > 0 || conn->out_more)
+        sqe->msg_flags |= MSG_MORE;
+
+    // a short send completes without error unless the whole length is waited
+    // for, and the linked body would then follow a partial header
+    if (conn->bytes_left > 0 && conn->staged == 0) {
+        sqe->msg_flags |= MSG_WAITALL;
+        sqe->flags |= IOSQE_IO_LINK;
+        queue_body_chunk(ring, conn);
+    }
+}
+
+static struct connection* conn_new(int sock, char* const dir_path) {
+    // malloc alignment of 16 bytes leaves the low bits of the pointer free
+    // for OP_BITS
+    struct connection* conn = calloc(1, sizeof(struct connection));
+
+    if (!conn)
+        return NULL;
+
+    conn->path_size = strlen(dir_path) + MAX_PATH_LEN + 2;
+    conn->file_path = malloc(conn->path_size);
+
+    if (!conn->file_path) {
+        free(conn);
+        return NULL;
+    }
+
+    conn->sock = sock;
+    conn->phase = PHASE_PARSE;
+    conn->file_fd = -1;
+    conn->wake_fd = -1;
+    conn->pipe_fds[0] = -1;
+    conn->pipe_fds[1] = -1;
+    metrics_connection_opened();
+    return conn;
+}
+
+static void conn_end_request(struct connection* conn) {
+    file_list_release(&conn->file_list);
+    batch_free(&conn->batch);
+    chunk_cache_release(&conn->fragment);
+
+    if (conn->file_fd >= 0) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+
+    buffer_put(conn->buffer);
+    conn->buffer = NULL;
+    file_map_put(conn->map);
+    conn->map = NULL;
+    conn->phase = PHASE_PARSE;
+    conn->phase_start = 0;
+}
+
+static void conn_delete(struct connection* conn) {
+    conn_end_request(conn);
+
+    if (conn->pipe_fds[0] >= 0) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+
+    // conn_end_request unregistered it from chunks being read
+    if (conn->wake_fd >= 0)
+        close(conn->wake_fd);
+
+    safe_close(conn->sock);
+    dyn_str_delete(conn->list_buf);
+    dyn_str_delete(conn->stats_buf);
+    free(conn->batch_stx);
+    free(conn->batch_paths);
+    free(conn->file_path);
+    free(conn);
+    metrics_connection_closed();
+}
+
+// prepares sending of len bytes of response starting at data
+static void set_response(struct connection* conn, void* data, size_t len) {
+    conn->out = data;
+    conn->out_left = len;
+    conn->out_next_len = 0;
+    conn->out_more = false;
+    conn->bytes_left = 0;
+    conn->staged = 0;
+    conn->phase = PHASE_SEND;
+}
+
+static int handle_list_request(struct connection* conn, struct server_config* config) {
+    log_debug("received a request for file list\n");
+
+    if (file_list_get(config->dir_path, &conn->list_buf, conn->wide, &conn->file_list) < 0)
+        return -1;
+
+    log_debug("successfully prepared file list\n");
+
+    if (conn->wide) {
+        struct fl_info64 info;
+
+        file_list_wide_header(&conn->file_list, &info);
+        memcpy(conn->header, &info, sizeof(struct fl_info64));
+        set_response(conn, conn->header, sizeof(struct fl_info64));
+        conn->out_next = conn->file_list.data;
+        conn->out_next_len = conn->file_list.size;
+        return 0;
+    }
+
+    set_response(conn, conn->file_list.data, conn->file_list.size);
+    return 0;
+}
+
+// prepares sending len bytes of the opened file starting at offset
+static int start_body(struct connection* conn, struct server_config* config,
+                      uint64_t offset, uint64_t len) {
+    conn->file_pos = offset;
+    conn->bytes_left = len;
+    conn->prefetched = 0;
+    conn->prefetch_depth = config->prefetch_depth;
+
+    // entries of a batch are sent one after another
+    file_map_put(conn->map);
+    conn->map = file_map_get(conn->file_fd, &conn->f_stat, offset + len);
+
+    if (conn->map) {
+        log_debug("sending from mapping... bytes left: %lu\n", conn->bytes_left);
+        return 0;
+    }
+
+    conn->use_splice = config->use_sendfile;
+
+    // with no free buffer in the pool, the body is spliced instead
+    if (!conn->use_splice && !conn->buffer && !(conn->buffer = buffer_get())) {
+        log_warn("no transfer buffer available, using splice instead\n");
+        conn->use_splice = true;
+    }
+
+    if (conn->use_splice && conn->pipe_fds[0] < 0) {
+        if (pipe2(conn->pipe_fds, O_CLOEXEC) < 0) {
+            syserr_noexit("pipe2");
+            return -1;
+        }
+
+        // let a whole chunk fit in the pipe; a smaller pipe only means
+        // more, shorter splices
+        fcntl(conn->pipe_fds[0], F_SETPIPE_SZ, MAX_CHUNK_SIZE);
+    }
+
+    log_debug("sending... bytes left: %lu\n", conn->bytes_left);
+    return 0;
+}
+
+// starts sending the body of a batch entry after its file was opened again;
+// the header is already sent, so the file must still hold the fragment
+static int handle_batch_file_opened(struct connection* conn, struct server_config* config) {
+    struct batch_entry* entry = &conn->batch.entries[conn->batch.next - 1];
+
+    if (conn->open_res >= 0)
+        conn->file_fd = conn->open_res;
+
+    if (conn->open_res < 0 || conn->statx_res < 0) {
+        errno = conn->open_res < 0 ? -conn->open_res : -conn->statx_res;
+        syserr_noexit("opening file of batch entry");
+        return -1;
+    }
+
+    if (!S_ISREG(conn->f_stat.st_mode)
+        || (uint64_t) conn->f_stat.st_size < entry->f_info.begin_addr + entry->body_len) {
+        fprintf(stderr, "file %s changed after its batch entry was accepted\n",
+                batch_name(&conn->batch, conn->batch.next - 1));
+        return -1;
+    }
+
+    set_response(conn, NULL, 0);
+    return start_body(conn, config, entry->f_info.begin_addr, entry->body_len);
+}
+
+// takes file file_name from the open file cache, as if its openat and statx
+// completed; on a miss notes the generation for caching the file once opened
+static bool open_from_cache(struct connection* conn, char* file_name) {
+    int fd;
+
+    if (!fd_cache_lookup(file_name, &fd, &conn->f_stat)) {
+        conn->cache_generation = fd_cache_generation();
+        return false;
+    }
+
+    conn->open_res = fd;
+    conn->statx_res = 0;
+    return true;
+}
+
+// caches the file whose openat and statx completed
+static void cache_opened_file(struct connection* conn) {
+    char* file_name = conn->req_type == 3 ? batch_name(&conn->batch, conn->batch.next - 1)
+                                          : conn->file_name;
+
+    if (conn->open_res >= 0 && conn->statx_res >= 0 && S_ISREG(conn->f_stat.st_mode))
+        fd_cache_insert(file_name, conn->open_res, &conn->f_stat, conn->cache_generation);
+}
+
+// starts sending the next accepted batch entry, or opening its file if it is
+// not cached; returns 0 if there are none left, -1 on error
+static int next_batch_entry(struct connection* conn, struct server_config* config) {
+    struct batch_request* batch = &conn->batch;
+
+    while (batch->next < batch->count && batch->entries[batch->next].body_len == 0)
+        ++batch->next;
+
+    if (batch->next == batch->count)
+        return 0;
+
+    char* file_name = batch_name(batch, batch->next);
+    ++batch->next;
+
+    if (open_from_cache(conn, file_name))
+        return handle_batch_file_opened(conn, config) < 0 ? -1 : 1;
+
+    build_file_path(conn->file_path, config->dir_path, file_name);
+    conn->phase = PHASE_OPEN;
+    return 1;
+}
+
+// sets up the response after openat and statx of the requested file completed
+static int handle_file_opened(struct connection* conn, struct server_config* config) {
+    struct file_response r_info;
+
+    if (conn->req_type == 3)
+        return handle_batch_file_opened(conn, config);
+
+    metrics_phase_done(METRICS_OPEN, conn->phase_start);
+    conn->phase_start = metrics_now();
+
+    bool found = conn->open_res >= 0 && conn->statx_res >= 0;
+
+    if (conn->open_res >= 0)
+        conn->file_fd = conn->open_res;
+
+    if (conn->open_res < 0 && conn->open_res != -ENOENT && conn->open_res != -ELOOP) {
+        errno = -conn->open_res;
+        syserr_noexit("openat");
+        return -1;
+    }
+
+    decide_file_request(&conn->f_info, found, found && S_ISREG(conn->f_stat.st_mode),
+                        found ? conn->f_stat.st_size : 0, &r_info);
+
+    size_t header_len = encode_response(&r_info, conn->wide, conn->header);
+    set_response(conn, conn->header, header_len);
+
+    if (r_info.msg_start == 3) {
+        int cached = chunk_cache_get(&conn->f_stat, conn->f_info.begin_addr,
+                                     r_info.second_param, conn->header, header_len,
+                                     &conn->fragment);
+        if (cached < 0)
+            return -1;
+
+        // the header goes out together with the fragment; in PHASE_SEND its
+        // missing chunks are read first and chunks read for others waited for
+        if (cached > 0)
+            conn->out_left = 0;
+        else if (start_body(conn, config, conn->f_info.begin_addr, r_info.second_param) < 0)
+            return -1;
+    } else if (conn->file_fd >= 0) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+
+    return 0;
+}
+
+static int handle_batch_count(struct connection* conn, uint16_t count) {
+    log_debug("received a batch request for %u files\n", count);
+
+    // nothing to answer, the next request is timed anew
+    if (count == 0) {
+        conn->phase_start = 0;
+        return 0;
+    }
+
+    if (count > MAX_BATCH_ENTRIES) {
+        log_warn("too many entries in batch request\n");
+        return -1;
+    }
+
+    if (!conn->batch_stx) {
+        conn->batch_stx = malloc(BATCH_STATX_WINDOW * sizeof(struct statx));
+        conn->batch_paths = malloc(BATCH_STATX_WINDOW * conn->path_size);
+
+        if (!conn->batch_stx || !conn->batch_paths) {
+            fprintf(stderr, "malloc for batch request failed\n");
+            return -1;
+        }
+    }
+
+    if (batch_init(&conn->batch, count, conn->wide) < 0)
+        return -1;
+
+    conn->phase = PHASE_BATCH_READ;
+    return 0;
+}
+
+static int handle_stats_request(struct connection* conn) {
+    log_debug("received a request for stats\n");
+
+    if (metrics_response(&conn->stats_buf) < 0)
+        return -1;
+
+    set_response(conn, conn->stats_buf->str, conn->stats_buf->used - 1);
+    return 0;
+}
+
+// operations of a connection are issued one after another, so frames of
+// several requests are not interleaved and framing is not offered
+static void handle_version_request(struct connection* conn, uint16_t client_version) {
+    struct file_response r_info;
+    uint16_t version = choose_version(client_version, false);
+
+    log_debug("client speaks protocol version %u, using %u\n", client_version, version);
+
+    r_info.msg_start = 4;
+    r_info.second_param = version;
+    conn->wide = version == PROTOCOL_WIDE;
+    set_response(conn, conn->header, encode_response(&r_info, false, conn->header));
+}
+
+// takes whole batch entries from the buffer; returns 1 when all entries of
+// the batch were read, 0 if more data is needed
+static int parse_batch_entries(struct connection* conn) {
+    struct batch_request* batch = &conn->batch;
+    size_t params_size = file_params_size(conn->wide);
+    size_t consumed = 0;
+    int ret = 1;
+
+    while (batch->added < batch->count) {
+        struct file_request f_info;
+        char* entry = conn->in_buf + consumed;
+        size_t available = conn->in_len - consumed;
+
+        if (available < params_size) {
+            ret = 0;
+            break;
+        }
+
+        decode_file_params(entry, conn->wide, &f_info);
+
+        if (f_info.name_len > MAX_PATH_LEN) {
+            log_warn("the name requested by client is too long\n");
+            return -1;
+        }
+
+        if (available < params_size + f_info.name_len) {
+            ret = 0;
+            break;
+        }
+
+        if (batch_add(batch, &f_info, entry + params_size) < 0)
+            return -1;
+
+        consumed += params_size + f_info.name_len;
+    }
+
+    memmove(conn->in_buf, conn->in_buf + consumed, conn->in_len - consumed);
+    conn->in_len -= consumed;
+    return ret;
+}
+
+// parses as many bytes of the buffered request as possible; returns 1 if a
+// whole request was taken and its processing started, 0 if more data is needed
+static int parse_request(struct connection* conn, struct server_config* config) {
+    size_t params_end = sizeof(uint16_t) + file_params_size(conn->wide);
+    size_t consumed;
+
+    while (true) {
+        if (conn->in_len < sizeof(uint16_t))
+            return 0;
+
+        // the request is timed from when its type came
+        if (conn->phase_start == 0)
+            conn->phase_start = metrics_now();
+
+        memcpy(&conn->req_type, conn->in_buf, sizeof(uint16_t));
+        conn->req_type = ntohs(conn->req_type);
+
+        if (conn->req_type == 1) {
+            consumed = sizeof(uint16_t);
+
+            if (handle_list_request(conn, config) < 0)
+                return -1;
+            break;
+        } else if (conn->req_type == 2) {
+            if (conn->in_len < params_end)
+                return 0;
+
+            decode_file_params(conn->in_buf + sizeof(uint16_t), conn->wide, &conn->f_info);
+
+            if (conn->f_info.name_len > MAX_PATH_LEN) {
+                log_warn("the name requested by client is too long\n");
+                return -1;
+            }
+
+            if (conn->in_len < params_end + conn->f_info.name_len)
+                return 0;
+
+            consumed = params_end + conn->f_info.name_len;
+            memcpy(conn->file_name, conn->in_buf + params_end, conn->f_info.name_len);
+            conn->file_name[conn->f_info.name_len] = '\0';
+
+            log_debug("received a request for file, checking params validity\n");
+            metrics_phase_done(METRICS_PARSE, conn->phase_start);
+            conn->phase_start = metrics_now();
+
+            if (!valid_file_name(conn->file_name, conn->f_info.name_len)) {
+                conn->open_res = -ENOENT;
+                conn->statx_res = -ENOENT;
+            } else if (!open_from_cache(conn, conn->file_name)) {
+                build_file_path(conn->file_path, config->dir_path, conn->file_name);
+                conn->phase = PHASE_OPEN;
+                break;
+            }
+
+            if (handle_file_opened(conn, config) < 0)
+                return -1;
+            break;
+        } else if (conn->req_type == 3) {
+            uint16_t count;
+
+            if (conn->in_len < 2 * sizeof(uint16_t))
+                return 0;
+
+            memcpy(&count, conn->in_buf + sizeof(uint16_t), sizeof(uint16_t));
+            consumed = 2 * sizeof(uint16_t);
+
+            if (handle_batch_count(conn, ntohs(count)) < 0)
+                return -1;
+            break;
+        } else if (conn->req_type == 4) {
+            uint16_t version;
+
+            if (conn->in_len < 2 * sizeof(uint16_t))
+                return 0;
+
+            memcpy(&version, conn->in_buf + sizeof(uint16_t), sizeof(uint16_t));
+            consumed = 2 * sizeof(uint16_t);
+            handle_version_request(conn, ntohs(version));
+            break;
+        } else if (conn->req_type == 5) {
+            consumed = sizeof(uint16_t);
+            break;
+        } else {
+            metrics_count_request(conn->req_type);
+            conn->phase_start = 0;
+            log_warn("invalid request format\n");
+            memmove(conn->in_buf, conn->in_buf + sizeof(uint16_t),
+                    conn->in_len - sizeof(uint16_t));
+            conn->in_len -= sizeof(uint16_t);
+        }
+    }
+
+    metrics_count_request(conn->req_type);
+
+    // the stats include the request asking for them
+    if (conn->req_type == 5 && handle_stats_request(conn) < 0)
+        return -1;
+
+    // clients may send the next request before this one is answered
+    memmove(conn->in_buf, conn->in_buf + consumed, conn->in_len - consumed);
+    conn->in_len -= consumed;
+    return 1;
+}
+
+// returns 1 if all chunks of the connection's fragment are ready, 0 if its
+// eventfd is to be read until chunks read for other connections are, and -1
+// on error
+static int fragment_wait_uring(struct connection* conn) {
+    // blocking, so that the read waits for the eventfd to be written
+    if (conn->wake_fd < 0 && (conn->wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        syserr_noexit("eventfd");
+        return -1;
+    }
+
+    return fragment_wait(&conn->fragment, conn->wake_fd);
+}
+
+// issues the next operations of a connection which has none in flight;
+// returns -1 if the connection should be closed
+static int conn_advance(struct uring* ring, struct connection* conn,
+                        struct server_config* config) {
+    while (!conn->failed) {
+        switch (conn->phase) {
+            case PHASE_PARSE: {
+                int ret = parse_request(conn, config);
+
+                if (ret < 0)
+                    return -1;
+
+                if (ret == 0) {
+                    queue_recv(ring, conn);
+                    return 0;
+                }
+
+                if (conn->phase == PHASE_OPEN) {
+                    queue_open(ring, conn);
+                    return 0;
+                }
+                break;
+            }
+
+            case PHASE_BATCH_READ: {
+                int ret = parse_batch_entries(conn);
+
+                if (ret < 0)
+                    return -1;
+
+                if (ret == 0) {
+                    queue_recv(ring, conn);
+                    return 0;
+                }
+
+                metrics_phase_done(METRICS_PARSE, conn->phase_start);
+                conn->phase_start = metrics_now();
+                conn->batch.next = 0;
+                conn->phase = PHASE_BATCH_CHECK;
+                break;
+            }
+
+            case PHASE_BATCH_CHECK:
+                handle_batch_statx(conn);
+
+                if (conn->batch.next < conn->batch.count) {
+                    queue_batch_statx(ring, conn, config);
+
+                    if (conn->pending > 0)
+                        return 0;
+                    break;
+                }
+
+                metrics_phase_done(METRICS_OPEN, conn->phase_start);
+                conn->phase_start = metrics_now();
+
+                // bodies follow all headers, starting from the first entry
+                set_response(conn, conn->batch.headers,
+                             conn->batch.count * conn->batch.header_size);
+                conn->out_more = batch_has_bodies(&conn->batch);
+                conn->batch.next = 0;
+                break;
+
+            case PHASE_OPEN:
+                if (conn->open_res >= 0) {
+                    conn->file_fd = conn->open_res;
+                    conn->phase = PHASE_STAT;
+                    queue_statx(ring, conn);
+                    return 0;
+                }
+
+                // a file which cannot be opened is refused without statx
+                // fall through
+            case PHASE_STAT:
+                cache_opened_file(conn);
+
+                if (handle_file_opened(conn, config) < 0)
+                    return -1;
+                break;
+
+            case PHASE_SEND: {
+                struct iovec buffer;
+                uint64_t offset;
+
+                // one read at a time, as completions do not tell chunks apart
+                if (fragment_next_read(&conn->fragment, &buffer, &offset)) {
+                    queue_chunk_read(ring, conn, &buffer, offset);
+                    return 0;
+                }
+
+                if (conn->fragment.iov_first < conn->fragment.iov_num) {
+                    int ret = fragment_wait_uring(conn);
+
+                    if (ret < 0)
+                        return -1;
+
+                    if (ret == 0)
+                        queue_wake(ring, conn);
+                    else
+                        queue_fragment(ring, conn);
+                    return 0;
+                }
+
+                if (conn->out_left > 0) {
+                    queue_header(ring, conn);
+                    return 0;
+                }
+
+                if (conn->out_next_len > 0) {
+                    conn->out = conn->out_next;
+                    conn->out_left = conn->out_next_len;
+                    conn->out_next_len = 0;
+                    break;
+                }
+
+                if (conn->staged > 0) {
+                    queue_staged(ring, conn);
+                    return 0;
+                }
+
+                if (conn->bytes_left > 0) {
+                    queue_body_chunk(ring, conn);
+                    return 0;
+                }
+
+                if (conn->req_type == 3) {
+                    if (conn->file_fd >= 0) {
+                        log_debug("successfully sent requested file fragment\n");
+                        close(conn->file_fd);
+                        conn->file_fd = -1;
+                    }
+
+                    int ret = next_batch_entry(conn, config);
+
+                    if (ret < 0)
+                        return -1;
+
+                    if (ret > 0 && conn->phase == PHASE_OPEN) {
+                        queue_open(ring, conn);
+                        return 0;
+                    }
+
+                    // the next entry's file was cached, its body is being sent
+                    if (ret > 0)
+                        break;
+
+                    metrics_phase_done(METRICS_SEND, conn->phase_start);
+                    log_debug("successfully sent batch response\n");
+                } else if (conn->req_type == 1) {
+                    log_debug("successfully sent whole list, waiting for request\n");
+                } else if (conn->req_type == 4) {
+                    log_debug("successfully sent version response\n");
+                } else if (conn->req_type == 5) {
+                    log_debug("successfully sent stats\n");
+                } else if (conn->file_fd >= 0) {
+                    metrics_phase_done(METRICS_SEND, conn->phase_start);
+                    log_debug("successfully sent requested file fragment\n");
+                } else {
+                    metrics_phase_done(METRICS_SEND, conn->phase_start);
+                    log_debug("successfully sent response info (refuse)\n");
+                }
+
+                conn_end_request(conn);
+                break;
+            }
+        }
+    }
+
+    return -1;
+}
+
+// records the result of a finished operation in the connection's state
+static void conn_complete(struct connection* conn, enum uring_op op, int res) {
+    --conn->pending;
+
+    // operation was linked to one which failed or wrote less than asked;
+    // the state below says what is left to do
+    if (res == -ECANCELED)
+        return;
+
+    switch (op) {
+        case OP_RECV:
+            if (res == 0) {
+                log_info("client has disconnected\n");
+                conn->failed = true;
+            } else if (res < 0) {
+                errno = -res;
+                syserr_noexit("reading from client socket");
+                conn->failed = true;
+            } else {
+                conn->in_len += res;
+            }
+            break;
+
+        case OP_OPEN:
+            conn->open_res = res;
+            break;
+
+        case OP_STATX:
+            conn->statx_res = res;
+            if (res >= 0)
+                stat_from_statx(&conn->stx, &conn->f_stat);
+            break;
+
+        case OP_BATCH_STATX:
+            // the entry is refused, as its result is left empty
+            if (res < 0 && res != -ENOENT) {
+                errno = -res;
+                syserr_noexit("statx");
+            }
+            break;
+
+        case OP_WAKE:
+            if (res < 0) {
+                errno = -res;
+                syserr_noexit("reading eventfd");
+                conn->failed = true;
+            }
+            break;
+
+        case OP_CHUNK_READ:
+            if (fragment_read_done(&conn->fragment, res) < 0)
+                conn->failed = true;
+            break;
+
+        case OP_SEND_FRAGMENT:
+            if (res <= 0) {
+                errno = -res;
+                syserr_noexit("writing to client socket");
+                conn->failed = true;
+                break;
+            }
+
+            metrics_add_sent(res);
+            fragment_advance(&conn->fragment, res);
+            break;
+
+        case OP_SEND_HEADER:
+            if (res <= 0) {
+                errno = -res;
+                syserr_noexit("writing to client socket");
+                conn->failed = true;
+                break;
+            }
+
+            metrics_add_sent(res);
+            conn->out += res;
+            conn->out_left -= res;
+            break;
+
+        case OP_BODY_IN:
+            if (res <= 0) {
+                errno = res < 0 ? -res : 0;
+                if (res < 0)
+                    syserr_noexit("reading requested file");
+                else
+                    fprintf(stderr, "file ended before requested fragment was sent\n");
+                conn->failed = true;
+                break;
+            }
+
+            conn->staged = res;
+            conn->staged_off = 0;
+            conn->file_pos += res;
+            break;
+
+        case OP_BODY_OUT:
+            if (res <= 0) {
+                errno = -res;
+                syserr_noexit("writing to client socket");
+                conn->failed = true;
+                break;
+            }
+
+            // sends from a mapping are not staged
+            if (conn->map) {
+                conn->file_pos += res;
+            } else {
+                conn->staged -= res;
+                conn->staged_off += res;
+            }
+
+            metrics_add_sent(res);
+            conn->bytes_left -= res;
+            break;
+
+        default:
+            break;
+    }
+}
+
+int run_uring_loop(int sock, struct server_config* config) {
+    struct uring ring;
+
+    if (uring_setup(&ring, RING_ENTRIES) < 0) {
+        syserr_noexit("io_uring_setup");
+        return -1;
+    }
+
+    queue_accept(&ring, sock);
+
+    while (true) {
+        if (uring_submit(&ring, 1) < 0)
+            return -1;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            struct connection* conn = (struct connection*) (cqe->user_data & ~(uint64_t) OP_BITS);
+            enum uring_op op = cqe->user_data & OP_BITS;
+            int res = cqe->res;
+
+            if (op == OP_ACCEPT) {
+                queue_accept(&ring, sock);
+
+                if (res < 0) {
+                    errno = -res;
+                    syserr_noexit("accept");
+                    continue;
+                }
+
+                set_nodelay(res);
+                conn = conn_new(res, config->dir_path);
+
+                if (!conn) {
+                    fprintf(stderr, "malloc for connection failed\n");
+                    safe_close(res);
+                    continue;
+                }
+
+                log_info("connection accepted, waiting for request\n");
+            } else {
+                conn_complete(conn, op, res);
+            }
+
+            if (conn->pending > 0)
+                continue;
+
+            if (conn->failed || conn_advance(&ring, conn, config) < 0) {
+                // queueing may have failed halfway; wait for what got queued
+                if (conn->pending == 0)
+                    conn_delete(conn);
+                else
+                    conn->failed = true;
+            }
+        }
+
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
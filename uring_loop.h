@@ -0,0 +1,15 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include "requests.h"
+
+/* Checks whether io_uring with all operations used by run_uring_loop is
+ * available in the running kernel. */
+bool uring_available(void);
+
+/* Serves all clients of listening socket sock from a single thread, driving
+ * accept, receive, open, stat and send operations through an io_uring.
+ * Returns only on fatal error. */
+int run_uring_loop(int sock, struct server_config* config);
+
+#endif //URING_LOOP_H
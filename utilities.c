@@ -1,12 +1,19 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "utilities.h"
 #include "err.h"
+#include "log.h"
 
 void safe_close(int sock) {
-    printf("ending connection\n\n");
+    log_info("ending connection\n\n");
 
     if (close(sock) < 0)
         syserr_noexit("close");
@@ -23,7 +30,7 @@ int safe_read(int sock, void* buffer, size_t count, char* const who) {
         len = read(sock, buffer + offset, chunk_size);
 
         if (len == 0) {
-            printf("%s has disconnected\n", who);
+            log_info("%s has disconnected\n", who);
             return -1;
         }
 
@@ -39,7 +46,8 @@ int safe_read(int sock, void* buffer, size_t count, char* const who) {
     return 0;
 }
 
-int safe_write(int sock, void* buffer, size_t count, char* const who) {
+// writes count bytes of buffer to sock, passing flags to send
+static int send_all(int sock, void* buffer, size_t count, int flags, char* const who) {
     ssize_t len;
     uint64_t bytes_left = count;
     uint64_t offset = 0;
@@ -47,10 +55,10 @@ int safe_write(int sock, void* buffer, size_t count, char* const who) {
 
     do {
         chunk_size = bytes_left < MAX_CHUNK_SIZE ? bytes_left : MAX_CHUNK_SIZE;
-        len = write(sock, buffer + offset, chunk_size);
+        len = send(sock, buffer + offset, chunk_size, flags);
 
         if (len == 0) {
-            printf("%s has disconnected\n", who);
+            log_info("%s has disconnected\n", who);
             return -1;
         }
 
@@ -66,6 +74,256 @@ int safe_write(int sock, void* buffer, size_t count, char* const who) {
     return 0;
 }
 
+int safe_write(int sock, void* buffer, size_t count, char* const who) {
+    return send_all(sock, buffer, count, 0, who);
+}
+
+int safe_write_more(int sock, void* buffer, size_t count, char* const who) {
+    return send_all(sock, buffer, count, MSG_MORE, who);
+}
+
+// moves *iov and *iovcnt past len bytes
+static void iov_skip(struct iovec** iov, int* iovcnt, size_t len) {
+    while (*iovcnt > 0 && len >= (*iov)->iov_len) {
+        len -= (*iov)->iov_len;
+        ++*iov;
+        --*iovcnt;
+    }
+
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char*) (*iov)->iov_base + len;
+        (*iov)->iov_len -= len;
+    }
+}
+
+int safe_writev(int sock, struct iovec* iov, int iovcnt, char* const who) {
+    ssize_t len;
+
+    // leading empty buffers would make writev return 0
+    iov_skip(&iov, &iovcnt, 0);
+
+    while (iovcnt > 0) {
+        len = writev(sock, iov, iovcnt);
+
+        if (len == 0) {
+            log_info("%s has disconnected\n", who);
+            return -1;
+        }
+
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+
+            syserr_noexit("writing to %s socket", who);
+            return -1;
+        }
+
+        iov_skip(&iov, &iovcnt, len);
+    }
+
+    return 0;
+}
+
+int set_nonblocking(int sock) {
+    int flags = fcntl(sock, F_GETFL, 0);
+
+    if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+        syserr_noexit("fcntl");
+        return -1;
+    }
+
+    return 0;
+}
+
+int nb_read(int sock, void* buffer, size_t count, size_t* done, char* const who) {
+    ssize_t len;
+
+    while (*done < count) {
+        len = read(sock, buffer + *done, count - *done);
+
+        if (len == 0) {
+            log_info("%s has disconnected\n", who);
+            return PEER_CLOSED;
+        }
+
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            if (errno == EINTR)
+                continue;
+
+            syserr_noexit("reading from %s socket", who);
+            return -1;
+        }
+
+        *done += len;
+    }
+
+    return 1;
+}
+
+// non-blocking send_all
+static int nb_send(int sock, void* buffer, size_t count, size_t* done, int flags,
+                   char* const who) {
+    ssize_t len;
+
+    while (*done < count) {
+        len = send(sock, buffer + *done, count - *done, flags);
+
+        if (len == 0) {
+            log_info("%s has disconnected\n", who);
+            return -1;
+        }
+
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            if (errno == EINTR)
+                continue;
+
+            syserr_noexit("writing to %s socket", who);
+            return -1;
+        }
+
+        *done += len;
+    }
+
+    return 1;
+}
+
+int nb_write(int sock, void* buffer, size_t count, size_t* done, char* const who) {
+    return nb_send(sock, buffer, count, done, 0, who);
+}
+
+int nb_write_more(int sock, void* buffer, size_t count, size_t* done, char* const who) {
+    return nb_send(sock, buffer, count, done, MSG_MORE, who);
+}
+
+int nb_writev(int sock, struct iovec* iov, int iovcnt, size_t* done, char* const who) {
+    ssize_t len;
+
+    iov_skip(&iov, &iovcnt, *done);
+
+    while (iovcnt > 0) {
+        len = writev(sock, iov, iovcnt);
+
+        if (len == 0) {
+            log_info("%s has disconnected\n", who);
+            return -1;
+        }
+
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            if (errno == EINTR)
+                continue;
+
+            syserr_noexit("writing to %s socket", who);
+            return -1;
+        }
+
+        *done += len;
+        iov_skip(&iov, &iovcnt, len);
+    }
+
+    return 1;
+}
+
+int set_nodelay(int sock) {
+    int one = 1;
+
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+        syserr_noexit("setsockopt");
+        return -1;
+    }
+
+    return 0;
+}
+
+int safe_sendfile(int sock, int fd, uint64_t* offset, size_t count, char* const who) {
+    size_t done = 0;
+    ssize_t len;
+
+    while (done < count) {
+        off_t off = *offset;
+        len = sendfile(sock, fd, &off, count - done);
+
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if ((errno == EINVAL || errno == ENOSYS) && done == 0)
+                return SENDFILE_UNSUPPORTED;
+
+            syserr_noexit("sending file to %s socket", who);
+            return -1;
+        }
+
+        if (len == 0) {
+            fprintf(stderr, "file ended before requested fragment was sent\n");
+            return -1;
+        }
+
+        *offset += len;
+        done += len;
+    }
+
+    return 0;
+}
+
+int nb_sendfile(int sock, int fd, uint64_t* offset, size_t count, size_t* done,
+                char* const who) {
+    ssize_t len;
+
+    while (*done < count) {
+        off_t off = *offset;
+        len = sendfile(sock, fd, &off, count - *done);
+
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EINVAL || errno == ENOSYS)
+                return SENDFILE_UNSUPPORTED;
+
+            syserr_noexit("sending file to %s socket", who);
+            return -1;
+        }
+
+        if (len == 0) {
+            fprintf(stderr, "file ended before requested fragment was sent\n");
+            return -1;
+        }
+
+        *offset += len;
+        *done += len;
+    }
+
+    return 1;
+}
+
+void prefetch_file(int fd, uint64_t pos, uint64_t len, uint64_t* prefetched, int depth) {
+    uint64_t ahead = (uint64_t) depth * MAX_CHUNK_SIZE;
+    uint64_t target = pos + (len < ahead ? len : ahead);
+
+    if (*prefetched < pos)
+        *prefetched = pos;
+
+    // asked for a chunk at a time, so that short sends cost no extra calls
+    if (target <= *prefetched || (target - *prefetched < MAX_CHUNK_SIZE && target < pos + len))
+        return;
+
+    // only a hint: a failure just leaves reading to the transfer itself
+    posix_fadvise(fd, *prefetched, target - *prefetched, POSIX_FADV_WILLNEED);
+    *prefetched = target;
+}
+
 void parse_port(char* const str, uint16_t* port_num) {
     errno = 0;
     char* endptr;
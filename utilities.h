@@ -1,10 +1,18 @@
+#ifndef UTILITIES_H
+#define UTILITIES_H
+
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <endian.h>
 
 #define MAX_PATH_LEN 256
 #define MAX_CHUNK_SIZE (512*1024)
 #define DEFAULT_PORT_NUM 6543
 
+// most entries in one batch request (req_type 3)
+#define MAX_BATCH_ENTRIES 16384
+
 struct __attribute__((__packed__)) f_req_params {
     uint32_t begin_addr;
     uint32_t part_len;
@@ -21,12 +29,109 @@ struct __attribute__((__packed__)) response_info {
     uint32_t second_param;
 };
 
+/* Messages of the wide protocol version: as above, with 64-bit offsets,
+ * lengths and list sizes. */
+struct __attribute__((__packed__)) f_req_params64 {
+    uint64_t begin_addr;
+    uint64_t part_len;
+    uint16_t name_len;
+};
+
+struct __attribute__((__packed__)) fl_info64 {
+    uint16_t msg_start;
+    uint64_t fl_len;
+};
+
+struct __attribute__((__packed__)) response_info64 {
+    uint16_t msg_start;
+    uint64_t second_param;
+};
+
+/* Versions of the protocol, negotiated with req_type 4 followed by the highest
+ * version the client speaks; the server answers with response_info
+ * {4, chosen version}, the highest version it supports up to the client's.
+ * Connections start with the classic version; the version response itself
+ * is always classic. */
+#define PROTOCOL_CLASSIC 1
+#define PROTOCOL_FRAMED  2
+#define PROTOCOL_WIDE    3     // classic requests with 64-bit messages, unframed
+
+/* req_type 5 asks for the server's counters and latencies; it is answered
+ * with response_info {5, length of the text} followed by the text, lines
+ * "<name> <value>". The response is classic in every version; framed
+ * connections cannot ask for it. */
+
+/* In the framed version every request is preceded by a uint32_t request id
+ * chosen by the client, and every message from the server is a frame: this
+ * header and len bytes of payload. A FRAME_RESPONSE carries the classic
+ * response to the request (the file list or response_info); FRAME_DATA frames
+ * carry the body of an accepted file request in order, interleaved with frames
+ * of other requests. */
+struct __attribute__((__packed__)) frame_header {
+    uint32_t request_id;
+    uint16_t kind;
+    uint32_t len;
+};
+
+#define FRAME_RESPONSE 1
+#define FRAME_DATA     2
+
+// largest payload of a data frame
+#define FRAME_DATA_SIZE (64*1024)
+
 void safe_close(int sock);
 
 int safe_read(int sock, void* buffer, size_t count, char* const who);
 
 int safe_write(int sock, void* buffer, size_t count, char* const who);
 
-void parse_port(char* const str, uint16_t* port_num);
+/* As safe_write, with MSG_MORE: the data is held back until the next write to
+ * sock, so a response header leaves in one segment with its body. The next
+ * write must follow without waiting for the client. */
+int safe_write_more(int sock, void* buffer, size_t count, char* const who);
+
+/* Writes all buffers of iov with as few calls as possible, so that e.g. a
+ * header and its payload go out together. iov is modified. */
+int safe_writev(int sock, struct iovec* iov, int iovcnt, char* const who);
+
+int set_nonblocking(int sock);
+
+/* Non-blocking variants: *done holds progress between calls.
+ * Return 1 when all count bytes are transferred, 0 when the socket would block
+ * and -1 on error. nb_read returns PEER_CLOSED, also below 0, when the other
+ * end has shut down sending before count bytes were read. */
+#define PEER_CLOSED (-3)
+
+int nb_read(int sock, void* buffer, size_t count, size_t* done, char* const who);
+
+int nb_write(int sock, void* buffer, size_t count, size_t* done, char* const who);
+
+int nb_write_more(int sock, void* buffer, size_t count, size_t* done, char* const who);
 
+/* *done counts bytes of all buffers of iov together. iov is modified. */
+int nb_writev(int sock, struct iovec* iov, int iovcnt, size_t* done, char* const who);
+
+/* Turns off Nagle's algorithm, which would hold the last short segment of a
+ * response until the client acknowledges the previous one, and the client
+ * delays its acknowledgement waiting for more data. */
+int set_nodelay(int sock);
+
+#define SENDFILE_UNSUPPORTED (-2)
+
+/* Send count bytes of file fd starting at *offset straight from the page cache,
+ * advancing *offset. Return SENDFILE_UNSUPPORTED, with nothing sent, if fd
+ * cannot be used with sendfile; the caller should then copy the data itself. */
+int safe_sendfile(int sock, int fd, uint64_t* offset, size_t count, char* const who);
+
+int nb_sendfile(int sock, int fd, uint64_t* offset, size_t count, size_t* done,
+                char* const who);
+
+/* Asks the kernel to read depth chunks of MAX_CHUNK_SIZE bytes of file fd
+ * ahead of a transfer at pos with len bytes left, so that the disk works
+ * while the current chunk is sent. *prefetched keeps how far the file has
+ * been asked for; it should be 0 when the transfer starts. */
+void prefetch_file(int fd, uint64_t pos, uint64_t len, uint64_t* prefetched, int depth);
+
+void parse_port(char* const str, uint16_t* port_num);
 
+#endif //UTILITIES_H